@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+
+#include "capture.h"
+#include "startupprofile.h"
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+
+using namespace std;
+
+static const char* DriverName = "unicam";
+
+SV4l2Source::SV4l2Source(const string& name) :
+    Name(name),
+    Fd(-1),
+    Caps()
+{
+}
+
+bool SV4l2Source::Open()
+{
+    // Non blocking, VIDIOC_DQBUF returns EAGAIN when no buffer is ready
+    Fd = open(Name.c_str(), O_RDWR | O_NONBLOCK);
+    if (Fd >= 0 && !Caps.Open(Fd))
+    {
+        close(Fd);
+        Fd = -1;
+    }
+    return Fd >= 0;
+}
+
+void SV4l2Source::Close()
+{
+    if (Fd >= 0)
+    {
+        Caps.Close();
+        close(Fd);
+    }
+    Fd = -1;
+}
+
+const string& SV4l2Source::GetName() const
+{
+    return Name;
+}
+
+int SV4l2Source::GetFd() const
+{
+    return Fd;
+}
+
+bool SV4l2Source::SubscribeSourceChange()
+{
+    struct v4l2_event_subscription sub;
+    CLEAR(sub);
+    sub.type = V4L2_EVENT_SOURCE_CHANGE;
+    int retVal = ioctl(Fd, VIDIOC_SUBSCRIBE_EVENT, &sub);
+    if (retVal != 0)
+    {
+        printf("VIDIOC_SUBSCRIBE_EVENT: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+vector<uint32_t> SV4l2Source::GetFormats()
+{
+    return Caps.GetFormats(V4L2_BUF_TYPE_VIDEO_CAPTURE, "V4L2 capture");
+}
+
+// Fixed timings, the driver adjusts the requested size to what it supports
+bool SV4l2Source::SetupTimings(tstFormat& /*format*/)
+{
+    return true;
+}
+
+bool SV4l2Source::SetupFormat(tstFormat& format)
+{
+    bool result = true;
+    int retVal;
+
+    Caps.GetFormats(V4L2_BUF_TYPE_VIDEO_CAPTURE, "V4L2 capture");
+
+    // v4l2-ctl -d /dev/video0 --list-formats
+    // [0]: 'RGB3' (24-bit RGB 8-8-8)
+    // [3]: 'UYVY' (UYVY 4:2:2)
+    uint32_t pixelFormat = format.Uyvy ?
+        V4L2_PIX_FMT_UYVY : // v4l2_fourcc('U', 'Y', 'V', 'Y') 16  YUV 4:2:2
+        V4L2_PIX_FMT_RGB24; // v4l2_fourcc('R', 'G', 'B', '3') 24  RGB-8-8-8
+    struct v4l2_format fmt;
+    CLEAR(fmt);
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    bool cached = Caps.FindFormat(fmt.type, format.Width, format.Height, pixelFormat, fmt);
+    retVal = cached ? 0 : ioctl(Fd, VIDIOC_G_FMT, &fmt);
+    if (retVal != 0)
+    {
+        result = false;
+        printf("VIDIOC_G_FMT: %s\n", strerror(errno));
+    }
+    else
+    {
+        fmt.fmt.pix.width = format.Width;
+        fmt.fmt.pix.height = format.Height;
+        fmt.fmt.pix.pixelformat = pixelFormat;
+        fmt.fmt.pix.field = V4L2_FIELD_NONE;
+        struct v4l2_format request = fmt;
+        retVal = ioctl(Fd, VIDIOC_S_FMT, &fmt);
+        if (retVal != 0)
+        {
+            result = false;
+            printf("VIDIOC_S_FMT: %s\n", strerror(errno));
+        }
+        else
+        {
+            retVal = cached ? 0 : ioctl(Fd, VIDIOC_G_FMT, &fmt); // S_FMT already returns the format set
+            if (retVal != 0)
+            {
+                result = false;
+                printf("VIDIOC_G_FMT: %s\n", strerror(errno));
+            }
+            else
+            {
+                Caps.StoreFormat(format.Width, format.Height, pixelFormat, request, fmt);
+                printf("V4L capture (final): width = %u, height = %u, 4cc = %.4s\n",
+                    fmt.fmt.pix.width, fmt.fmt.pix.height,
+                    (char*)&fmt.fmt.pix.pixelformat);
+                format.Width = fmt.fmt.pix.width;
+                format.Height = fmt.fmt.pix.height;
+                format.BytesPerLine = fmt.fmt.pix.bytesperline;
+                format.Uyvy = fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_UYVY;
+                // The tc358743 reports REC709 for HD and SMPTE170M for SD timings, limited range by default
+                format.Bt709 = fmt.fmt.pix.ycbcr_enc == V4L2_YCBCR_ENC_709 ||
+                    (fmt.fmt.pix.ycbcr_enc == V4L2_YCBCR_ENC_DEFAULT && fmt.fmt.pix.colorspace != V4L2_COLORSPACE_SMPTE170M);
+                format.FullRange = fmt.fmt.pix.quantization == V4L2_QUANTIZATION_FULL_RANGE;
+            }
+        }
+    }
+    return result;
+}
+
+unsigned SV4l2Source::AllocBuffers(unsigned count, vector<int>& dmaFd, vector<unsigned>& length)
+{
+    int retVal;
+
+    // Export
+    SStartupPhase phase("REQBUFS V4L capture");
+    struct v4l2_requestbuffers req;
+    CLEAR(req);
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    req.count = count;
+    retVal = ioctl(Fd, VIDIOC_REQBUFS, &req);
+    if (retVal != 0)
+    {
+        printf("VIDIOC_REQBUFS: %s\n", strerror(errno));
+        return 0;
+    }
+    printf("VIDIOC_REQBUFS export: num %d, %s, %s\n", req.count, req.type == V4L2_BUF_TYPE_VIDEO_CAPTURE ? "V4L2_BUF_TYPE_VIDEO_CAPTURE" : "type error", req.memory == V4L2_MEMORY_MMAP ? "V4L2_MEMORY_MMAP" : "memory error");
+
+    for (unsigned i = 0; i < req.count; i++)
+    {
+        phase.Next("EXPBUF V4L capture #" + to_string(i));
+        struct v4l2_buffer buf;
+        CLEAR(buf);
+        buf.index = i;
+        buf.type = req.type;
+        buf.memory = req.memory;
+        buf.length = Caps.GetBufferLength(req.type); // All buffers of the format have the same length
+        if (buf.length == 0)
+        {
+            retVal = ioctl(Fd, VIDIOC_QUERYBUF, &buf); // length
+            if (retVal != 0)
+            {
+                printf("VIDIOC_QUERYBUF: %s\n", strerror(errno));
+                return 0;
+            }
+            Caps.StoreBufferLength(req.type, buf.length);
+        }
+
+        struct v4l2_exportbuffer expbuf;
+        CLEAR(expbuf);
+        expbuf.type = req.type;
+        expbuf.index = i;
+        retVal = ioctl(Fd, VIDIOC_EXPBUF, &expbuf);
+        if (retVal != 0)
+        {
+            printf("VIDIOC_EXPBUF: %s\n", strerror(errno));
+            return 0;
+        }
+        printf("VIDIOC_EXPBUF DMA fd %d for buffer index %d\n", expbuf.fd, i);
+        dmaFd.push_back(expbuf.fd);
+        length.push_back(buf.length);
+    }
+    return req.count;
+}
+
+void SV4l2Source::FreeBuffers()
+{
+    struct v4l2_requestbuffers req;
+    CLEAR(req);
+    req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    req.memory = V4L2_MEMORY_MMAP;
+    req.count = 0;
+    int retVal = ioctl(Fd, VIDIOC_REQBUFS, &req);
+    if (retVal != 0)
+    {
+        printf("VIDIOC_REQBUFS free: %s\n", strerror(errno));
+    }
+}
+
+bool SV4l2Source::StreamOn()
+{
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int retVal = ioctl(Fd, VIDIOC_STREAMON, &type);
+    if (retVal != 0)
+    {
+        printf("VIDIOC_STREAMON: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool SV4l2Source::StreamOff()
+{
+    int type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    int retVal = ioctl(Fd, VIDIOC_STREAMOFF, &type);
+    if (retVal != 0)
+    {
+        printf("VIDIOC_STREAMOFF: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// Put buffer into V4L queue
+void SV4l2Source::Queue(unsigned index)
+{
+    struct v4l2_buffer buf;
+    CLEAR(buf);
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = index;
+    int retVal = ioctl(Fd, VIDIOC_QBUF, &buf); // bytesused and length
+    if (retVal != 0)
+    {
+        printf("VIDIOC_QBUF: %s\n", strerror(errno));
+    }
+}
+
+// Get buffer from V4L queue
+int SV4l2Source::Dequeue(uint64_t& timestamp)
+{
+    struct v4l2_buffer buf;
+    CLEAR(buf);
+    buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buf.memory = V4L2_MEMORY_MMAP;
+    int retVal = ioctl(Fd, VIDIOC_DQBUF, &buf);
+    if (retVal != 0)
+    {
+        if (errno != EAGAIN)
+        {
+            printf("VIDIOC_DQBUF: %s\n", strerror(errno));
+        }
+        return -1; // Nothing ready
+    }
+    // unicam stamps the frame start with CLOCK_MONOTONIC (V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+    timestamp = (uint64_t)buf.timestamp.tv_sec * 1000000000ull + buf.timestamp.tv_usec * 1000ull;
+    return buf.index;
+}
+
+bool SV4l2Source::SourceChanged()
+{
+    bool changed = false;
+    struct v4l2_event ev;
+    CLEAR(ev);
+    while (ioctl(Fd, VIDIOC_DQEVENT, &ev) == 0)
+    {
+        if (ev.type == V4L2_EVENT_SOURCE_CHANGE && (ev.u.src_change.changes & V4L2_EVENT_SRC_CH_RESOLUTION))
+        {
+            printf("V4L source change\n");
+            changed = true;
+        }
+        CLEAR(ev);
+    }
+    return changed;
+}
+
+SUnicamSource::SUnicamSource(const string& name) :
+    SV4l2Source(name)
+{
+}
+
+// The frame size follows the HDMI timings, the driver refuses new ones while buffers are allocated
+bool SUnicamSource::SetupTimings(tstFormat& format)
+{
+    SStartupPhase phase("DV timings");
+    bool result = true;
+    int retVal;
+
+    // Check the correct loaded driver. 
+    // "no dtoverlay" or "dtoverlay=tc358743"
+    // "bm2835 mmal" or "unicam"
+    // "mmal service 16.1" or "unicam"
+    // video0, queried once in Open()
+    // 0x04000000 V4L2_CAP_STREAMING The device supports the streaming I/O method.
+    // 0x01000000 V4L2_CAP_READWRITE The device supports the read() and/or write() I/O methods.
+    // 0x00800000 V4L2_CAP_META_CAPTURE The device supports the Metadata Interface capture interface.
+    // 0x00200000 V4L2_CAP_EXT_PIX_FORMAT The device supports the struct v4l2_pix_format extended fields.
+    // 0x00000001 V4L2_CAP_VIDEO_CAPTURE The device supports the single-planar API through the Video Capture interface.
+    const struct v4l2_capability& cap = Caps.GetCapability();
+    if (strncmp((const char*)cap.driver, DriverName, strlen(DriverName)) != 0)
+    {
+        result = false;
+        printf("Wrong driver. Set dtoverlay=tc358743 in /boot/config.txt\n");
+    }
+
+    struct v4l2_dv_timings tmg;
+    CLEAR(tmg);
+    retVal = ioctl(Fd, VIDIOC_QUERY_DV_TIMINGS, &tmg);
+    if (retVal != 0)
+    {
+        result = false;
+        printf("VIDIOC_QUERY_DV_TIMINGS: %s\n", strerror(errno));
+    }
+    else
+    {
+        unsigned fps = (unsigned)(tmg.bt.pixelclock / ((tmg.bt.width + tmg.bt.hsync) * (tmg.bt.height + tmg.bt.vsync)));
+        printf("HDMI input Width/Height: %u/%u@%uHz\n", tmg.bt.width, tmg.bt.height, fps);
+        retVal = ioctl(Fd, VIDIOC_S_DV_TIMINGS, &tmg);
+        if (retVal != 0)
+        {
+            result = false;
+            printf("VIDIOC_S_DV_TIMINGS: %s\n", strerror(errno));
+        }
+        else
+        {
+            format.Width = tmg.bt.width;
+            format.Height = tmg.bt.height;
+        }
+    }
+    return result;
+}
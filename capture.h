@@ -0,0 +1,79 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "devicecaps.h"
+
+// Capture stage feeding SVideo: a ring of dmabufs the source fills and SVideo queues back.
+// Called from the thread currently driving the pipeline, never concurrently.
+class SCaptureSource
+{
+public:
+    // Pixel layout of the captured frames
+    struct tstFormat
+    {
+        unsigned Width; // In: requested size, the source may override it
+        unsigned Height;
+        unsigned BytesPerLine;
+        bool Uyvy; // In: UYVY 4:2:2, RGB24 otherwise
+        bool Bt709; // Colorimetry of a YUV capture, BT.601 otherwise
+        bool FullRange; // Quantization of a YUV capture, limited range otherwise
+    };
+
+    virtual ~SCaptureSource()
+    {
+    };
+    virtual bool Open() = 0;
+    virtual void Close() = 0;
+    virtual const std::string& GetName() const = 0;
+    virtual int GetFd() const = 0; // EPOLLIN: a frame completed, EPOLLPRI: an event is pending
+    virtual bool SubscribeSourceChange() = 0;
+    virtual std::vector<uint32_t> GetFormats() = 0; // V4L2 fourccs the source captures, after Open()
+    virtual bool SetupTimings(tstFormat& format) = 0; // Before SetupFormat() and without buffers, may set the frame size
+    virtual bool SetupFormat(tstFormat& format) = 0;
+    // Returns the granted count, 0 on error. The DMA file descriptors belong to the caller.
+    virtual unsigned AllocBuffers(unsigned count, std::vector<int>& dmaFd, std::vector<unsigned>& length) = 0;
+    virtual void FreeBuffers() = 0;
+    virtual bool StreamOn() = 0;
+    virtual bool StreamOff() = 0; // Every queued buffer returns to the caller
+    virtual void Queue(unsigned index) = 0;
+    virtual int Dequeue(uint64_t& timestamp) = 0; // CLOCK_MONOTONIC ns, -1 if no frame completed
+    virtual bool SourceChanged() = 0; // Drains the pending events, true on a resolution change
+};
+
+// Single planar V4L2 capture device with MMAP buffers exported as dmabufs, e.g. vivid
+class SV4l2Source : public SCaptureSource
+{
+public:
+    SV4l2Source(const std::string& name);
+    bool Open() override;
+    void Close() override;
+    const std::string& GetName() const override;
+    int GetFd() const override;
+    bool SubscribeSourceChange() override;
+    std::vector<uint32_t> GetFormats() override;
+    bool SetupTimings(tstFormat& format) override; // The driver adjusts the requested size in SetupFormat()
+    bool SetupFormat(tstFormat& format) override;
+    unsigned AllocBuffers(unsigned count, std::vector<int>& dmaFd, std::vector<unsigned>& length) override;
+    void FreeBuffers() override;
+    bool StreamOn() override;
+    bool StreamOff() override;
+    void Queue(unsigned index) override;
+    int Dequeue(uint64_t& timestamp) override;
+    bool SourceChanged() override;
+
+protected:
+    const std::string Name;
+    int Fd;
+    SDeviceCaps Caps;
+};
+
+// tc358743 HDMI to CSI-2 bridge on the Pi unicam driver, the frame size follows the DV timings
+class SUnicamSource : public SV4l2Source
+{
+public:
+    SUnicamSource(const std::string& name);
+    bool SetupTimings(tstFormat& format) override; // Queries and sets the DV timings
+};
@@ -0,0 +1,367 @@
+// On-device calibration of the format chain cost model, see SFormatChain. Each stage is timed at two
+// frame sizes and fitted to a per frame cost plus a cost per byte read and written:
+//   ./chainbench [lanes [Mbps per lane [frames]]]
+// The capture is priced from the CSI-2 link rate instead, the bridge sends at line rate whatever the
+// load. Writes chain.weights next to the program cache, with the dmabuf formats EGL imports.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/videodev2.h>
+#include <libdrm/drm_fourcc.h>
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "glad/glad.h"
+#include "glad/glad_egl.h"
+
+#include "formatchain.h"
+#include "glloader.h"
+#include "gpuconvert.h"
+#include "headlessplatform.h"
+#include "latency.h"
+#include "programcache.h"
+#include "shadervariants.h"
+#include "softisp.h"
+#include "synthetic.h"
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+
+using namespace std;
+
+struct tstSize
+{
+    unsigned Width;
+    unsigned Height;
+};
+
+static const tstSize Sizes[2] = { { 640, 360 }, { 1920, 1080 } };
+
+static const char* IspName = "/dev/video12";
+
+static const string sVertex = R"glsl(
+#version 310 es
+layout(location = 0) in vec2 VertexPosition;
+layout(location = 1) in vec2 vertex_UV;
+out vec2 UV;
+void main()
+{
+    gl_Position = vec4(VertexPosition, 0, 1);
+    UV = vertex_UV;
+}
+)glsl";
+
+// ns per frame of run(), after one warm-up run
+template <typename T>
+static double TimeFrames(unsigned frames, T run)
+{
+    run();
+    uint64_t start = MonotonicNs();
+    for (unsigned frame = 0; frame < frames; frame++)
+    {
+        run();
+    }
+    return (double)(MonotonicNs() - start) / frames;
+}
+
+// Line through the two sizes: ns = FrameUs * 1000 + NsPerByte * bytes
+static void Fit(SFormatChain::tstWeights& weights, SFormatChain::EStage stage, const char* name, const double bytes[2], const double ns[2])
+{
+    double nsPerByte = max(0.0, (ns[1] - ns[0]) / (bytes[1] - bytes[0]));
+    weights.NsPerByte[stage] = (float)nsPerByte;
+    weights.FrameUs[stage] = (float)max(0.0, (ns[0] - nsPerByte * bytes[0]) / 1000);
+    printf("%-8s %7.3f ms, %7.3f ms: %.4f ns/B + %.1f us/frame\n", name, ns[0] / 1e6, ns[1] / 1e6, weights.NsPerByte[stage],
+        weights.FrameUs[stage]);
+}
+
+static bool QueueIsp(int fd, unsigned type, unsigned bytesUsed)
+{
+    struct v4l2_plane plane;
+    CLEAR(plane);
+    plane.bytesused = bytesUsed;
+    struct v4l2_buffer buf;
+    CLEAR(buf);
+    buf.type = type;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.index = 0;
+    buf.m.planes = &plane;
+    buf.length = 1;
+    return ioctl(fd, VIDIOC_QBUF, &buf) == 0;
+}
+
+static bool DeQueueIsp(int fd, unsigned type, short events)
+{
+    struct pollfd pfd = { fd, events, 0 };
+    struct v4l2_plane plane;
+    CLEAR(plane);
+    struct v4l2_buffer buf;
+    CLEAR(buf);
+    buf.type = type;
+    buf.memory = V4L2_MEMORY_MMAP;
+    buf.m.planes = &plane;
+    buf.length = 1;
+    return poll(&pfd, 1, 1000) == 1 && ioctl(fd, VIDIOC_DQBUF, &buf) == 0;
+}
+
+static bool SetupIspQueue(int fd, unsigned type, unsigned width, unsigned height, uint32_t pixelFormat, unsigned& sizeImage)
+{
+    struct v4l2_format fmt;
+    CLEAR(fmt);
+    fmt.type = type;
+    fmt.fmt.pix_mp.width = width;
+    fmt.fmt.pix_mp.height = height;
+    fmt.fmt.pix_mp.pixelformat = pixelFormat;
+    fmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+    fmt.fmt.pix_mp.num_planes = 1;
+    struct v4l2_requestbuffers req;
+    CLEAR(req);
+    req.count = 1;
+    req.type = type;
+    req.memory = V4L2_MEMORY_MMAP;
+    bool result = ioctl(fd, VIDIOC_S_FMT, &fmt) == 0 && ioctl(fd, VIDIOC_REQBUFS, &req) == 0 && req.count >= 1;
+    sizeImage = fmt.fmt.pix_mp.plane_fmt[0].sizeimage;
+    return result;
+}
+
+// ns per frame of the M2M ISP converting RGB24 to BGR32 at the size, one MMAP buffer per queue.
+// 0 if the ISP fails.
+static double TimeIsp(int fd, const tstSize& size, unsigned frames)
+{
+    unsigned outputSize;
+    unsigned captureSize;
+    unsigned output = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    unsigned capture = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+    bool result = SetupIspQueue(fd, output, size.Width, size.Height, V4L2_PIX_FMT_RGB24, outputSize) &&
+        SetupIspQueue(fd, capture, size.Width, size.Height, V4L2_PIX_FMT_BGR32, captureSize) &&
+        ioctl(fd, VIDIOC_STREAMON, &output) == 0 && ioctl(fd, VIDIOC_STREAMON, &capture) == 0;
+    double ns = TimeFrames(frames, [&]()
+    {
+        result = result && QueueIsp(fd, capture, 0) && QueueIsp(fd, output, outputSize) &&
+            DeQueueIsp(fd, capture, POLLIN) && DeQueueIsp(fd, output, POLLOUT);
+    });
+    ioctl(fd, VIDIOC_STREAMOFF, &output);
+    ioctl(fd, VIDIOC_STREAMOFF, &capture);
+    struct v4l2_requestbuffers req;
+    CLEAR(req);
+    req.memory = V4L2_MEMORY_MMAP;
+    req.type = output;
+    ioctl(fd, VIDIOC_REQBUFS, &req);
+    req.type = capture;
+    ioctl(fd, VIDIOC_REQBUFS, &req);
+    if (!result)
+    {
+        printf("%s: %ux%u conversion failed: %s\n", IspName, size.Width, size.Height, strerror(errno));
+    }
+    return result ? ns : 0;
+}
+
+// The software ISP on every core, as SVideo runs it without /dev/video12
+static double TimeSoftIsp(SThreadPool& pool, const tstSize& size, unsigned frames)
+{
+    unsigned inPitch = (size.Width * 3 + 31) / 32 * 32;
+    unsigned outPitch = size.Width * 4;
+    vector<unsigned char> in((size_t)inPitch * size.Height, 0x80);
+    vector<unsigned char> out((size_t)outPitch * size.Height);
+    return TimeFrames(frames, [&]()
+    {
+        SSoftIsp::ConvertFrame(pool, in.data(), inPitch, out.data(), outPitch, size.Width, size.Height);
+    });
+}
+
+// RGB24 synthetic frames unpacked by the compute shader at the source size
+static double TimeGpuConvert(const tstSize& size, unsigned frames)
+{
+    SSyntheticSource source(size.Width, size.Height, 60, 0);
+    SCaptureSource::tstFormat format = { size.Width, size.Height, 0, false, true, false };
+    vector<int> dmaFd;
+    vector<unsigned> length;
+    if (!source.Open() || !source.SetupFormat(format) || source.AllocBuffers(1, dmaFd, length) != 1)
+    {
+        source.Close();
+        return 0;
+    }
+    SGpuConvert convert;
+    unsigned index = convert.AddSource(dmaFd[0], length[0], format.Width, format.Height, format.BytesPerLine, SGpuConvert::eSF_Rgb24, false, false);
+    double ns = TimeFrames(frames, [&]()
+    {
+        convert.Convert(index);
+        glFinish();
+    });
+    convert.Destroy();
+    source.FreeBuffers();
+    source.Close();
+    return ns;
+}
+
+// Full screen quad sampling an RGBA8 texture into an RGBA8 target of the frame size. Texels wide
+// texels per line, packed YUV has one per two pixels.
+static double TimeDisplay(SProgramCache& cache, const SShaderVariants::tstFormatPair& pair, const tstSize& size, unsigned frames)
+{
+    string fragment = SShaderVariants::FragmentSource(pair);
+    size_t external = fragment.find("#extension");
+    if (external != string::npos)
+    {
+        fragment.erase(external, fragment.find('\n', external) + 1 - external);
+    }
+    size_t sampler = fragment.find("samplerExternalOES");
+    if (sampler != string::npos)
+    {
+        fragment.replace(sampler, strlen("samplerExternalOES"), "sampler2D"); // Same cost per texel fetch
+    }
+    unsigned program = cache.GetProgram({ { GL_VERTEX_SHADER, sVertex }, { GL_FRAGMENT_SHADER, fragment } });
+    if (program == 0)
+    {
+        return 0;
+    }
+    bool packed = SShaderVariants::Packed(pair);
+
+    GLuint textures[2];
+    glGenTextures(2, textures);
+    glBindTexture(GL_TEXTURE_2D, textures[0]);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, packed ? size.Width / 2 : size.Width, size.Height);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, textures[1]);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, size.Width, size.Height);
+    GLuint framebuffer;
+    glGenFramebuffers(1, &framebuffer);
+    glBindFramebuffer(GL_FRAMEBUFFER, framebuffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, textures[1], 0);
+    glBindTexture(GL_TEXTURE_2D, textures[0]);
+    glViewport(0, 0, size.Width, size.Height);
+
+    // Position and UV interleaved, triangle strip
+    const float quad[] = { -1, -1, 0, 0, 1, -1, 1, 0, -1, 1, 0, 1, 1, 1, 1, 1 };
+    GLuint vao;
+    GLuint buffer;
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+    glGenBuffers(1, &buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(quad), quad, GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 4 * sizeof(float), (void*)(2 * sizeof(float)));
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glUseProgram(program);
+    glUniform1f(glGetUniformLocation(program, "SourceWidth"), (float)size.Width);
+
+    double ns = TimeFrames(frames, []()
+    {
+        glDrawArrays(GL_TRIANGLE_STRIP, 0, 4);
+        glFinish();
+    });
+
+    glDeleteBuffers(1, &buffer);
+    glDeleteVertexArrays(1, &vao);
+    glDeleteFramebuffers(1, &framebuffer);
+    glDeleteTextures(2, textures);
+    glDeleteProgram(program);
+    return ns;
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned lanes = argc > 1 ? atoi(argv[1]) : 2;
+    unsigned laneMbps = argc > 2 ? atoi(argv[2]) : 972; // tc358743 at 1080p60 RGB24 on the Pi
+    unsigned frames = argc > 3 ? atoi(argv[3]) : 100;
+
+    SFormatChain::tstWeights weights = SFormatChain::DefaultWeights();
+    weights.NsPerByte[SFormatChain::eST_Capture] = 8000.0f / (lanes * laneMbps);
+    weights.FrameUs[SFormatChain::eST_Capture] = 0;
+    printf("capture  %u lanes at %u Mbit/s: %.4f ns/B\n", lanes, laneMbps, weights.NsPerByte[SFormatChain::eST_Capture]);
+
+    // RGB24 in, BGR32 out
+    double bytes[2];
+    double ns[2];
+    int ispFd = open(IspName, O_RDWR | O_NONBLOCK);
+    for (int i = 0; i < 2 && ispFd >= 0; i++)
+    {
+        bytes[i] = 7.0 * Sizes[i].Width * Sizes[i].Height;
+        ns[i] = TimeIsp(ispFd, Sizes[i], frames);
+        if (ns[i] == 0)
+        {
+            close(ispFd);
+            ispFd = -1;
+        }
+    }
+    if (ispFd >= 0)
+    {
+        close(ispFd);
+        Fit(weights, SFormatChain::eST_Isp, "isp", bytes, ns);
+    }
+    else
+    {
+        printf("No %s, timing the CPU ISP\n", IspName);
+        vector<unsigned> cores;
+        for (unsigned core = 0; core < thread::hardware_concurrency(); core++)
+        {
+            cores.push_back(core);
+        }
+        SThreadPool pool;
+        pool.Start(cores);
+        for (int i = 0; i < 2; i++)
+        {
+            bytes[i] = 7.0 * Sizes[i].Width * Sizes[i].Height;
+            ns[i] = TimeSoftIsp(pool, Sizes[i], frames);
+        }
+        pool.Stop();
+        Fit(weights, SFormatChain::eST_Isp, "softisp", bytes, ns);
+    }
+
+    SHeadlessPlatform platform(64, 64, 0);
+    if (!platform.Create())
+    {
+        return 1;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        bytes[i] = 7.0 * Sizes[i].Width * Sizes[i].Height;
+        ns[i] = TimeGpuConvert(Sizes[i], frames);
+    }
+    if (ns[0] != 0 && ns[1] != 0)
+    {
+        Fit(weights, SFormatChain::eST_GpuConvert, "gpu", bytes, ns);
+    }
+    else
+    {
+        printf("Synthetic source unavailable, gpu keeps the default weights\n");
+    }
+
+    // Plain RGBA8 sampling, then the unpacking of UYVY imported as RGBA on top of it
+    SProgramCache cache;
+    for (int i = 0; i < 2; i++)
+    {
+        bytes[i] = 4.0 * Sizes[i].Width * Sizes[i].Height;
+        ns[i] = TimeDisplay(cache, { 0, 0, false, false }, Sizes[i], frames);
+    }
+    Fit(weights, SFormatChain::eST_Display, "display", bytes, ns);
+    double packed = TimeDisplay(cache, { DRM_FORMAT_UYVY, DRM_FORMAT_ABGR8888, false, false }, Sizes[1], frames);
+    weights.PackedNsPerPixel = (float)max(0.0, (packed - ns[1]) / (Sizes[1].Width * Sizes[1].Height));
+    printf("packed   %7.3f ms: %.4f ns/pixel\n", packed / 1e6, weights.PackedNsPerPixel);
+
+    EGLDisplay display = eglGetCurrentDisplay();
+    EGLint count = 0;
+    if (HasEglExtension(display, "EGL_EXT_image_dma_buf_import_modifiers") && eglQueryDmaBufFormatsEXT(display, 0, nullptr, &count))
+    {
+        vector<EGLint> formats(count);
+        eglQueryDmaBufFormatsEXT(display, count, formats.data(), &count);
+        weights.Import.assign(formats.begin(), formats.begin() + count);
+    }
+    printf("import   %zu dmabuf formats\n", weights.Import.size());
+    platform.Destroy();
+
+    string path = SFormatChain::WeightsFile();
+    if (path.empty() || !SFormatChain::SaveWeights(path, weights))
+    {
+        return 1;
+    }
+    printf("Weights written to %s\n", path.c_str());
+    return 0;
+}
@@ -0,0 +1,310 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/utsname.h>
+
+#include "devicecaps.h"
+#include "programcache.h"
+#include "startupprofile.h"
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+
+using namespace std;
+
+static const uint32_t Magic = 0x31504143; // 'CAP1'
+
+// Ahead of the lists and entries in a snapshot file
+struct tstFileHeader
+{
+    uint32_t Magic;
+    uint32_t EntrySize; // Layout of the V4L2 structures, the kernel release already covers it
+    uint64_t Key; // Guards against truncated names and copied files
+    v4l2_capability Capability;
+    uint32_t ListCount;
+    uint32_t EntryCount;
+};
+
+static uint64_t Fnv1a(uint64_t hash, const void* data, size_t length)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ p[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static const char* TypeName(unsigned type)
+{
+    switch (type)
+    {
+    case V4L2_BUF_TYPE_VIDEO_CAPTURE:
+        return "V4L2_BUF_TYPE_VIDEO_CAPTURE";
+    case V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE:
+        return "V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE";
+    case V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE:
+        return "V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE";
+    default:
+        return "V4L2_BUF_TYPE";
+    }
+}
+
+SDeviceCaps::SDeviceCaps(const char* directory) :
+    Directory(directory != nullptr ? directory : DefaultCacheDirectory()),
+    Fd(-1),
+    Key(0),
+    Capability(),
+    Lists(),
+    Entries(),
+    CurrentEntry(),
+    Changed(false)
+{
+}
+
+bool SDeviceCaps::Open(int fd)
+{
+    Fd = fd;
+    Lists.clear();
+    Entries.clear();
+    CurrentEntry.clear();
+    Changed = false;
+    CLEAR(Capability);
+    int retVal = ioctl(Fd, VIDIOC_QUERYCAP, &Capability);
+    if (retVal != 0)
+    {
+        printf("VIDIOC_QUERYCAP: %s\n", strerror(errno));
+        Fd = -1;
+        return false;
+    }
+
+    // Identity of the device and of the kernel driving it. Capabilities as the driver reports them
+    // differently with other overlays loaded.
+    struct utsname name;
+    CLEAR(name);
+    uname(&name);
+    Key = 0xcbf29ce484222325ull;
+    Key = Fnv1a(Key, Capability.driver, sizeof(Capability.driver));
+    Key = Fnv1a(Key, Capability.card, sizeof(Capability.card));
+    Key = Fnv1a(Key, Capability.bus_info, sizeof(Capability.bus_info));
+    Key = Fnv1a(Key, &Capability.version, sizeof(Capability.version));
+    Key = Fnv1a(Key, &Capability.capabilities, sizeof(Capability.capabilities));
+    Key = Fnv1a(Key, name.release, strlen(name.release) + 1);
+    Key = Fnv1a(Key, name.version, strlen(name.version) + 1);
+    Key = Fnv1a(Key, name.machine, strlen(name.machine) + 1);
+
+    if (Load())
+    {
+        printf("Device caps %.32s %.32s loaded from cache\n", (const char*)Capability.card, (const char*)Capability.bus_info);
+    }
+    return true;
+}
+
+void SDeviceCaps::Close()
+{
+    if (Fd >= 0 && Changed)
+    {
+        Save();
+    }
+    Fd = -1;
+}
+
+const v4l2_capability& SDeviceCaps::GetCapability() const
+{
+    return Capability;
+}
+
+const vector<uint32_t>& SDeviceCaps::GetFormats(unsigned type, const string& devStr)
+{
+    for (const tstFormatList& list : Lists)
+    {
+        if (list.Type == type)
+        {
+            return list.PixelFormats;
+        }
+    }
+
+    SStartupPhase phase("ListFormats " + devStr);
+    Lists.push_back({ type, vector<uint32_t>() });
+    vector<uint32_t>& pixelFormats = Lists.back().PixelFormats;
+    struct v4l2_fmtdesc fmt;
+    for (unsigned i = 0; ; i++)
+    {
+        CLEAR(fmt);
+        fmt.index = i;
+        fmt.type = type;
+        if (ioctl(Fd, VIDIOC_ENUM_FMT, &fmt) != 0)
+        {
+            break;
+        }
+        printf("%s: [%u] %.4s\n", devStr.c_str(), fmt.index, (char*)&fmt.pixelformat);
+        pixelFormats.push_back(fmt.pixelformat);
+    }
+    printf("%s: %zu formats on %s\n", devStr.c_str(), pixelFormats.size(), TypeName(type));
+    Changed = true;
+    return pixelFormats;
+}
+
+bool SDeviceCaps::FindFormat(unsigned type, unsigned width, unsigned height, uint32_t pixelFormat, v4l2_format& fmt) const
+{
+    for (const tstFormatEntry& entry : Entries)
+    {
+        if (entry.Type == type && entry.Width == width && entry.Height == height && entry.PixelFormat == pixelFormat)
+        {
+            fmt = entry.Request;
+            return true;
+        }
+    }
+    return false;
+}
+
+void SDeviceCaps::StoreFormat(unsigned width, unsigned height, uint32_t pixelFormat, const v4l2_format& request, const v4l2_format& result)
+{
+    size_t index = 0;
+    while (index < Entries.size() && (Entries[index].Type != request.type || Entries[index].Width != width ||
+        Entries[index].Height != height || Entries[index].PixelFormat != pixelFormat))
+    {
+        index++;
+    }
+    if (index == Entries.size())
+    {
+        Entries.push_back({ request.type, width, height, pixelFormat, 0, request, result });
+        Changed = true;
+    }
+    else if (memcmp(&Entries[index].Result, &result, sizeof(result)) != 0 || memcmp(&Entries[index].Request, &request, sizeof(request)) != 0)
+    {
+        // Same device and kernel, e.g. another firmware or module parameter. The buffers follow the format.
+        printf("Device caps %.32s: %.4s %ux%u negotiated differently, snapshot updated\n", (const char*)Capability.card,
+            (const char*)&pixelFormat, width, height);
+        Entries[index] = { request.type, width, height, pixelFormat, 0, request, result };
+        Changed = true;
+    }
+
+    for (pair<uint32_t, size_t>& current : CurrentEntry)
+    {
+        if (current.first == request.type)
+        {
+            current.second = index;
+            return;
+        }
+    }
+    CurrentEntry.push_back({ request.type, index });
+}
+
+unsigned SDeviceCaps::GetBufferLength(unsigned type) const
+{
+    const tstFormatEntry* entry = Current(type);
+    return entry != nullptr ? entry->BufferLength : 0;
+}
+
+void SDeviceCaps::StoreBufferLength(unsigned type, unsigned length)
+{
+    tstFormatEntry* entry = Current(type);
+    if (entry != nullptr && entry->BufferLength != length)
+    {
+        entry->BufferLength = length;
+        Changed = true;
+    }
+}
+
+string SDeviceCaps::FileName() const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.cap", (unsigned long long)Key);
+    return Directory + name;
+}
+
+// false if there is no snapshot of this device, an invalid one is left to be overwritten
+bool SDeviceCaps::Load()
+{
+    if (Directory.empty())
+    {
+        return false;
+    }
+    FILE* file = fopen(FileName().c_str(), "rb");
+    if (file == nullptr)
+    {
+        return false;
+    }
+    tstFileHeader header;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 && header.Magic == Magic && header.Key == Key &&
+        header.EntrySize == sizeof(tstFormatEntry) && memcmp(&header.Capability, &Capability, sizeof(Capability)) == 0;
+    for (uint32_t i = 0; valid && i < header.ListCount; i++)
+    {
+        uint32_t list[2]; // Type and count
+        valid = fread(list, sizeof(list), 1, file) == 1 && list[1] < 1024;
+        if (valid)
+        {
+            Lists.push_back({ list[0], vector<uint32_t>(list[1]) });
+            valid = fread(Lists.back().PixelFormats.data(), sizeof(uint32_t), list[1], file) == list[1];
+        }
+    }
+    valid = valid && header.EntryCount < 1024;
+    if (valid)
+    {
+        Entries.resize(header.EntryCount);
+        valid = fread(Entries.data(), sizeof(tstFormatEntry), Entries.size(), file) == Entries.size();
+    }
+    fclose(file);
+    if (!valid)
+    {
+        printf("Device caps %s: invalid file\n", FileName().c_str());
+        Lists.clear();
+        Entries.clear();
+        return false;
+    }
+    return true;
+}
+
+// Written to a temporary file and renamed, a concurrent start never reads a partial snapshot
+bool SDeviceCaps::Save()
+{
+    if (Directory.empty() || Fd < 0)
+    {
+        return false;
+    }
+    tstFileHeader header = { Magic, sizeof(tstFormatEntry), Key, Capability, (uint32_t)Lists.size(), (uint32_t)Entries.size() };
+    string name = FileName();
+    string temporary = name + ".tmp" + to_string(getpid());
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (file == nullptr)
+    {
+        printf("Device caps %s: %s\n", temporary.c_str(), strerror(errno));
+        return false;
+    }
+    bool result = fwrite(&header, sizeof(header), 1, file) == 1;
+    for (const tstFormatList& list : Lists)
+    {
+        uint32_t count = list.PixelFormats.size();
+        result &= fwrite(&list.Type, sizeof(list.Type), 1, file) == 1 && fwrite(&count, sizeof(count), 1, file) == 1 &&
+            fwrite(list.PixelFormats.data(), sizeof(uint32_t), count, file) == count;
+    }
+    result &= fwrite(Entries.data(), sizeof(tstFormatEntry), Entries.size(), file) == Entries.size();
+    result &= fclose(file) == 0;
+    if (!result || rename(temporary.c_str(), name.c_str()) != 0)
+    {
+        printf("Device caps %s: %s\n", name.c_str(), strerror(errno));
+        unlink(temporary.c_str());
+        return false;
+    }
+    Changed = false;
+    return true;
+}
+
+SDeviceCaps::tstFormatEntry* SDeviceCaps::Current(unsigned type)
+{
+    for (const pair<uint32_t, size_t>& current : CurrentEntry)
+    {
+        if (current.first == type)
+        {
+            return &Entries[current.second];
+        }
+    }
+    return nullptr;
+}
+
+const SDeviceCaps::tstFormatEntry* SDeviceCaps::Current(unsigned type) const
+{
+    return const_cast<SDeviceCaps*>(this)->Current(type);
+}
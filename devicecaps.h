@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <linux/videodev2.h>
+
+// Probed capabilities of one V4L2 device kept on disk between runs: the VIDIOC_QUERYCAP answer, the
+// VIDIOC_ENUM_FMT lists, every format set with VIDIOC_S_FMT and the buffer length it gave. A warm start
+// issues one VIDIOC_QUERYCAP to identify the device and goes straight to S_FMT/REQBUFS.
+// One file per device, named by a hash of driver, card, bus_info, driver version and the kernel
+// release and build, so another board, driver or kernel never sees the snapshot. A format the driver
+// now negotiates differently replaces its entry. Used by one thread at a time.
+class SDeviceCaps
+{
+public:
+    SDeviceCaps(const char* directory = nullptr); // nullptr: next to the program cache
+    bool Open(int fd); // VIDIOC_QUERYCAP, then loads the snapshot of this device if there is one
+    void Close(); // Saves a changed snapshot
+    const v4l2_capability& GetCapability() const;
+    // Enumerated once per device, printed on enumeration
+    const std::vector<uint32_t>& GetFormats(unsigned type, const std::string& devStr);
+    // fmt as last passed to S_FMT for this type, size and pixel format, skips VIDIOC_G_FMT. false on a miss.
+    bool FindFormat(unsigned type, unsigned width, unsigned height, uint32_t pixelFormat, v4l2_format& fmt) const;
+    // Request as passed to S_FMT and the driver's answer
+    void StoreFormat(unsigned width, unsigned height, uint32_t pixelFormat, const v4l2_format& request, const v4l2_format& result);
+    // Length of plane 0 of the buffers of the last format of the type, 0 if not known yet
+    unsigned GetBufferLength(unsigned type) const;
+    void StoreBufferLength(unsigned type, unsigned length);
+    bool Save();
+
+private:
+    struct tstFormatList
+    {
+        uint32_t Type;
+        std::vector<uint32_t> PixelFormats;
+    };
+    struct tstFormatEntry
+    {
+        uint32_t Type;
+        uint32_t Width; // Requested, before the driver adjusts it
+        uint32_t Height;
+        uint32_t PixelFormat;
+        uint32_t BufferLength;
+        v4l2_format Request;
+        v4l2_format Result;
+    };
+
+    std::string FileName() const;
+    bool Load();
+    tstFormatEntry* Current(unsigned type);
+    const tstFormatEntry* Current(unsigned type) const;
+
+    std::string Directory; // Empty disables the file
+    int Fd;
+    uint64_t Key;
+    v4l2_capability Capability;
+    std::vector<tstFormatList> Lists;
+    std::vector<tstFormatEntry> Entries;
+    std::vector<std::pair<uint32_t, size_t>> CurrentEntry; // Type and index into Entries of the last S_FMT
+    bool Changed; // Differs from the file
+};
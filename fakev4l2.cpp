@@ -0,0 +1,881 @@
+// LD_PRELOAD interposer emulating the two V4L2 devices SVideo drives, for repeatable latency and
+// throughput numbers of the unmodified video.cpp without the tc358743 or the ISP:
+//   LD_PRELOAD=./libfakev4l2.so ./tearing
+// /dev/video0  unicam: single planar RGB24/UYVY capture with DV timings of FAKEV4L2_SIZE (1920x1080) at
+//              FAKEV4L2_FPS (60), FAKEV4L2_JITTER_US (0) of uniform frame start jitter, fixed seed
+// /dev/video12 ISP: M2M multi planar RGB24 -> BGR32 (rgbconvert.h, nearest neighbour when scaling),
+//              FAKEV4L2_ISP_US (2000) per frame, at least the conversion time
+// Buffers are memfds exported through udmabuf (plain memfds without /dev/udmabuf). Each fake fd is an
+// eventfd, readable while a buffer can be dequeued, so epoll and poll work unchanged. EPOLLOUT and
+// EPOLLPRI are folded into EPOLLIN, no V4L2 events are generated.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
+#include <linux/udmabuf.h>
+#include <linux/videodev2.h>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "rgbconvert.h"
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+
+using namespace std;
+
+static const char* UnicamName = "/dev/video0";
+static const char* IspName = "/dev/video12";
+static const unsigned MaxBuffers = 32; // VIDEO_MAX_FRAME
+static const unsigned Alignment = 32; // bytesperline of every queue
+static const unsigned HBlank = 280; // DV timings blanking, 1080p60: 2200 x 1125 total
+static const unsigned VBlank = 45;
+
+struct tstBuffer
+{
+    int MemFd; // MMAP queues
+    int DmaFd; // Duplicated by VIDIOC_EXPBUF
+    unsigned char* Map; // MMAP: memfd mapping, DMABUF: imported mapping
+    unsigned Length;
+    int ImportFd; // DMABUF queues, fd of the current mapping
+    uint64_t Timestamp;
+    unsigned Sequence;
+};
+
+// What the worker reads or writes outside the device lock, copied while holding it
+struct tstImage
+{
+    unsigned char* Map;
+    int Fd; // DMA_BUF_IOCTL_SYNC
+    unsigned Width;
+    unsigned Height;
+    unsigned BytesPerLine;
+};
+
+struct tstQueue
+{
+    unsigned Type;
+    unsigned Memory;
+    unsigned Width;
+    unsigned Height;
+    unsigned PixelFormat;
+    unsigned BytesPerLine;
+    unsigned SizeImage;
+    bool Streaming;
+    vector<tstBuffer> Buffers;
+    deque<unsigned> Queued;
+    deque<unsigned> Done;
+};
+
+struct tstDevice
+{
+    bool Isp;
+    int Fd; // eventfd standing in for the device
+    mutex Lock;
+    condition_variable Wake;
+    tstQueue Capture;
+    tstQueue Output; // ISP only
+    thread Worker;
+    bool Run;
+    bool Busy; // The worker holds a dequeued buffer outside the lock, see WaitIdle()
+    unsigned Sequence;
+    unsigned Fps;
+    unsigned JitterUs;
+    unsigned IspUs;
+    vector<unsigned char> Pattern; // Two capture lines, copied from a scrolling offset
+};
+
+static mutex DevicesLock;
+static map<int, tstDevice*> Devices;
+
+template <typename T>
+static T Next(const char* name)
+{
+    return (T)dlsym(RTLD_NEXT, name);
+}
+
+static int RealIoctl(int fd, unsigned long request, void* arg)
+{
+    static int (*real)(int, unsigned long, ...) = Next<int (*)(int, unsigned long, ...)>("ioctl");
+    return real(fd, request, arg);
+}
+
+static tstDevice* Find(int fd)
+{
+    lock_guard<mutex> lock(DevicesLock);
+    map<int, tstDevice*>::iterator it = Devices.find(fd);
+    return it != Devices.end() ? it->second : nullptr;
+}
+
+static unsigned EnvUnsigned(const char* name, unsigned value)
+{
+    const char* env = getenv(name);
+    return env != nullptr ? (unsigned)strtoul(env, nullptr, 10) : value;
+}
+
+static uint64_t NowNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static unsigned BytesPerPixel(unsigned pixelFormat)
+{
+    return pixelFormat == V4L2_PIX_FMT_BGR32 ? 4 : pixelFormat == V4L2_PIX_FMT_UYVY ? 2 : 3;
+}
+
+static void SetFormat(tstQueue& queue, unsigned width, unsigned height, unsigned pixelFormat)
+{
+    queue.Width = width < 32 ? 32 : width > 4096 ? 4096 : width & ~1u;
+    queue.Height = height < 32 ? 32 : height > 4096 ? 4096 : height;
+    queue.PixelFormat = pixelFormat;
+    queue.BytesPerLine = (queue.Width * BytesPerPixel(pixelFormat) + Alignment - 1) / Alignment * Alignment;
+    queue.SizeImage = queue.BytesPerLine * queue.Height;
+}
+
+// Readable eventfd while any queue has a buffer to dequeue. Device lock held.
+static void UpdateReady(tstDevice& dev)
+{
+    uint64_t value = 1;
+    if (!dev.Capture.Done.empty() || !dev.Output.Done.empty())
+    {
+        if (write(dev.Fd, &value, sizeof(value)) < 0)
+        {
+            printf("fakev4l2: eventfd write: %s\n", strerror(errno));
+        }
+    }
+    else if (read(dev.Fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    {
+        printf("fakev4l2: eventfd read: %s\n", strerror(errno));
+    }
+}
+
+static bool AllocBuffer(tstBuffer& buffer, unsigned length)
+{
+    static int udmabuf = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+    unsigned page = sysconf(_SC_PAGESIZE);
+    buffer.Length = (length + page - 1) / page * page;
+    buffer.MemFd = memfd_create("fakev4l2", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (buffer.MemFd < 0 || ftruncate(buffer.MemFd, buffer.Length) != 0)
+    {
+        return false;
+    }
+    buffer.Map = (unsigned char*)mmap(nullptr, buffer.Length, PROT_READ | PROT_WRITE, MAP_SHARED, buffer.MemFd, 0);
+    if (buffer.Map == MAP_FAILED)
+    {
+        buffer.Map = nullptr;
+        return false;
+    }
+    if (udmabuf >= 0)
+    {
+        fcntl(buffer.MemFd, F_ADD_SEALS, F_SEAL_SHRINK);
+        struct udmabuf_create create;
+        CLEAR(create);
+        create.memfd = buffer.MemFd;
+        create.flags = UDMABUF_FLAGS_CLOEXEC;
+        create.size = buffer.Length;
+        buffer.DmaFd = RealIoctl(udmabuf, UDMABUF_CREATE, &create);
+    }
+    else
+    {
+        buffer.DmaFd = fcntl(buffer.MemFd, F_DUPFD_CLOEXEC, 0);
+    }
+    return buffer.DmaFd >= 0;
+}
+
+static void FreeBuffers(tstQueue& queue)
+{
+    for (tstBuffer& buffer : queue.Buffers)
+    {
+        if (buffer.Map != nullptr)
+        {
+            munmap(buffer.Map, buffer.Length);
+        }
+        if (buffer.MemFd >= 0)
+        {
+            close(buffer.MemFd);
+        }
+        if (buffer.DmaFd >= 0)
+        {
+            close(buffer.DmaFd);
+        }
+    }
+    queue.Buffers.clear();
+    queue.Queued.clear();
+    queue.Done.clear();
+}
+
+static tstImage ImageOf(const tstQueue& queue, const tstBuffer& buffer, int fd)
+{
+    tstImage image = { buffer.Map, fd, queue.Width, queue.Height, queue.BytesPerLine };
+    return image;
+}
+
+// Device lock held. Like the streamoff of the real drivers, which waits for the running job, so the
+// buffers and the format stay valid while the worker uses them.
+static void WaitIdle(tstDevice& dev, unique_lock<mutex>& lock)
+{
+    while (dev.Busy)
+    {
+        dev.Wake.wait(lock);
+    }
+}
+
+// Device lock held, hands the buffer back to STREAMOFF, REQBUFS and S_FMT
+static void SetIdle(tstDevice& dev)
+{
+    dev.Busy = false;
+    dev.Wake.notify_all();
+}
+
+static void SyncDmaBuf(int fd, uint64_t flags)
+{
+    struct dma_buf_sync sync;
+    sync.flags = flags;
+    RealIoctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+// Colour bars, RGB24 in the B, G, R byte order of the tc358743, UYVY limited range BT.709
+static void BuildPattern(tstDevice& dev)
+{
+    static const unsigned char bars[8][3] =
+    {
+        { 255, 255, 255 }, { 255, 255, 0 }, { 0, 255, 255 }, { 0, 255, 0 },
+        { 255, 0, 255 }, { 255, 0, 0 }, { 0, 0, 255 }, { 0, 0, 0 }
+    };
+    const tstQueue& queue = dev.Capture;
+    bool uyvy = queue.PixelFormat == V4L2_PIX_FMT_UYVY;
+    dev.Pattern.resize(2 * queue.Width * BytesPerPixel(queue.PixelFormat));
+    unsigned char* p = dev.Pattern.data();
+    for (unsigned x = 0; x < 2 * queue.Width; x += 2)
+    {
+        const unsigned char* c = bars[(x % queue.Width) * 8 / queue.Width];
+        if (uyvy)
+        {
+            float y = 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+            unsigned char luma = (unsigned char)(16.5f + y * 219.0f / 255.0f);
+            *p++ = (unsigned char)(128.5f + (c[2] - y) / 1.8556f * 224.0f / 255.0f);
+            *p++ = luma;
+            *p++ = (unsigned char)(128.5f + (c[0] - y) / 1.5748f * 224.0f / 255.0f);
+            *p++ = luma;
+        }
+        else
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                *p++ = c[2];
+                *p++ = c[1];
+                *p++ = c[0];
+            }
+        }
+    }
+}
+
+// Frame starts on a fixed grid plus jitter, frames without a queued buffer are dropped like unicam does
+static void UnicamLoop(tstDevice* dev)
+{
+    minstd_rand random(1);
+    uniform_int_distribution<int> jitter(-(int)dev->JitterUs, (int)dev->JitterUs);
+    uint64_t period = 1000000000ull / dev->Fps;
+    uint64_t next = 0;
+    uint64_t due = 0;
+    unsigned frame = 0;
+    unique_lock<mutex> lock(dev->Lock);
+    while (dev->Run)
+    {
+        if (!dev->Capture.Streaming)
+        {
+            next = 0;
+            dev->Wake.wait(lock);
+            continue;
+        }
+        if (next == 0)
+        {
+            next = NowNs() + period;
+            due = next + (int64_t)jitter(random) * 1000;
+        }
+        uint64_t now = NowNs();
+        if (now < due)
+        {
+            dev->Wake.wait_for(lock, chrono::nanoseconds(due - now));
+            continue; // Woken early by a queue, stop or stream off
+        }
+        next += period;
+        due = next + (int64_t)jitter(random) * 1000;
+        frame++;
+        tstQueue& queue = dev->Capture;
+        if (queue.Queued.empty())
+        {
+            continue;
+        }
+        unsigned index = queue.Queued.front();
+        queue.Queued.pop_front();
+        tstBuffer& buffer = queue.Buffers[index];
+        buffer.Timestamp = NowNs(); // Frame start, V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC
+        buffer.Sequence = dev->Sequence++;
+        tstImage image = ImageOf(queue, buffer, buffer.DmaFd);
+        unsigned bytesPerPixel = BytesPerPixel(queue.PixelFormat);
+        const unsigned char* pattern = dev->Pattern.data(); // Rebuilt by S_FMT only
+        dev->Busy = true;
+        lock.unlock();
+        // Full frame write like the capture DMA
+        unsigned lineBytes = image.Width * bytesPerPixel;
+        unsigned offset = (frame * 8) % image.Width * bytesPerPixel;
+        SyncDmaBuf(image.Fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+        for (unsigned y = 0; y < image.Height; y++)
+        {
+            memcpy(image.Map + y * image.BytesPerLine, pattern + offset, lineBytes);
+        }
+        SyncDmaBuf(image.Fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+        lock.lock();
+        SetIdle(*dev);
+        if (queue.Streaming)
+        {
+            queue.Done.push_back(index);
+            UpdateReady(*dev);
+        }
+    }
+}
+
+static void Convert(const tstImage& in, const tstImage& out)
+{
+    if (in.Width == out.Width && in.Height == out.Height)
+    {
+        ConvertRgb24ToBgr32(in.Map, in.BytesPerLine, out.Map, out.BytesPerLine, out.Width, 0, out.Height);
+        return;
+    }
+    // Nearest neighbour, the real ISP filters
+    for (unsigned y = 0; y < out.Height; y++)
+    {
+        const unsigned char* line = in.Map + (y * in.Height / out.Height) * in.BytesPerLine;
+        unsigned char* o = out.Map + y * out.BytesPerLine;
+        for (unsigned x = 0; x < out.Width; x++, o += 4)
+        {
+            const unsigned char* i = line + (x * in.Width / out.Width) * 3;
+            o[0] = i[2];
+            o[1] = i[1];
+            o[2] = i[0];
+            o[3] = 255;
+        }
+    }
+}
+
+// One frame at a time in queue order, both queues streaming
+static void IspLoop(tstDevice* dev)
+{
+    unique_lock<mutex> lock(dev->Lock);
+    while (dev->Run)
+    {
+        tstQueue& output = dev->Output;
+        tstQueue& capture = dev->Capture;
+        if (!output.Streaming || !capture.Streaming || output.Queued.empty() || capture.Queued.empty())
+        {
+            dev->Wake.wait(lock);
+            continue;
+        }
+        unsigned in = output.Queued.front();
+        unsigned out = capture.Queued.front();
+        output.Queued.pop_front();
+        capture.Queued.pop_front();
+        tstBuffer& source = output.Buffers[in];
+        tstBuffer& target = capture.Buffers[out];
+        tstImage sourceImage = ImageOf(output, source, source.ImportFd);
+        tstImage targetImage = ImageOf(capture, target, target.DmaFd);
+        bool convert = source.Map != nullptr && output.PixelFormat == V4L2_PIX_FMT_RGB24;
+        chrono::steady_clock::time_point done = chrono::steady_clock::now() + chrono::microseconds(dev->IspUs);
+        dev->Busy = true;
+        lock.unlock();
+        if (convert)
+        {
+            SyncDmaBuf(sourceImage.Fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+            SyncDmaBuf(targetImage.Fd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+            Convert(sourceImage, targetImage);
+            SyncDmaBuf(targetImage.Fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+            SyncDmaBuf(sourceImage.Fd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+        }
+        this_thread::sleep_until(done);
+        lock.lock();
+        SetIdle(*dev);
+        target.Timestamp = source.Timestamp;
+        target.Sequence = dev->Sequence++;
+        if (output.Streaming)
+        {
+            output.Done.push_back(in);
+        }
+        if (capture.Streaming)
+        {
+            capture.Done.push_back(out);
+        }
+        UpdateReady(*dev);
+    }
+}
+
+static tstQueue* QueueOf(tstDevice& dev, unsigned type)
+{
+    if (!dev.Isp && type == V4L2_BUF_TYPE_VIDEO_CAPTURE)
+    {
+        return &dev.Capture;
+    }
+    if (dev.Isp && type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
+    {
+        return &dev.Capture;
+    }
+    if (dev.Isp && type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+    {
+        return &dev.Output;
+    }
+    return nullptr;
+}
+
+static bool MultiPlanar(const tstQueue& queue)
+{
+    return queue.Type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE || queue.Type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+}
+
+static void GetFormat(const tstQueue& queue, struct v4l2_format& fmt)
+{
+    if (MultiPlanar(queue))
+    {
+        CLEAR(fmt.fmt.pix_mp);
+        fmt.fmt.pix_mp.width = queue.Width;
+        fmt.fmt.pix_mp.height = queue.Height;
+        fmt.fmt.pix_mp.pixelformat = queue.PixelFormat;
+        fmt.fmt.pix_mp.field = V4L2_FIELD_NONE;
+        fmt.fmt.pix_mp.colorspace = V4L2_COLORSPACE_SRGB;
+        fmt.fmt.pix_mp.num_planes = 1;
+        fmt.fmt.pix_mp.plane_fmt[0].bytesperline = queue.BytesPerLine;
+        fmt.fmt.pix_mp.plane_fmt[0].sizeimage = queue.SizeImage;
+    }
+    else
+    {
+        CLEAR(fmt.fmt.pix);
+        fmt.fmt.pix.width = queue.Width;
+        fmt.fmt.pix.height = queue.Height;
+        fmt.fmt.pix.pixelformat = queue.PixelFormat;
+        fmt.fmt.pix.field = V4L2_FIELD_NONE;
+        fmt.fmt.pix.bytesperline = queue.BytesPerLine;
+        fmt.fmt.pix.sizeimage = queue.SizeImage;
+        // What the tc358743 reports for HD timings
+        fmt.fmt.pix.colorspace = V4L2_COLORSPACE_REC709;
+        fmt.fmt.pix.ycbcr_enc = V4L2_YCBCR_ENC_709;
+        fmt.fmt.pix.quantization = V4L2_QUANTIZATION_LIM_RANGE;
+    }
+}
+
+static int Fail(int error)
+{
+    errno = error;
+    return -1;
+}
+
+// The ioctl subset video.cpp uses, device lock held
+static int DeviceIoctl(tstDevice& dev, unique_lock<mutex>& lock, unsigned long request, void* arg)
+{
+    switch (request)
+    {
+    case VIDIOC_QUERYCAP:
+    {
+        struct v4l2_capability* cap = (struct v4l2_capability*)arg;
+        CLEAR(*cap);
+        strcpy((char*)cap->driver, dev.Isp ? "bcm2835-codec" : "unicam");
+        strcpy((char*)cap->card, dev.Isp ? "bcm2835-codec-isp" : "unicam");
+        strcpy((char*)cap->bus_info, "platform:fakev4l2");
+        cap->device_caps = V4L2_CAP_STREAMING | V4L2_CAP_EXT_PIX_FORMAT |
+            (dev.Isp ? V4L2_CAP_VIDEO_M2M_MPLANE : V4L2_CAP_VIDEO_CAPTURE);
+        cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+        return 0;
+    }
+    case VIDIOC_ENUM_FMT:
+    {
+        struct v4l2_fmtdesc* desc = (struct v4l2_fmtdesc*)arg;
+        tstQueue* queue = QueueOf(dev, desc->type);
+        static const unsigned unicam[] = { V4L2_PIX_FMT_RGB24, V4L2_PIX_FMT_UYVY };
+        unsigned count = !dev.Isp ? 2 : 1;
+        if (queue == nullptr || desc->index >= count)
+        {
+            return Fail(EINVAL);
+        }
+        desc->pixelformat = !dev.Isp ? unicam[desc->index] : queue == &dev.Output ? V4L2_PIX_FMT_RGB24 : V4L2_PIX_FMT_BGR32;
+        return 0;
+    }
+    case VIDIOC_QUERY_DV_TIMINGS:
+    case VIDIOC_G_DV_TIMINGS:
+    {
+        if (dev.Isp)
+        {
+            return Fail(ENOTTY);
+        }
+        struct v4l2_dv_timings* timings = (struct v4l2_dv_timings*)arg;
+        CLEAR(*timings);
+        timings->type = V4L2_DV_BT_656_1120;
+        timings->bt.width = dev.Capture.Width;
+        timings->bt.height = dev.Capture.Height;
+        timings->bt.hsync = HBlank; // All blanking in the sync pulse, SVideo only derives the rate
+        timings->bt.vsync = VBlank;
+        timings->bt.pixelclock = (uint64_t)(dev.Capture.Width + HBlank) * (dev.Capture.Height + VBlank) * dev.Fps;
+        return 0;
+    }
+    case VIDIOC_S_DV_TIMINGS:
+        return dev.Isp ? Fail(ENOTTY) : !dev.Capture.Buffers.empty() ? Fail(EBUSY) : 0;
+    case VIDIOC_SUBSCRIBE_EVENT:
+    case VIDIOC_UNSUBSCRIBE_EVENT:
+        return 0;
+    case VIDIOC_DQEVENT:
+        return Fail(ENOENT);
+    case VIDIOC_G_FMT:
+    case VIDIOC_S_FMT:
+    case VIDIOC_TRY_FMT:
+    {
+        struct v4l2_format* fmt = (struct v4l2_format*)arg;
+        tstQueue* queue = QueueOf(dev, fmt->type);
+        if (queue == nullptr)
+        {
+            return Fail(EINVAL);
+        }
+        if (request != VIDIOC_G_FMT)
+        {
+            if (request == VIDIOC_S_FMT && !queue->Buffers.empty())
+            {
+                return Fail(EBUSY);
+            }
+            if (request == VIDIOC_S_FMT)
+            {
+                WaitIdle(dev, lock); // The unicam worker reads the pattern
+            }
+            // Width, height and pixelformat share their offsets in pix and pix_mp
+            tstQueue adjusted = *queue;
+            unsigned pixelFormat = fmt->fmt.pix.pixelformat;
+            if (!dev.Isp)
+            {
+                // Size from the DV timings
+                pixelFormat = pixelFormat == V4L2_PIX_FMT_UYVY ? V4L2_PIX_FMT_UYVY : V4L2_PIX_FMT_RGB24;
+                SetFormat(adjusted, queue->Width, queue->Height, pixelFormat);
+            }
+            else
+            {
+                pixelFormat = queue == &dev.Output ? V4L2_PIX_FMT_RGB24 : V4L2_PIX_FMT_BGR32;
+                SetFormat(adjusted, fmt->fmt.pix.width, fmt->fmt.pix.height, pixelFormat);
+            }
+            if (request == VIDIOC_S_FMT)
+            {
+                *queue = adjusted;
+                if (!dev.Isp)
+                {
+                    BuildPattern(dev);
+                }
+            }
+            GetFormat(adjusted, *fmt);
+            return 0;
+        }
+        GetFormat(*queue, *fmt);
+        return 0;
+    }
+    case VIDIOC_REQBUFS:
+    {
+        struct v4l2_requestbuffers* req = (struct v4l2_requestbuffers*)arg;
+        tstQueue* queue = QueueOf(dev, req->type);
+        if (queue == nullptr)
+        {
+            return Fail(EINVAL);
+        }
+        if (queue->Streaming)
+        {
+            return Fail(EBUSY);
+        }
+        WaitIdle(dev, lock);
+        FreeBuffers(*queue);
+        queue->Memory = req->memory;
+        unsigned count = req->count < MaxBuffers ? req->count : MaxBuffers;
+        for (unsigned i = 0; i < count; i++)
+        {
+            tstBuffer buffer = { -1, -1, nullptr, queue->SizeImage, -1, 0, 0 };
+            if (req->memory == V4L2_MEMORY_MMAP && !AllocBuffer(buffer, queue->SizeImage))
+            {
+                queue->Buffers.push_back(buffer);
+                FreeBuffers(*queue);
+                return Fail(ENOMEM);
+            }
+            queue->Buffers.push_back(buffer);
+        }
+        req->count = count;
+        req->capabilities = V4L2_BUF_CAP_SUPPORTS_MMAP | V4L2_BUF_CAP_SUPPORTS_DMABUF;
+        UpdateReady(dev);
+        return 0;
+    }
+    case VIDIOC_QUERYBUF:
+    case VIDIOC_QBUF:
+    case VIDIOC_DQBUF:
+    {
+        struct v4l2_buffer* buf = (struct v4l2_buffer*)arg;
+        tstQueue* queue = QueueOf(dev, buf->type);
+        if (queue == nullptr)
+        {
+            return Fail(EINVAL);
+        }
+        bool planes = MultiPlanar(*queue);
+        if (request == VIDIOC_DQBUF)
+        {
+            if (queue->Done.empty())
+            {
+                return Fail(EAGAIN);
+            }
+            buf->index = queue->Done.front();
+            queue->Done.pop_front();
+            UpdateReady(dev);
+        }
+        if (buf->index >= queue->Buffers.size() || (planes && (buf->m.planes == nullptr || buf->length < 1)))
+        {
+            return Fail(EINVAL);
+        }
+        tstBuffer& buffer = queue->Buffers[buf->index];
+        if (request == VIDIOC_QBUF)
+        {
+            if (queue->Memory == V4L2_MEMORY_DMABUF)
+            {
+                int fd = planes ? buf->m.planes[0].m.fd : buf->m.fd;
+                if (fd != buffer.ImportFd)
+                {
+                    if (buffer.Map != nullptr)
+                    {
+                        munmap(buffer.Map, buffer.Length);
+                    }
+                    buffer.Length = queue->SizeImage;
+                    buffer.Map = (unsigned char*)mmap(nullptr, buffer.Length, PROT_READ, MAP_SHARED, fd, 0);
+                    buffer.Map = buffer.Map != MAP_FAILED ? buffer.Map : nullptr;
+                    buffer.ImportFd = fd;
+                }
+            }
+            queue->Queued.push_back(buf->index);
+            dev.Wake.notify_all();
+        }
+        buf->flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+        buf->field = V4L2_FIELD_NONE;
+        buf->sequence = buffer.Sequence;
+        buf->timestamp.tv_sec = buffer.Timestamp / 1000000000ull;
+        buf->timestamp.tv_usec = buffer.Timestamp % 1000000000ull / 1000;
+        if (planes)
+        {
+            buf->length = 1;
+            buf->m.planes[0].length = buffer.Length;
+            buf->m.planes[0].bytesused = queue->SizeImage;
+        }
+        else
+        {
+            buf->length = buffer.Length;
+            buf->bytesused = queue->SizeImage;
+        }
+        return 0;
+    }
+    case VIDIOC_EXPBUF:
+    {
+        struct v4l2_exportbuffer* expbuf = (struct v4l2_exportbuffer*)arg;
+        tstQueue* queue = QueueOf(dev, expbuf->type);
+        if (queue == nullptr || queue->Memory != V4L2_MEMORY_MMAP || expbuf->index >= queue->Buffers.size())
+        {
+            return Fail(EINVAL);
+        }
+        expbuf->fd = fcntl(queue->Buffers[expbuf->index].DmaFd, F_DUPFD_CLOEXEC, 0);
+        return expbuf->fd >= 0 ? 0 : -1;
+    }
+    case VIDIOC_STREAMON:
+    case VIDIOC_STREAMOFF:
+    {
+        tstQueue* queue = QueueOf(dev, *(int*)arg);
+        if (queue == nullptr)
+        {
+            return Fail(EINVAL);
+        }
+        queue->Streaming = request == VIDIOC_STREAMON;
+        if (!queue->Streaming)
+        {
+            WaitIdle(dev, lock);
+            // Every buffer returns to the application
+            queue->Queued.clear();
+            queue->Done.clear();
+            UpdateReady(dev);
+        }
+        dev.Wake.notify_all();
+        return 0;
+    }
+    default:
+        return Fail(ENOTTY);
+    }
+}
+
+static int OpenDevice(const char* path)
+{
+    bool isp = strcmp(path, IspName) == 0;
+    tstDevice* dev = new tstDevice();
+    dev->Isp = isp;
+    dev->Fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    dev->Run = true;
+    dev->Busy = false;
+    dev->Sequence = 0;
+    dev->Fps = EnvUnsigned("FAKEV4L2_FPS", 60);
+    dev->Fps = dev->Fps != 0 ? dev->Fps : 60;
+    dev->JitterUs = EnvUnsigned("FAKEV4L2_JITTER_US", 0);
+    dev->IspUs = EnvUnsigned("FAKEV4L2_ISP_US", 2000);
+    unsigned width = 1920;
+    unsigned height = 1080;
+    const char* size = getenv("FAKEV4L2_SIZE");
+    if (size != nullptr)
+    {
+        sscanf(size, "%ux%u", &width, &height);
+    }
+    dev->Capture.Type = isp ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    dev->Capture.Memory = V4L2_MEMORY_MMAP;
+    SetFormat(dev->Capture, width, height, isp ? V4L2_PIX_FMT_BGR32 : V4L2_PIX_FMT_RGB24);
+    dev->Output.Type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+    dev->Output.Memory = V4L2_MEMORY_DMABUF;
+    SetFormat(dev->Output, width, height, V4L2_PIX_FMT_RGB24);
+    if (!isp)
+    {
+        BuildPattern(*dev);
+    }
+    dev->Worker = thread(isp ? IspLoop : UnicamLoop, dev);
+    printf("fakev4l2: %s emulated as fd %d\n", path, dev->Fd);
+    lock_guard<mutex> lock(DevicesLock);
+    Devices[dev->Fd] = dev;
+    return dev->Fd;
+}
+
+static void CloseDevice(tstDevice* dev)
+{
+    {
+        lock_guard<mutex> lock(dev->Lock);
+        dev->Run = false;
+        dev->Wake.notify_all();
+    }
+    dev->Worker.join();
+    FreeBuffers(dev->Capture);
+    FreeBuffers(dev->Output);
+    delete dev;
+}
+
+static bool Emulated(const char* path)
+{
+    return path != nullptr && (strcmp(path, UnicamName) == 0 || strcmp(path, IspName) == 0);
+}
+
+extern "C" int open(const char* path, int flags, ...)
+{
+    static int (*real)(const char*, int, ...) = Next<int (*)(const char*, int, ...)>("open");
+    if (Emulated(path))
+    {
+        return OpenDevice(path);
+    }
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = (flags & (O_CREAT | O_TMPFILE)) ? va_arg(args, mode_t) : 0;
+    va_end(args);
+    return real(path, flags, mode);
+}
+
+extern "C" int open64(const char* path, int flags, ...)
+{
+    static int (*real)(const char*, int, ...) = Next<int (*)(const char*, int, ...)>("open64");
+    if (Emulated(path))
+    {
+        return OpenDevice(path);
+    }
+    va_list args;
+    va_start(args, flags);
+    mode_t mode = (flags & (O_CREAT | O_TMPFILE)) ? va_arg(args, mode_t) : 0;
+    va_end(args);
+    return real(path, flags, mode);
+}
+
+extern "C" int close(int fd)
+{
+    static int (*real)(int) = Next<int (*)(int)>("close");
+    tstDevice* dev = nullptr;
+    {
+        lock_guard<mutex> lock(DevicesLock);
+        map<int, tstDevice*>::iterator it = Devices.find(fd);
+        if (it != Devices.end())
+        {
+            dev = it->second;
+            Devices.erase(it);
+        }
+    }
+    if (dev != nullptr)
+    {
+        CloseDevice(dev);
+    }
+    return real(fd);
+}
+
+extern "C" int ioctl(int fd, unsigned long request, ...) __THROW
+{
+    va_list args;
+    va_start(args, request);
+    void* arg = va_arg(args, void*);
+    va_end(args);
+    tstDevice* dev = Find(fd);
+    if (dev == nullptr)
+    {
+        return RealIoctl(fd, request, arg);
+    }
+    unique_lock<mutex> lock(dev->Lock);
+    return DeviceIoctl(*dev, lock, request, arg);
+}
+
+// Level triggered readiness is all on the eventfd
+extern "C" int epoll_ctl(int epfd, int op, int fd, struct epoll_event* event) __THROW
+{
+    static int (*real)(int, int, int, struct epoll_event*) = Next<int (*)(int, int, int, struct epoll_event*)>("epoll_ctl");
+    if (event != nullptr && Find(fd) != nullptr)
+    {
+        struct epoll_event folded = *event;
+        folded.events = (folded.events & ~(EPOLLOUT | EPOLLPRI)) | EPOLLIN;
+        return real(epfd, op, fd, &folded);
+    }
+    return real(epfd, op, fd, event);
+}
+
+extern "C" int poll(struct pollfd* fds, nfds_t count, int timeout)
+{
+    static int (*real)(struct pollfd*, nfds_t, int) = Next<int (*)(struct pollfd*, nfds_t, int)>("poll");
+    vector<short> requested(count);
+    vector<bool> emulated(count);
+    for (nfds_t i = 0; i < count; i++)
+    {
+        requested[i] = fds[i].events;
+        emulated[i] = Find(fds[i].fd) != nullptr;
+        if (emulated[i])
+        {
+            fds[i].events = POLLIN;
+        }
+    }
+    int ret = real(fds, count, timeout);
+    for (nfds_t i = 0; i < count; i++)
+    {
+        if (emulated[i])
+        {
+            fds[i].events = requested[i];
+            if (fds[i].revents & POLLIN)
+            {
+                fds[i].revents = (fds[i].revents & ~POLLIN) | (requested[i] & (POLLIN | POLLRDNORM | POLLOUT | POLLWRNORM));
+            }
+        }
+    }
+    return ret;
+}
@@ -0,0 +1,291 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <linux/videodev2.h>
+#include <libdrm/drm_fourcc.h>
+#include <algorithm>
+#include <iterator>
+
+#include "formatchain.h"
+#include "programcache.h"
+
+using namespace std;
+
+// Memory layouts along the chain
+struct tstLayout
+{
+    uint32_t V4l2; // 0 if only produced by a conversion
+    uint32_t Drm;
+    unsigned BytesPerPixel;
+    bool Subsampled; // 4:2:2 chroma
+};
+
+static const tstLayout Layouts[] =
+{
+    { V4L2_PIX_FMT_RGB24, DRM_FORMAT_BGR888, 3, false }, // 'RGB3' carries B, G, R
+    { V4L2_PIX_FMT_UYVY, DRM_FORMAT_UYVY, 2, true },
+    { V4L2_PIX_FMT_BGR32, DRM_FORMAT_ABGR8888, 4, false },
+    { 0, DRM_FORMAT_ARGB8888, 4, false },
+};
+
+// ISP output fourcc to ISP capture fourcc, and the memory layout of the result
+struct tstConversion
+{
+    uint32_t Input;
+    uint32_t Output;
+    uint32_t Drm;
+};
+
+// Edges of the chain graph, as far as SVideo implements them
+static const uint32_t Captures[] = { V4L2_PIX_FMT_RGB24, V4L2_PIX_FMT_UYVY }; // SCaptureSource::tstFormat
+static const tstConversion IspConversions[] =
+{
+    { V4L2_PIX_FMT_RGB24, V4L2_PIX_FMT_BGR32, DRM_FORMAT_ABGR8888 }, // Swapped 'RGB3' in, 'BGR4' holds R, G, B, A
+    { V4L2_PIX_FMT_UYVY, V4L2_PIX_FMT_BGR32, DRM_FORMAT_ARGB8888 }, // Converted from YUV, 'BGR4' holds B, G, R, A
+};
+static const uint32_t GpuInputs[] = { V4L2_PIX_FMT_RGB24, V4L2_PIX_FMT_UYVY }; // SGpuConvert::ESourceFormat
+static const uint32_t DirectInputs[] = { V4L2_PIX_FMT_UYVY }; // Imported as captured
+static const unsigned GpuTargetBytesPerPixel = 4; // RGBA8
+
+static const char* StageNames[SFormatChain::eST_Count] = { "capture", "isp", "gpu", "display" };
+
+static const tstLayout* FindV4l2(uint32_t fourcc)
+{
+    for (const tstLayout& layout : Layouts)
+    {
+        if (layout.V4l2 == fourcc)
+        {
+            return &layout;
+        }
+    }
+    return nullptr;
+}
+
+static const tstLayout* FindDrm(uint32_t fourcc)
+{
+    for (const tstLayout& layout : Layouts)
+    {
+        if (layout.Drm == fourcc)
+        {
+            return &layout;
+        }
+    }
+    return nullptr;
+}
+
+template <typename T, size_t N>
+static bool Contains(const T (&array)[N], uint32_t fourcc)
+{
+    return find(begin(array), end(array), fourcc) != end(array);
+}
+
+static bool Contains(const vector<uint32_t>& list, uint32_t fourcc)
+{
+    return find(list.begin(), list.end(), fourcc) != list.end();
+}
+
+// Whether the display takes buffers of the layout, and if the shader then unpacks YUV itself
+static bool Displayable(const SFormatChain::tstCaps& caps, uint32_t drm, bool& packed)
+{
+    packed = false;
+    if (caps.Scanout)
+    {
+        // The plane ignores alpha, see CreateSourceImage()
+        uint32_t opaque = drm == DRM_FORMAT_ABGR8888 ? DRM_FORMAT_XBGR8888 : drm == DRM_FORMAT_ARGB8888 ? DRM_FORMAT_XRGB8888 : drm;
+        return drm != 0 && (caps.Display.empty() || Contains(caps.Display, drm) || Contains(caps.Display, opaque));
+    }
+    if (drm == 0 || caps.Display.empty() || Contains(caps.Display, drm))
+    {
+        return true;
+    }
+    // SShaderVariants swizzles another RGB import for free, YUV costs the unpacking
+    const tstLayout* layout = FindDrm(drm);
+    packed = layout != nullptr && layout->Subsampled;
+    return true;
+}
+
+SFormatChain::SFormatChain(const tstWeights& weights) :
+    Weights(weights)
+{
+}
+
+SFormatChain::tstWeights SFormatChain::DefaultWeights()
+{
+    tstWeights weights;
+    weights.NsPerByte[eST_Capture] = 8000.0f / (2 * 972); // 2 lanes at 972 Mbit/s
+    weights.FrameUs[eST_Capture] = 0;
+    weights.NsPerByte[eST_Isp] = 0.6f;
+    weights.FrameUs[eST_Isp] = 500;
+    weights.NsPerByte[eST_GpuConvert] = 0.2f;
+    weights.FrameUs[eST_GpuConvert] = 200;
+    weights.NsPerByte[eST_Display] = 0.1f;
+    weights.FrameUs[eST_Display] = 0;
+    weights.PackedNsPerPixel = 1.0f;
+    return weights;
+}
+
+string SFormatChain::WeightsFile()
+{
+    string directory = DefaultCacheDirectory();
+    return directory.empty() ? string() : directory + "/chain.weights";
+}
+
+// Text, one stage per line: <stage> <ns per byte> <us per frame>, then packed <ns per pixel> and
+// import <fourcc>... Stages missing from the file keep their value.
+bool SFormatChain::LoadWeights(const string& path, tstWeights& weights)
+{
+    FILE* file = fopen(path.c_str(), "r");
+    if (file == nullptr)
+    {
+        return false;
+    }
+    char line[1024];
+    while (fgets(line, sizeof(line), file) != nullptr)
+    {
+        char name[16];
+        int offset = 0;
+        if (line[0] == '#' || sscanf(line, "%15s %n", name, &offset) != 1)
+        {
+            continue;
+        }
+        float nsPerByte;
+        float frameUs;
+        for (int stage = 0; stage < eST_Count; stage++)
+        {
+            if (strcmp(name, StageNames[stage]) == 0 && sscanf(line + offset, "%f %f", &nsPerByte, &frameUs) == 2)
+            {
+                weights.NsPerByte[stage] = nsPerByte;
+                weights.FrameUs[stage] = frameUs;
+            }
+        }
+        if (strcmp(name, "packed") == 0)
+        {
+            sscanf(line + offset, "%f", &weights.PackedNsPerPixel);
+        }
+        else if (strcmp(name, "import") == 0)
+        {
+            weights.Import.clear();
+            char fourcc[5];
+            int length = 0;
+            for (const char* p = line + offset; sscanf(p, "%4s%n", fourcc, &length) == 1; p += length)
+            {
+                weights.Import.push_back(fourcc_code(fourcc[0], fourcc[1], fourcc[2], fourcc[3]));
+            }
+        }
+    }
+    fclose(file);
+    return true;
+}
+
+bool SFormatChain::SaveWeights(const string& path, const tstWeights& weights)
+{
+    FILE* file = fopen(path.c_str(), "w");
+    if (file == nullptr)
+    {
+        printf("Chain weights %s: %s\n", path.c_str(), strerror(errno));
+        return false;
+    }
+    fprintf(file, "# stage, ns per byte read and written, us per frame\n");
+    for (int stage = 0; stage < eST_Count; stage++)
+    {
+        fprintf(file, "%s %.4f %.1f\n", StageNames[stage], weights.NsPerByte[stage], weights.FrameUs[stage]);
+    }
+    fprintf(file, "packed %.4f\n", weights.PackedNsPerPixel);
+    if (!weights.Import.empty())
+    {
+        fprintf(file, "import");
+        for (uint32_t fourcc : weights.Import)
+        {
+            fprintf(file, " %.4s", (const char*)&fourcc);
+        }
+        fprintf(file, "\n");
+    }
+    return fclose(file) == 0;
+}
+
+const SFormatChain::tstWeights& SFormatChain::GetWeights() const
+{
+    return Weights;
+}
+
+bool SFormatChain::Negotiate(const tstCaps& caps, unsigned width, unsigned height, tstChain& chain) const
+{
+    vector<tstChain> candidates;
+    for (uint32_t capture : Captures)
+    {
+        const tstLayout* layout = FindV4l2(capture);
+        if (!Contains(caps.Capture, capture) || (caps.FullChroma && layout->Subsampled))
+        {
+            continue;
+        }
+        tstChain candidate = { capture, 0, false, 0, false, 0 };
+        if (Contains(DirectInputs, capture) && Displayable(caps, layout->Drm, candidate.Packed))
+        {
+            candidate.Display = layout->Drm;
+            candidates.push_back(candidate);
+        }
+        for (const tstConversion& conversion : IspConversions)
+        {
+            if (conversion.Input == capture && Contains(caps.IspOutput, capture) && Contains(caps.IspCapture, conversion.Output) &&
+                Displayable(caps, conversion.Drm, candidate.Packed))
+            {
+                candidate.IspCapture = conversion.Output;
+                candidate.Display = conversion.Drm;
+                candidates.push_back(candidate);
+            }
+        }
+        if (caps.GpuConvert && !caps.Scanout && Contains(GpuInputs, capture))
+        {
+            candidates.push_back({ capture, 0, true, 0, false, 0 });
+        }
+    }
+
+    for (tstChain& candidate : candidates)
+    {
+        candidate.CostUs = Cost(candidate, width, height);
+        Print(candidate);
+    }
+    vector<tstChain>::iterator best = min_element(candidates.begin(), candidates.end(),
+        [](const tstChain& a, const tstChain& b) { return a.CostUs < b.CostUs; });
+    if (best == candidates.end())
+    {
+        printf("Format chain: no chain for the probed formats\n");
+        return false;
+    }
+    chain = *best;
+    return true;
+}
+
+float SFormatChain::Cost(const tstChain& chain, unsigned width, unsigned height) const
+{
+    float pixels = (float)width * height;
+    unsigned capture = FindV4l2(chain.Capture)->BytesPerPixel;
+    float ns = Weights.FrameUs[eST_Capture] * 1000 + Weights.NsPerByte[eST_Capture] * pixels * capture;
+    if (chain.IspCapture != 0)
+    {
+        ns += Weights.FrameUs[eST_Isp] * 1000 + Weights.NsPerByte[eST_Isp] * pixels * (capture + FindDrm(chain.Display)->BytesPerPixel);
+    }
+    if (chain.GpuConvert)
+    {
+        ns += Weights.FrameUs[eST_GpuConvert] * 1000 + Weights.NsPerByte[eST_GpuConvert] * pixels * (capture + GpuTargetBytesPerPixel);
+    }
+    const tstLayout* display = FindDrm(chain.Display);
+    ns += Weights.FrameUs[eST_Display] * 1000 + Weights.NsPerByte[eST_Display] * pixels *
+        (display != nullptr ? display->BytesPerPixel : GpuTargetBytesPerPixel);
+    if (chain.Packed)
+    {
+        ns += Weights.PackedNsPerPixel * pixels;
+    }
+    return ns / 1000;
+}
+
+void SFormatChain::Print(const tstChain& chain)
+{
+    char isp[16] = "";
+    if (chain.IspCapture != 0)
+    {
+        snprintf(isp, sizeof(isp), " -> ISP %.4s", (const char*)&chain.IspCapture);
+    }
+    printf("Format chain %.4s%s%s -> display %.4s%s: %.0f us\n", (const char*)&chain.Capture, isp, chain.GpuConvert ? " -> compute" : "",
+        chain.Display != 0 ? (const char*)&chain.Display : "RGBA", chain.Packed ? " unpacked by the shader" : "", chain.CostUs);
+}
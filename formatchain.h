@@ -0,0 +1,67 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// End-to-end format negotiation: the capture fourcc, whether the ISP converts and into what, whether
+// the compute shader unpacks, and the layout the display imports or scans out. Every chain the
+// pipeline implements is priced per frame from the bytes each stage reads and writes; a skipped stage
+// costs nothing. The weights come from chainbench, run once on the device, defaults otherwise.
+class SFormatChain
+{
+public:
+    enum EStage
+    {
+        eST_Capture, // Source to memory, the CSI-2 link
+        eST_Isp, // Hardware ISP or its CPU stand-in
+        eST_GpuConvert, // Compute shader
+        eST_Display, // Sampling by the display shader or plane scanout
+        eST_Count
+    };
+
+    // Cost of a stage per frame: FrameUs + NsPerByte * (bytes read + bytes written) / 1000
+    struct tstWeights
+    {
+        float NsPerByte[eST_Count];
+        float FrameUs[eST_Count];
+        float PackedNsPerPixel; // Display shader unpacking YUV imported as RGBA, on top of eST_Display
+        std::vector<uint32_t> Import; // DRM fourccs EGL imported during the calibration, empty if unknown
+    };
+
+    // What the stages offer. Capture and ISP in V4L2 fourccs from VIDIOC_ENUM_FMT.
+    struct tstCaps
+    {
+        std::vector<uint32_t> Capture;
+        std::vector<uint32_t> IspOutput; // Both empty without an ISP
+        std::vector<uint32_t> IspCapture;
+        bool GpuConvert; // GLES 3.1 compute shaders, GL presentation only
+        bool Scanout; // KMS plane instead of the display shader
+        std::vector<uint32_t> Display; // DRM fourccs EGL imports or the plane scans out, empty assumes all
+        bool FullChroma; // Excludes 4:2:2 captures and conversions
+    };
+
+    struct tstChain
+    {
+        uint32_t Capture; // V4L2 fourcc
+        uint32_t IspCapture; // V4L2 fourcc, 0 if the ISP is skipped
+        bool GpuConvert;
+        uint32_t Display; // DRM fourcc of the presented buffers, 0 for the RGBA8 compute target
+        bool Packed; // YUV the display shader unpacks itself
+        float CostUs; // Per frame
+    };
+
+    SFormatChain(const tstWeights& weights);
+    static tstWeights DefaultWeights(); // Pi 4 estimates, tc358743 on 2 CSI-2 lanes
+    static std::string WeightsFile(); // chain.weights next to the program cache
+    static bool LoadWeights(const std::string& path, tstWeights& weights);
+    static bool SaveWeights(const std::string& path, const tstWeights& weights);
+    const tstWeights& GetWeights() const;
+    // Cheapest chain the stages support for frames of the size, false if there is none. Prints the candidates.
+    bool Negotiate(const tstCaps& caps, unsigned width, unsigned height, tstChain& chain) const;
+    float Cost(const tstChain& chain, unsigned width, unsigned height) const;
+    static void Print(const tstChain& chain);
+
+private:
+    tstWeights Weights;
+};
@@ -0,0 +1,206 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <gbm.h>
+#include <libdrm/drm_fourcc.h>
+#include <vector>
+
+#include "glloader.h"
+#include "startupprofile.h"
+
+#include "gbmplatform.h"
+
+using namespace std;
+
+SGbmPlatform::SGbmPlatform() :
+    Kms(),
+    Device(nullptr),
+    Surface(nullptr),
+    Front(nullptr),
+    Display(EGL_NO_DISPLAY),
+    Context(EGL_NO_CONTEXT),
+    EglSurface(EGL_NO_SURFACE)
+{
+}
+
+bool SGbmPlatform::Create()
+{
+    SStartupPhase phase("KMS setup");
+    if (!Kms.Create(nullptr, DRM_FORMAT_XRGB8888))
+    {
+        return false;
+    }
+    phase.Next("GBM surface");
+    Device = gbm_create_device(Kms.GetFd());
+    if (Device != nullptr)
+    {
+        Surface = gbm_surface_create(Device, Kms.GetWidth(), Kms.GetHeight(), GBM_FORMAT_XRGB8888,
+            GBM_BO_USE_SCANOUT | GBM_BO_USE_RENDERING);
+    }
+    if (Surface == nullptr)
+    {
+        printf("GBM surface %ux%u failed\n", Kms.GetWidth(), Kms.GetHeight());
+        Destroy();
+        return false;
+    }
+    phase.Next("EGL context");
+    if (!CreateContext())
+    {
+        Destroy();
+        return false;
+    }
+    return true;
+}
+
+// GLES 3.1 context on the GBM platform, the config must match the scanout format
+bool SGbmPlatform::CreateContext()
+{
+    LazyLoadEGL((GLADloadproc)eglGetProcAddress);
+    if (!HasEglExtension(EGL_NO_DISPLAY, "EGL_EXT_platform_base"))
+    {
+        printf("EGL_EXT_platform_base missing\n");
+        return false;
+    }
+    Display = eglGetPlatformDisplayEXT(EGL_PLATFORM_GBM_KHR, Device, nullptr);
+    EGLint major;
+    EGLint minor;
+    if (Display == EGL_NO_DISPLAY || !eglInitialize(Display, &major, &minor))
+    {
+        printf("eglInitialize: error 0x%x\n", eglGetError());
+        return false;
+    }
+    eglBindAPI(EGL_OPENGL_ES_API);
+
+    const EGLint configAttribs[] =
+    {
+        EGL_SURFACE_TYPE, EGL_WINDOW_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT_KHR,
+        EGL_RED_SIZE, 8,
+        EGL_GREEN_SIZE, 8,
+        EGL_BLUE_SIZE, 8,
+        EGL_NONE
+    };
+    EGLint count = 0;
+    eglChooseConfig(Display, configAttribs, nullptr, 0, &count);
+    vector<EGLConfig> configs(count);
+    eglChooseConfig(Display, configAttribs, configs.data(), count, &count);
+    EGLConfig config = nullptr;
+    for (EGLint i = 0; i < count && config == nullptr; i++)
+    {
+        EGLint visual;
+        if (eglGetConfigAttrib(Display, configs[i], EGL_NATIVE_VISUAL_ID, &visual) && visual == GBM_FORMAT_XRGB8888)
+        {
+            config = configs[i];
+        }
+    }
+    if (config == nullptr)
+    {
+        printf("No EGL config for XRGB8888\n");
+        return false;
+    }
+
+    const EGLint contextAttribs[] =
+    {
+        EGL_CONTEXT_MAJOR_VERSION_KHR, 3,
+        EGL_CONTEXT_MINOR_VERSION_KHR, 1,
+        EGL_NONE
+    };
+    Context = eglCreateContext(Display, config, EGL_NO_CONTEXT, contextAttribs);
+    if (Context != EGL_NO_CONTEXT)
+    {
+        EglSurface = eglCreatePlatformWindowSurfaceEXT(Display, config, Surface, nullptr);
+    }
+    if (EglSurface == EGL_NO_SURFACE || !eglMakeCurrent(Display, EglSurface, EglSurface, Context))
+    {
+        printf("EGL context: error 0x%x\n", eglGetError());
+        return false;
+    }
+    SStartupPhase phase("GL loader");
+    LazyLoadGLES2((GLADloadproc)eglGetProcAddress);
+    printf("GBM platform: EGL %d.%d, %s\n", major, minor, glGetString(GL_RENDERER));
+    return true;
+}
+
+void SGbmPlatform::Destroy()
+{
+    if (Display != EGL_NO_DISPLAY)
+    {
+        eglMakeCurrent(Display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        if (EglSurface != EGL_NO_SURFACE)
+        {
+            eglDestroySurface(Display, EglSurface);
+        }
+        if (Context != EGL_NO_CONTEXT)
+        {
+            eglDestroyContext(Display, Context);
+        }
+        eglTerminate(Display);
+    }
+    Kms.WaitFlip(100);
+    if (Front != nullptr)
+    {
+        gbm_surface_release_buffer(Surface, Front);
+    }
+    if (Surface != nullptr)
+    {
+        gbm_surface_destroy(Surface);
+    }
+    if (Device != nullptr)
+    {
+        gbm_device_destroy(Device);
+    }
+    Kms.Destroy();
+    Front = nullptr;
+    Surface = nullptr;
+    Device = nullptr;
+    Display = EGL_NO_DISPLAY;
+    Context = EGL_NO_CONTEXT;
+    EglSurface = EGL_NO_SURFACE;
+}
+
+void SGbmPlatform::GetFramebufferSize(unsigned& width, unsigned& height) const
+{
+    width = Kms.GetWidth();
+    height = Kms.GetHeight();
+}
+
+// The surface cycles through a few buffer objects, each gets its framebuffer once
+int SGbmPlatform::Framebuffer(gbm_bo* bo)
+{
+    intptr_t index = (intptr_t)gbm_bo_get_user_data(bo);
+    if (index == 0)
+    {
+        int dmaFd = gbm_bo_get_fd(bo);
+        index = Kms.AddBuffer(dmaFd, gbm_bo_get_width(bo), gbm_bo_get_height(bo), DRM_FORMAT_XRGB8888, gbm_bo_get_stride(bo)) + 1;
+        close(dmaFd);
+        gbm_bo_set_user_data(bo, (void*)index, nullptr); // Framebuffers are removed with the KMS device
+    }
+    return index - 1;
+}
+
+// FIFO: blocks until the new buffer is on screen, then the previous one is free for rendering again
+void SGbmPlatform::SwapBuffers()
+{
+    eglSwapBuffers(Display, EglSurface);
+    gbm_bo* bo = gbm_surface_lock_front_buffer(Surface);
+    int index = bo != nullptr ? Framebuffer(bo) : -1;
+    if (index < 0 || !Kms.Show(index))
+    {
+        if (bo != nullptr)
+        {
+            gbm_surface_release_buffer(Surface, bo);
+        }
+        return;
+    }
+    Kms.WaitFlip(-1);
+    if (Front != nullptr)
+    {
+        gbm_surface_release_buffer(Surface, Front);
+    }
+    Front = bo;
+}
+
+bool SGbmPlatform::PollEvents()
+{
+    return true; // No input, main quits on SIGINT/SIGTERM
+}
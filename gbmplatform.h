@@ -0,0 +1,33 @@
+#pragma once
+
+#include "kms.h"
+#include "platform.h"
+
+struct gbm_bo;
+struct gbm_device;
+struct gbm_surface;
+
+// EGL on a GBM surface of the DRM device, presented with atomic page flips. No window system or
+// compositor, needs DRM master (e.g. started from a VT). Runs on vkms.
+class SGbmPlatform : public SPlatform
+{
+public:
+    SGbmPlatform();
+    bool Create() override;
+    void Destroy() override;
+    void GetFramebufferSize(unsigned& width, unsigned& height) const override;
+    void SwapBuffers() override;
+    bool PollEvents() override;
+
+private:
+    bool CreateContext();
+    int Framebuffer(gbm_bo* bo);
+
+    SKms Kms;
+    gbm_device* Device;
+    gbm_surface* Surface;
+    gbm_bo* Front; // On screen, locked until the next flip completed
+    void* Display; // EGLDisplay
+    void* Context; // EGLContext
+    void* EglSurface; // EGLSurface
+};
@@ -0,0 +1,77 @@
+#include <stdio.h>
+
+#include <GLFW/glfw3.h>
+
+#include "glloader.h"
+#include "startupprofile.h"
+
+#include "glfwplatform.h"
+
+SGlfwPlatform::SGlfwPlatform(bool fullScreen) :
+    FullScreen(fullScreen),
+    Window(nullptr)
+{
+}
+
+bool SGlfwPlatform::Create()
+{
+    SStartupPhase phase("glfwInit");
+    if (!glfwInit())
+    {
+        printf("glfwInit failed\n");
+        return false;
+    }
+    phase.Next("glfwCreateWindow");
+    glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
+    glfwWindowHint(GLFW_DOUBLEBUFFER, GLFW_TRUE);
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
+    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
+    glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
+    GLFWmonitor* monitor = glfwGetPrimaryMonitor();
+    const GLFWvidmode* mode = glfwGetVideoMode(monitor);
+    Window = glfwCreateWindow(mode->width, mode->height, "Raspberry PI 4 tearing", FullScreen ? monitor : nullptr, nullptr);
+    if (Window == nullptr)
+    {
+        printf("glfwCreateWindow failed\n");
+        glfwTerminate();
+        return false;
+    }
+    phase.Next("glfwMakeContextCurrent");
+    glfwMakeContextCurrent(Window);
+    glfwSwapInterval(1);
+    phase.Next("GL loader");
+    LazyLoadGLES2((GLADloadproc)glfwGetProcAddress);
+    LazyLoadEGL((GLADloadproc)glfwGetProcAddress);
+    return true;
+}
+
+void SGlfwPlatform::Destroy()
+{
+    if (Window != nullptr)
+    {
+        glfwDestroyWindow(Window);
+        glfwTerminate();
+    }
+    Window = nullptr;
+}
+
+void SGlfwPlatform::GetFramebufferSize(unsigned& width, unsigned& height) const
+{
+    int w;
+    int h;
+    glfwGetFramebufferSize(Window, &w, &h);
+    width = w;
+    height = h;
+}
+
+void SGlfwPlatform::SwapBuffers()
+{
+    glfwSwapBuffers(Window);
+}
+
+bool SGlfwPlatform::PollEvents()
+{
+    glfwPollEvents();
+    return !glfwWindowShouldClose(Window);
+}
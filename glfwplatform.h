@@ -0,0 +1,21 @@
+#pragma once
+
+#include "platform.h"
+
+struct GLFWwindow;
+
+// GLFW window on the EGL context API, needs X11 or Wayland
+class SGlfwPlatform : public SPlatform
+{
+public:
+    SGlfwPlatform(bool fullScreen);
+    bool Create() override;
+    void Destroy() override;
+    void GetFramebufferSize(unsigned& width, unsigned& height) const override;
+    void SwapBuffers() override;
+    bool PollEvents() override;
+
+private:
+    const bool FullScreen;
+    GLFWwindow* Window;
+};
@@ -0,0 +1,232 @@
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include "glloader.h"
+
+using namespace std;
+
+struct tstEntry
+{
+    const char* Name;
+    void** Slot; // glad function pointer
+    void* Trampoline;
+    bool Egl;
+    bool Missing; // Reported once
+};
+
+static GLADloadproc GlLoad = nullptr;
+static GLADloadproc EglLoad = nullptr;
+static unordered_set<string> GlExtensions; // Empty until the first query
+static unordered_map<EGLDisplay, unordered_set<string>> EglExtensions;
+
+static void* Resolve(void** slot);
+
+// Called through a glad pointer before its first resolution
+template <typename F, F* Slot>
+struct tstTrampoline;
+
+template <typename R, typename... A, R (**Slot)(A...)>
+struct tstTrampoline<R (*)(A...), Slot>
+{
+    static R Call(A... args)
+    {
+        void* proc = Resolve((void**)Slot);
+        if (proc == nullptr)
+        {
+            return R();
+        }
+        *Slot = (R (*)(A...))proc;
+        return (*Slot)(args...);
+    }
+};
+
+#define LAZY_GL(name) { #name, (void**)&glad_##name, (void*)&tstTrampoline<decltype(glad_##name), &glad_##name>::Call, false, false }
+#define LAZY_EGL(name) { #name, (void**)&glad_##name, (void*)&tstTrampoline<decltype(glad_##name), &glad_##name>::Call, true, false }
+
+// Every glad pointer called in this tree. EGL core functions are linked directly.
+static tstEntry Entries[] =
+{
+    LAZY_EGL(eglCreateImageKHR),
+    LAZY_EGL(eglCreatePlatformWindowSurfaceEXT),
+    LAZY_EGL(eglDestroyImageKHR),
+    LAZY_EGL(eglGetPlatformDisplayEXT),
+    LAZY_EGL(eglQueryDmaBufFormatsEXT),
+    LAZY_GL(glActiveTexture),
+    LAZY_GL(glAttachShader),
+    LAZY_GL(glBindBuffer),
+    LAZY_GL(glBindFramebuffer),
+    LAZY_GL(glBindImageTexture),
+    LAZY_GL(glBindTexture),
+    LAZY_GL(glBindVertexArray),
+    LAZY_GL(glBufferData),
+    LAZY_GL(glCheckFramebufferStatus),
+    LAZY_GL(glClientWaitSync),
+    LAZY_GL(glCompileShader),
+    LAZY_GL(glCreateProgram),
+    LAZY_GL(glCreateShader),
+    LAZY_GL(glDebugMessageCallback),
+    LAZY_GL(glDeleteBuffers),
+    LAZY_GL(glDeleteFramebuffers),
+    LAZY_GL(glDeleteProgram),
+    LAZY_GL(glDeleteShader),
+    LAZY_GL(glDeleteSync),
+    LAZY_GL(glDeleteTextures),
+    LAZY_GL(glDeleteVertexArrays),
+    LAZY_GL(glDispatchCompute),
+    LAZY_GL(glDrawArrays),
+    LAZY_GL(glDrawElements),
+    LAZY_GL(glEGLImageTargetTexture2DOES),
+    LAZY_GL(glEnable),
+    LAZY_GL(glEnableVertexAttribArray),
+    LAZY_GL(glFenceSync),
+    LAZY_GL(glFinish),
+    LAZY_GL(glFlush),
+    LAZY_GL(glFramebufferTexture2D),
+    LAZY_GL(glGenBuffers),
+    LAZY_GL(glGenFramebuffers),
+    LAZY_GL(glGenTextures),
+    LAZY_GL(glGenVertexArrays),
+    LAZY_GL(glGetIntegerv),
+    LAZY_GL(glGetProgramBinary),
+    LAZY_GL(glGetProgramInfoLog),
+    LAZY_GL(glGetProgramiv),
+    LAZY_GL(glGetShaderInfoLog),
+    LAZY_GL(glGetShaderiv),
+    LAZY_GL(glGetString),
+    LAZY_GL(glGetStringi),
+    LAZY_GL(glGetSynciv),
+    LAZY_GL(glGetUniformLocation),
+    LAZY_GL(glLinkProgram),
+    LAZY_GL(glMemoryBarrier),
+    LAZY_GL(glPixelStorei),
+    LAZY_GL(glProgramBinary),
+    LAZY_GL(glProgramParameteri),
+    LAZY_GL(glShaderSource),
+    LAZY_GL(glTexImage2D),
+    LAZY_GL(glTexParameteri),
+    LAZY_GL(glTexStorage2D),
+    LAZY_GL(glTexSubImage2D),
+    LAZY_GL(glUniform1f),
+    LAZY_GL(glUniform1i),
+    LAZY_GL(glUniform2i),
+    LAZY_GL(glUniform3fv),
+    LAZY_GL(glUniformMatrix3fv),
+    LAZY_GL(glUseProgram),
+    LAZY_GL(glVertexAttribPointer),
+    LAZY_GL(glViewport),
+};
+
+static void* Resolve(tstEntry& entry)
+{
+    GLADloadproc load = entry.Egl ? EglLoad : GlLoad;
+    void* proc = load != nullptr ? load(entry.Name) : nullptr;
+    if (proc == nullptr && !entry.Missing)
+    {
+        entry.Missing = true;
+        printf("Entry point %s missing\n", entry.Name);
+    }
+    return proc;
+}
+
+// Once per entry point, a linear search is cheaper than building an index at startup
+static void* Resolve(void** slot)
+{
+    for (tstEntry& entry : Entries)
+    {
+        if (entry.Slot == slot)
+        {
+            return Resolve(entry);
+        }
+    }
+    return nullptr;
+}
+
+static void Install(bool egl)
+{
+    for (tstEntry& entry : Entries)
+    {
+        if (entry.Egl == egl)
+        {
+            *entry.Slot = entry.Trampoline;
+            entry.Missing = false;
+        }
+    }
+}
+
+void LazyLoadEGL(GLADloadproc load)
+{
+    EglLoad = load;
+    EglExtensions.clear();
+    Install(true);
+}
+
+void LazyLoadGLES2(GLADloadproc load)
+{
+    GlLoad = load;
+    GlExtensions.clear();
+    Install(false);
+}
+
+unsigned ResolveLazyEntries()
+{
+    unsigned missing = 0;
+    for (tstEntry& entry : Entries)
+    {
+        if (*entry.Slot == entry.Trampoline)
+        {
+            void* proc = Resolve(entry);
+            if (proc != nullptr)
+            {
+                *entry.Slot = proc;
+            }
+            else
+            {
+                missing++;
+            }
+        }
+    }
+    return missing;
+}
+
+bool HasGlExtension(const char* name)
+{
+    if (GlExtensions.empty())
+    {
+        GLint count = 0;
+        glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+        GlExtensions.reserve(count);
+        for (GLint i = 0; i < count; i++)
+        {
+            GlExtensions.insert((const char*)glGetStringi(GL_EXTENSIONS, i));
+        }
+    }
+    return GlExtensions.count(name) != 0;
+}
+
+bool HasEglExtension(EGLDisplay display, const char* name)
+{
+    auto it = EglExtensions.find(display);
+    if (it == EglExtensions.end())
+    {
+        it = EglExtensions.emplace(display, unordered_set<string>()).first;
+        const char* list = eglQueryString(display, EGL_EXTENSIONS);
+        if (list == nullptr)
+        {
+            eglGetError(); // EGL_NO_DISPLAY without EGL_EXT_client_extensions, not an error for the caller
+            list = "";
+        }
+        while (*list != '\0')
+        {
+            size_t length = strcspn(list, " ");
+            if (length != 0)
+            {
+                it->second.emplace(list, length);
+            }
+            list += length + (list[length] == ' ' ? 1 : 0);
+        }
+    }
+    return it->second.count(name) != 0;
+}
@@ -0,0 +1,19 @@
+#pragma once
+
+#include "glad/glad.h"
+#include "glad/glad_egl.h"
+
+// Replaces gladLoadGLES2Loader() and gladLoadEGLLoader(), which resolve every entry point of GLES 3.1,
+// EGL and ~300 extensions and match each extension name against the driver's list. Only the glad
+// pointers this tree calls get a trampoline; the first call resolves the entry point, stores it in
+// the pointer and forwards, later calls go straight to the driver. A function missing from the table
+// in glloader.cpp stays NULL, add it there when calling a new one.
+// Render thread only.
+void LazyLoadEGL(GLADloadproc load); // Before the first EGL extension call, no display needed
+void LazyLoadGLES2(GLADloadproc load); // Context current if the loader needs it, e.g. glfwGetProcAddress
+unsigned ResolveLazyEntries(); // Resolves all entry points now, returns the number missing
+
+// Pointers are never NULL with trampolines, availability is checked by extension.
+// Each list is split into a hash set once.
+bool HasGlExtension(const char* name); // Context current, the set follows LazyLoadGLES2()
+bool HasEglExtension(EGLDisplay display, const char* name); // EGL_NO_DISPLAY for client extensions
@@ -0,0 +1,352 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
+#include <libdrm/drm_fourcc.h>
+#include <string>
+
+#include "glad/glad.h"
+#include "glad/glad_egl.h"
+
+#include "gpuconvert.h"
+#include "startupprofile.h"
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+
+using namespace std;
+
+static const unsigned LocalSize = 16; // Work group is LocalSize x LocalSize target pixels
+
+static const string sCompute = R"glsl(
+#version 310 es
+precision highp float;
+precision highp int;
+layout(local_size_x = 16, local_size_y = 16) in;
+uniform highp sampler2D Source; // Raw bytes, one R8 texel each
+layout(rgba8, binding = 0) writeonly uniform highp image2D Target;
+uniform ivec2 SourceSize; // Pixels
+uniform ivec2 TargetSize;
+uniform mat3 YuvMatrix;
+uniform vec3 YuvOffset;
+
+float Byte(int x, int y)
+{
+    return texelFetch(Source, ivec2(x, y), 0).r;
+}
+
+vec3 Pixel(ivec2 p)
+{
+#ifdef RGB24
+    int x = p.x * 3;
+    return vec3(Byte(x + 2, p.y), Byte(x + 1, p.y), Byte(x, p.y));
+#else
+    int x = (p.x >> 1) * 4; // U Y0 V Y1
+    vec3 yuv = vec3(Byte(x + 1 + (p.x & 1) * 2, p.y), Byte(x, p.y), Byte(x + 2, p.y));
+    return clamp(YuvMatrix * (yuv - YuvOffset), 0.0, 1.0);
+#endif
+}
+
+void main()
+{
+    ivec2 t = ivec2(gl_GlobalInvocationID.xy);
+    if (any(greaterThanEqual(t, TargetSize)))
+    {
+        return;
+    }
+#ifdef SCALE
+    vec2 s = max((vec2(t) + 0.5) * vec2(SourceSize) / vec2(TargetSize) - 0.5, vec2(0.0));
+    ivec2 p0 = min(ivec2(s), SourceSize - 1);
+    ivec2 p1 = min(p0 + 1, SourceSize - 1);
+    vec2 f = s - vec2(p0);
+    vec3 top = mix(Pixel(p0), Pixel(ivec2(p1.x, p0.y)), f.x);
+    vec3 bottom = mix(Pixel(ivec2(p0.x, p1.y)), Pixel(p1), f.x);
+    vec3 c = mix(top, bottom, f.y);
+#else
+    vec3 c = Pixel(t);
+#endif
+    imageStore(Target, t, vec4(c, 1.0));
+}
+)glsl";
+
+SGpuConvert::SGpuConvert() :
+    Program(0),
+    Target(0),
+    RequestedWidth(0),
+    RequestedHeight(0),
+    SourceWidth(0),
+    SourceHeight(0),
+    TargetWidth(0),
+    TargetHeight(0),
+    Format(eSF_Rgb24),
+    Bt709(true),
+    FullRange(false),
+    Sources()
+{
+}
+
+void SGpuConvert::SetTargetSize(unsigned width, unsigned height)
+{
+    RequestedWidth = width;
+    RequestedHeight = height;
+}
+
+unsigned SGpuConvert::GetTargetWidth() const
+{
+    return TargetWidth;
+}
+
+// Program and target follow the source, recreated when format or size change
+bool SGpuConvert::Setup(unsigned width, unsigned height, ESourceFormat format, bool bt709, bool fullRange)
+{
+    unsigned targetWidth = RequestedWidth ? RequestedWidth : width;
+    unsigned targetHeight = RequestedHeight ? RequestedHeight : height;
+    if (Program != 0 && width == SourceWidth && height == SourceHeight && format == Format &&
+        bt709 == Bt709 && fullRange == FullRange && targetWidth == TargetWidth && targetHeight == TargetHeight)
+    {
+        return true;
+    }
+    if (Program != 0)
+    {
+        glDeleteProgram(Program);
+        glDeleteTextures(1, &Target);
+    }
+    SourceWidth = width;
+    SourceHeight = height;
+    TargetWidth = targetWidth;
+    TargetHeight = targetHeight;
+    Format = format;
+    Bt709 = bt709;
+    FullRange = fullRange;
+
+    Program = CompileProgram(format, width != targetWidth || height != targetHeight);
+    if (Program == 0)
+    {
+        return false;
+    }
+    glGenTextures(1, &Target);
+    glBindTexture(GL_TEXTURE_2D, Target);
+    glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, TargetWidth, TargetHeight);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+
+    // Y'CbCr -> R'G'B': matrix from Kr/Kb, scaled for the quantization range
+    float kr = bt709 ? 0.2126f : 0.299f;
+    float kb = bt709 ? 0.0722f : 0.114f;
+    float kg = 1.0f - kr - kb;
+    float ys = fullRange ? 1.0f : 255.0f / 219.0f;
+    float cs = fullRange ? 1.0f : 255.0f / 224.0f;
+    // Column major: columns are the Y, Cb and Cr contributions
+    GLfloat matrix[9] =
+    {
+        ys, ys, ys,
+        0.0f, -2.0f * kb * (1.0f - kb) / kg * cs, 2.0f * (1.0f - kb) * cs,
+        2.0f * (1.0f - kr) * cs, -2.0f * kr * (1.0f - kr) / kg * cs, 0.0f
+    };
+    GLfloat offset[3] = { fullRange ? 0.0f : 16.0f / 255.0f, 128.0f / 255.0f, 128.0f / 255.0f };
+
+    glUseProgram(Program);
+    glUniform1i(glGetUniformLocation(Program, "Source"), 0);
+    glUniform2i(glGetUniformLocation(Program, "SourceSize"), SourceWidth, SourceHeight);
+    glUniform2i(glGetUniformLocation(Program, "TargetSize"), TargetWidth, TargetHeight);
+    glUniformMatrix3fv(glGetUniformLocation(Program, "YuvMatrix"), 1, GL_FALSE, matrix);
+    glUniform3fv(glGetUniformLocation(Program, "YuvOffset"), 1, offset);
+    printf("GPU convert %ux%u %s -> %ux%u RGBA8\n", SourceWidth, SourceHeight, format == eSF_Uyvy ? "UYVY" : "RGB24", TargetWidth, TargetHeight);
+    return true;
+}
+
+unsigned SGpuConvert::CompileProgram(ESourceFormat format, bool scale)
+{
+    // Variant selected by defines behind the #version line
+    string source = sCompute;
+    string defines = string(format == eSF_Rgb24 ? "#define RGB24\n" : "") + (scale ? "#define SCALE\n" : "");
+    source.insert(source.find('\n', 1) + 1, defines);
+    const GLchar* sourcePointer = source.c_str();
+
+    SStartupPhase phase("Compile compute shader");
+    GLint result = GL_FALSE;
+    GLuint shader = glCreateShader(GL_COMPUTE_SHADER);
+    glShaderSource(shader, 1, &sourcePointer, NULL);
+    glCompileShader(shader);
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &result);
+    if (result == GL_FALSE) {
+        int InfoLogLength;
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &InfoLogLength);
+        vector<char> ShaderErrorMessage(InfoLogLength + 1);
+        glGetShaderInfoLog(shader, InfoLogLength, NULL, &ShaderErrorMessage[0]);
+        printf("%s\n", &ShaderErrorMessage[0]);
+        glDeleteShader(shader);
+        return 0;
+    }
+
+    phase.Next("Link compute program");
+    GLuint program = glCreateProgram();
+    glAttachShader(program, shader);
+    glLinkProgram(program);
+    glDeleteShader(shader);
+    glGetProgramiv(program, GL_LINK_STATUS, &result);
+    if (result == GL_FALSE) {
+        int InfoLogLength;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &InfoLogLength);
+        vector<char> ProgramErrorMessage(InfoLogLength + 1);
+        glGetProgramInfoLog(program, InfoLogLength, NULL, &ProgramErrorMessage[0]);
+        printf("%s\n", &ProgramErrorMessage[0]);
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+// Index of the source, -1 on failure
+unsigned SGpuConvert::AddSource(int dmaFd, unsigned length, unsigned width, unsigned height, unsigned pitch,
+    ESourceFormat format, bool bt709, bool fullRange)
+{
+    GLint program;
+    glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+    bool setup = Setup(width, height, format, bt709, fullRange);
+    glUseProgram(program);
+    if (!setup)
+    {
+        return -1;
+    }
+
+    tstSource source;
+    source.Map = nullptr;
+    source.DmaFd = dmaFd;
+    source.Length = length;
+    source.Pitch = pitch;
+    source.Height = height;
+    glGenTextures(1, &source.Texture);
+    glBindTexture(GL_TEXTURE_2D, source.Texture);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    EGLint attribs[] =
+    {
+        EGL_WIDTH, (EGLint)pitch,
+        EGL_HEIGHT, (EGLint)height,
+        EGL_LINUX_DRM_FOURCC_EXT, DRM_FORMAT_R8,
+        EGL_DMA_BUF_PLANE0_FD_EXT, dmaFd,
+        EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
+        EGL_DMA_BUF_PLANE0_PITCH_EXT, (EGLint)pitch,
+        EGL_NONE
+    };
+    EGLImage image = eglCreateImageKHR(eglGetCurrentDisplay(), EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
+    if (image)
+    {
+        glEGLImageTargetTexture2DOES(GL_TEXTURE_2D, image);
+        eglDestroyImageKHR(eglGetCurrentDisplay(), image);
+    }
+    else
+    {
+        // No dmabuf import, upload every frame from the mapped buffer
+        glTexStorage2D(GL_TEXTURE_2D, 1, GL_R8, pitch, height);
+        source.Map = mmap(nullptr, length, PROT_READ, MAP_SHARED, dmaFd, 0);
+        if (source.Map == MAP_FAILED)
+        {
+            printf("GPU convert: no EGL import (0x%x) and mmap failed\n", eglGetError());
+            source.Map = nullptr;
+        }
+    }
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    unsigned index = 0;
+    while (index < Sources.size() && Sources[index].Texture != 0)
+    {
+        index++;
+    }
+    if (index == Sources.size())
+    {
+        Sources.push_back(source);
+    }
+    else
+    {
+        Sources[index] = source;
+    }
+    printf("GPU convert source #%u pitch %u, DMA %d, %s\n", index, pitch, dmaFd, source.Map ? "upload" : "EGL image");
+    return index;
+}
+
+void SGpuConvert::RemoveSource(unsigned index)
+{
+    if (index < Sources.size() && Sources[index].Texture != 0)
+    {
+        tstSource& source = Sources[index];
+        glDeleteTextures(1, &source.Texture);
+        if (source.Map)
+        {
+            munmap(source.Map, source.Length);
+        }
+        source.Texture = 0;
+        source.Map = nullptr;
+    }
+}
+
+static void SyncDmaBuf(int fd, uint64_t flags)
+{
+    struct dma_buf_sync sync;
+    CLEAR(sync);
+    sync.flags = flags;
+    if (ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) != 0 && errno != ENOTTY) // Plain memfd of a synthetic source
+    {
+        printf("DMA_BUF_IOCTL_SYNC: %s\n", strerror(errno));
+    }
+}
+
+void SGpuConvert::Upload(const tstSource& source)
+{
+    SyncDmaBuf(source.DmaFd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+    glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, source.Pitch, source.Height, GL_RED, GL_UNSIGNED_BYTE, source.Map);
+    SyncDmaBuf(source.DmaFd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+}
+
+void SGpuConvert::Convert(unsigned index)
+{
+    if (index >= Sources.size() || Sources[index].Texture == 0 || Program == 0)
+    {
+        return;
+    }
+    const tstSource& source = Sources[index];
+    GLint program;
+    glGetIntegerv(GL_CURRENT_PROGRAM, &program);
+    if ((RequestedWidth != 0 && RequestedWidth != TargetWidth) || (RequestedHeight != 0 && RequestedHeight != TargetHeight))
+    {
+        Setup(SourceWidth, SourceHeight, Format, Bt709, FullRange); // Framebuffer resized
+    }
+
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, source.Texture);
+    if (source.Map)
+    {
+        Upload(source);
+    }
+    glUseProgram(Program);
+    glBindImageTexture(0, Target, 0, GL_FALSE, 0, GL_WRITE_ONLY, GL_RGBA8);
+    glDispatchCompute((TargetWidth + LocalSize - 1) / LocalSize, (TargetHeight + LocalSize - 1) / LocalSize, 1);
+    // The draw samples the target right after
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+    glUseProgram(program);
+    glBindTexture(GL_TEXTURE_2D, Target);
+}
+
+void SGpuConvert::Destroy()
+{
+    for (unsigned i = 0; i < Sources.size(); i++)
+    {
+        RemoveSource(i);
+    }
+    Sources.clear();
+    if (Program != 0)
+    {
+        glDeleteProgram(Program);
+        glDeleteTextures(1, &Target);
+        Program = 0;
+        Target = 0;
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <stddef.h>
+#include <vector>
+
+// GLES 3.1 compute stage replacing the ISP: unpacks raw RGB24 or UYVY capture buffers into an
+// RGBA8 texture, optionally scaled to the target size in the same pass.
+// Capture buffers are imported as R8 EGL images (one texel per byte). Where the dmabuf import is
+// not available (e.g. Mesa llvmpipe) the buffer is mmapped and uploaded instead.
+class SGpuConvert
+{
+public:
+    enum ESourceFormat
+    {
+        eSF_Rgb24, // tc358743 'RGB3', bytes in B, G, R order
+        eSF_Uyvy,
+    };
+
+    SGpuConvert();
+    void SetTargetSize(unsigned width, unsigned height); // 0 keeps the source size
+    unsigned GetTargetWidth() const; // Of the RGBA8 target, after AddSource()
+    unsigned AddSource(int dmaFd, unsigned length, unsigned width, unsigned height, unsigned pitch,
+        ESourceFormat format, bool bt709, bool fullRange);
+    void RemoveSource(unsigned index);
+    void Convert(unsigned index); // Leaves the target bound to GL_TEXTURE_2D
+    void Destroy();
+
+private:
+    struct tstSource
+    {
+        unsigned Texture; // R8, pitch x height
+        void* Map; // Upload fallback, nullptr when imported as EGL image
+        int DmaFd;
+        unsigned Length;
+        unsigned Pitch;
+        unsigned Height;
+    };
+
+    bool Setup(unsigned width, unsigned height, ESourceFormat format, bool bt709, bool fullRange);
+    unsigned CompileProgram(ESourceFormat format, bool scale);
+    void Upload(const tstSource& source);
+
+    unsigned Program;
+    unsigned Target; // RGBA8, TargetWidth x TargetHeight
+    unsigned RequestedWidth;
+    unsigned RequestedHeight;
+    unsigned SourceWidth;
+    unsigned SourceHeight;
+    unsigned TargetWidth;
+    unsigned TargetHeight;
+    ESourceFormat Format;
+    bool Bt709;
+    bool FullRange;
+    std::vector<tstSource> Sources;
+};
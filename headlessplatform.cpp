@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <thread>
+
+#include "glloader.h"
+#include "startupprofile.h"
+
+#include "headlessplatform.h"
+
+using namespace std;
+
+SHeadlessPlatform::SHeadlessPlatform(unsigned width, unsigned height, unsigned refreshHz) :
+    Width(width),
+    Height(height),
+    RefreshHz(refreshHz),
+    Display(EGL_NO_DISPLAY),
+    Context(EGL_NO_CONTEXT),
+    Pbuffer(EGL_NO_SURFACE),
+    InFlight(nullptr),
+    Frames(0),
+    Start(),
+    NextVsync()
+{
+}
+
+bool SHeadlessPlatform::Create()
+{
+    SStartupPhase phase("eglInitialize");
+    LazyLoadEGL((GLADloadproc)eglGetProcAddress);
+    if (!HasEglExtension(EGL_NO_DISPLAY, "EGL_EXT_platform_base"))
+    {
+        printf("EGL_EXT_platform_base missing\n");
+        return false;
+    }
+    Display = eglGetPlatformDisplayEXT(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    EGLint major;
+    EGLint minor;
+    if (Display == EGL_NO_DISPLAY || !eglInitialize(Display, &major, &minor))
+    {
+        printf("eglInitialize: error 0x%x\n", eglGetError());
+        Destroy();
+        return false;
+    }
+    eglBindAPI(EGL_OPENGL_ES_API);
+    phase.Next("EGL context");
+
+    const EGLint configAttribs[] =
+    {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+        EGL_RENDERABLE_TYPE, EGL_OPENGL_ES3_BIT_KHR,
+        EGL_NONE
+    };
+    EGLConfig config;
+    EGLint count = 0;
+    if (!eglChooseConfig(Display, configAttribs, &config, 1, &count) || count == 0)
+    {
+        printf("No EGL config for GLES 3\n");
+        Destroy();
+        return false;
+    }
+    const EGLint contextAttribs[] =
+    {
+        EGL_CONTEXT_MAJOR_VERSION_KHR, 3,
+        EGL_CONTEXT_MINOR_VERSION_KHR, 1,
+        EGL_NONE
+    };
+    Context = eglCreateContext(Display, config, EGL_NO_CONTEXT, contextAttribs);
+    bool current = Context != EGL_NO_CONTEXT && eglMakeCurrent(Display, EGL_NO_SURFACE, EGL_NO_SURFACE, Context);
+    if (Context != EGL_NO_CONTEXT && !current)
+    {
+        // Without EGL_KHR_surfaceless_context a dummy pbuffer makes the context current
+        const EGLint pbufferAttribs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+        Pbuffer = eglCreatePbufferSurface(Display, config, pbufferAttribs);
+        current = Pbuffer != EGL_NO_SURFACE && eglMakeCurrent(Display, Pbuffer, Pbuffer, Context);
+    }
+    if (!current)
+    {
+        printf("EGL context: error 0x%x\n", eglGetError());
+        Destroy();
+        return false;
+    }
+    phase.Next("GL loader");
+    LazyLoadGLES2((GLADloadproc)eglGetProcAddress);
+    printf("Headless platform: EGL %d.%d, %s, %ux%u at %u Hz (0: uncapped)\n", major, minor, glGetString(GL_RENDERER),
+        Width, Height, RefreshHz);
+    Start = chrono::steady_clock::now();
+    NextVsync = Start;
+    return true;
+}
+
+void SHeadlessPlatform::Destroy()
+{
+    if (Frames != 0)
+    {
+        double seconds = chrono::duration<double>(chrono::steady_clock::now() - Start).count();
+        printf("Headless: %u frames in %.1f s, %.1f fps\n", Frames, seconds, Frames / seconds);
+    }
+    if (InFlight != nullptr)
+    {
+        glDeleteSync((GLsync)InFlight);
+    }
+    if (Display != EGL_NO_DISPLAY)
+    {
+        eglMakeCurrent(Display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+        if (Pbuffer != EGL_NO_SURFACE)
+        {
+            eglDestroySurface(Display, Pbuffer);
+        }
+        if (Context != EGL_NO_CONTEXT)
+        {
+            eglDestroyContext(Display, Context);
+        }
+        eglTerminate(Display);
+    }
+    Display = EGL_NO_DISPLAY;
+    Context = EGL_NO_CONTEXT;
+    Pbuffer = EGL_NO_SURFACE;
+    InFlight = nullptr;
+    Frames = 0;
+}
+
+void SHeadlessPlatform::GetFramebufferSize(unsigned& width, unsigned& height) const
+{
+    width = Width;
+    height = Height;
+}
+
+// Like a double buffered swap chain: waits for the GPU to finish the previous frame, not this one
+void SHeadlessPlatform::SwapBuffers()
+{
+    GLsync fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    glFlush();
+    if (InFlight != nullptr)
+    {
+        glClientWaitSync((GLsync)InFlight, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+        glDeleteSync((GLsync)InFlight);
+    }
+    InFlight = fence;
+    Frames++;
+    if (RefreshHz != 0)
+    {
+        NextVsync += chrono::nanoseconds(1000000000 / RefreshHz);
+        chrono::steady_clock::time_point now = chrono::steady_clock::now();
+        if (NextVsync > now)
+        {
+            this_thread::sleep_until(NextVsync);
+        }
+        else
+        {
+            NextVsync = now; // Missed, no catching up
+        }
+    }
+}
+
+bool SHeadlessPlatform::PollEvents()
+{
+    return true; // No input, main quits on SIGINT/SIGTERM
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <chrono>
+
+#include "platform.h"
+
+// Surfaceless EGL (EGL_MESA_platform_surfaceless) without any display, main renders into an FBO.
+// Paced by a virtual refresh rate or uncapped, at most one frame in flight on the GPU.
+// For benchmarks and servers, works on Mesa llvmpipe.
+class SHeadlessPlatform : public SPlatform
+{
+public:
+    SHeadlessPlatform(unsigned width, unsigned height, unsigned refreshHz); // 0 Hz renders uncapped
+    bool Create() override;
+    void Destroy() override;
+    void GetFramebufferSize(unsigned& width, unsigned& height) const override;
+    void SwapBuffers() override;
+    bool PollEvents() override;
+
+private:
+    const unsigned Width;
+    const unsigned Height;
+    const unsigned RefreshHz;
+    void* Display; // EGLDisplay
+    void* Context; // EGLContext
+    void* Pbuffer; // EGLSurface, only without EGL_KHR_surfaceless_context
+    void* InFlight; // GLsync of the previous frame
+    unsigned Frames;
+    std::chrono::steady_clock::time_point Start;
+    std::chrono::steady_clock::time_point NextVsync;
+};
@@ -0,0 +1,125 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#include "glad/glad.h"
+
+#include "importcache.h"
+
+using namespace std;
+
+SImportCache::SImportCache(unsigned capacity) :
+    Capacity(capacity),
+    Entries(),
+    ByKey(),
+    ById(),
+    NextId(0)
+{
+}
+
+// The inode identifies the buffer behind any fd referring to it
+bool SImportCache::MakeKey(int dmaFd, unsigned fourcc, unsigned width, unsigned height, unsigned pitch, unsigned hints, uint64_t modifier, tstKey& key)
+{
+    struct stat st;
+    if (fstat(dmaFd, &st) != 0)
+    {
+        printf("Import cache fstat DMA fd %d: %s\n", dmaFd, strerror(errno));
+        return false;
+    }
+    key.Device = st.st_dev;
+    key.Inode = st.st_ino;
+    key.Fourcc = fourcc;
+    key.Width = width;
+    key.Height = height;
+    key.Pitch = pitch;
+    key.Hints = hints;
+    key.Modifier = modifier;
+    return true;
+}
+
+bool SImportCache::Find(const tstKey& key, unsigned& id) const
+{
+    auto it = ByKey.find(key);
+    if (it == ByKey.end())
+    {
+        return false;
+    }
+    id = it->second->Id;
+    return true;
+}
+
+// A buffer imported with another layout was reallocated or reformatted, its old import is dropped.
+// Over the capacity the least recently selected import goes.
+unsigned SImportCache::Insert(const tstKey& key, unsigned texture)
+{
+    for (tEntryIt it = Entries.begin(); it != Entries.end();)
+    {
+        tEntryIt entry = it++;
+        if (entry->Key.Device == key.Device && entry->Key.Inode == key.Inode)
+        {
+            Erase(entry);
+        }
+    }
+    while (!Entries.empty() && Entries.size() >= Capacity)
+    {
+        printf("Import cache full, releasing buffer #%u\n", Entries.back().Id);
+        Erase(prev(Entries.end()));
+    }
+
+    Entries.push_front({ key, NextId++, texture });
+    ByKey[key] = Entries.begin();
+    ById[Entries.front().Id] = Entries.begin();
+    return Entries.front().Id;
+}
+
+unsigned SImportCache::GetTexture(unsigned id)
+{
+    auto it = ById.find(id);
+    if (it == ById.end())
+    {
+        return 0;
+    }
+    Entries.splice(Entries.begin(), Entries, it->second); // Iterators stay valid
+    return it->second->Texture;
+}
+
+void SImportCache::Erase(unsigned id)
+{
+    auto it = ById.find(id);
+    if (it != ById.end())
+    {
+        Erase(it->second);
+    }
+}
+
+unsigned SImportCache::GetSize() const
+{
+    return Entries.size();
+}
+
+void SImportCache::Erase(tEntryIt entry)
+{
+    glDeleteTextures(1, &entry->Texture);
+    ByKey.erase(entry->Key);
+    ById.erase(entry->Id);
+    Entries.erase(entry);
+}
+
+size_t SImportCache::tstKeyHash::operator()(const tstKey& key) const
+{
+    // FNV-1a over the fields
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (uint64_t field : { key.Device, key.Inode, (uint64_t)key.Fourcc, (uint64_t)key.Width, (uint64_t)key.Height,
+        (uint64_t)key.Pitch, (uint64_t)key.Hints, key.Modifier })
+    {
+        hash = (hash ^ field) * 0x100000001b3ull;
+    }
+    return (size_t)hash;
+}
+
+bool SImportCache::tstKeyEqual::operator()(const tstKey& a, const tstKey& b) const
+{
+    return a.Device == b.Device && a.Inode == b.Inode && a.Fourcc == b.Fourcc && a.Width == b.Width &&
+        a.Height == b.Height && a.Pitch == b.Pitch && a.Hints == b.Hints && a.Modifier == b.Modifier;
+}
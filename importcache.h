@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <list>
+#include <unordered_map>
+
+// Textures of imported dmabufs keyed by the identity of the buffer instead of its fd: the inode of the
+// dmabuf plus the layout it is imported with. A buffer handed over again under another fd (DMABUF
+// import queue, other process, re-export) maps to its first import, so EGL imports it exactly once.
+// Bounded, the least recently selected import is released first. Render thread only.
+class SImportCache
+{
+public:
+    struct tstKey
+    {
+        uint64_t Device; // st_dev and st_ino of the dmabuf, unique while the buffer exists
+        uint64_t Inode;
+        uint32_t Fourcc;
+        uint32_t Width;
+        uint32_t Height;
+        uint32_t Pitch;
+        uint32_t Hints; // Import attributes beyond the layout, e.g. YUV matrix and range
+        uint64_t Modifier;
+    };
+
+    SImportCache(unsigned capacity);
+    static bool MakeKey(int dmaFd, unsigned fourcc, unsigned width, unsigned height, unsigned pitch, unsigned hints, uint64_t modifier, tstKey& key);
+    bool Find(const tstKey& key, unsigned& id) const;
+    unsigned Insert(const tstKey& key, unsigned texture); // Takes the texture, returns the buffer id
+    unsigned GetTexture(unsigned id); // 0 if released, else marks the import most recently used
+    void Erase(unsigned id); // Deletes the texture, unknown ids are ignored
+    unsigned GetSize() const;
+
+private:
+    struct tstEntry
+    {
+        tstKey Key;
+        unsigned Id;
+        unsigned Texture;
+    };
+
+    struct tstKeyHash
+    {
+        size_t operator()(const tstKey& key) const;
+    };
+
+    struct tstKeyEqual
+    {
+        bool operator()(const tstKey& a, const tstKey& b) const;
+    };
+
+    typedef std::list<tstEntry>::iterator tEntryIt;
+
+    void Erase(tEntryIt entry);
+
+    const unsigned Capacity;
+    std::list<tstEntry> Entries; // Most recently used first
+    std::unordered_map<tstKey, tEntryIt, tstKeyHash, tstKeyEqual> ByKey;
+    std::unordered_map<unsigned, tEntryIt> ById;
+    unsigned NextId; // Ids are never reused, a released one cannot alias a later import
+};
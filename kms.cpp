@@ -0,0 +1,468 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <xf86drm.h>
+#include <xf86drmMode.h>
+#include <algorithm>
+
+#include "kms.h"
+
+using namespace std;
+
+static const unsigned MaxCards = 8;
+
+SKms::SKms() :
+    Fd(-1),
+    ConnectorId(0),
+    CrtcId(0),
+    PlaneId(0),
+    ModeBlob(0),
+    ModeWidth(0),
+    ModeHeight(0),
+    ConnectorProperties(),
+    CrtcProperties(),
+    PlaneProperties(),
+    ModeSet(false),
+    FlipPending(false),
+    CommitSeq(0),
+    CompletedSeq(0),
+    Geometry(),
+    Buffers()
+{
+}
+
+bool SKms::Create(const char* device, unsigned fourcc)
+{
+    bool result = false;
+    if (device != nullptr)
+    {
+        result = Open(device) && FindOutput();
+    }
+    else
+    {
+        // Pi 4: card0 is v3d without outputs, card1 vc4. vkms adds another card.
+        for (unsigned i = 0; i < MaxCards && !result; i++)
+        {
+            string name = "/dev/dri/card" + to_string(i);
+            result = Open(name.c_str()) && FindOutput();
+            if (!result)
+            {
+                Destroy();
+            }
+        }
+    }
+    result = result && LoadProperties(ConnectorId, DRM_MODE_OBJECT_CONNECTOR, ConnectorProperties);
+    result = result && LoadProperties(CrtcId, DRM_MODE_OBJECT_CRTC, CrtcProperties);
+    result = result && (fourcc == 0 || SelectPlane(fourcc));
+    if (result)
+    {
+        printf("KMS: connector %u, CRTC %u, plane %u, mode %ux%u\n", ConnectorId, CrtcId, PlaneId, ModeWidth, ModeHeight);
+    }
+    else
+    {
+        printf("KMS: no usable output\n");
+        Destroy();
+    }
+    return result;
+}
+
+bool SKms::SelectPlane(unsigned fourcc)
+{
+    PlaneId = 0;
+    PlaneProperties.clear();
+    return FindPlane(fourcc) && LoadProperties(PlaneId, DRM_MODE_OBJECT_PLANE, PlaneProperties);
+}
+
+vector<unsigned> SKms::GetPlaneFormats() const
+{
+    vector<unsigned> formats;
+    drmModeRes* res = drmModeGetResources(Fd);
+    drmModePlaneRes* planes = drmModeGetPlaneResources(Fd);
+    if (res == nullptr || planes == nullptr)
+    {
+        drmModeFreeResources(res);
+        drmModeFreePlaneResources(planes);
+        return formats;
+    }
+    int crtcIndex = 0;
+    while (crtcIndex < res->count_crtcs && res->crtcs[crtcIndex] != CrtcId)
+    {
+        crtcIndex++;
+    }
+    for (uint32_t i = 0; i < planes->count_planes; i++)
+    {
+        drmModePlane* plane = drmModeGetPlane(Fd, planes->planes[i]);
+        if (plane == nullptr)
+        {
+            continue;
+        }
+        for (uint32_t f = 0; (plane->possible_crtcs & (1u << crtcIndex)) && f < plane->count_formats; f++)
+        {
+            if (find(formats.begin(), formats.end(), plane->formats[f]) == formats.end())
+            {
+                formats.push_back(plane->formats[f]);
+            }
+        }
+        drmModeFreePlane(plane);
+    }
+    drmModeFreePlaneResources(planes);
+    drmModeFreeResources(res);
+    return formats;
+}
+
+void SKms::Destroy()
+{
+    if (Fd >= 0)
+    {
+        WaitFlip(100);
+        for (unsigned i = 0; i < Buffers.size(); i++)
+        {
+            RemoveBuffer(i);
+        }
+        if (ModeBlob != 0)
+        {
+            drmModeDestroyPropertyBlob(Fd, ModeBlob);
+        }
+        close(Fd);
+    }
+    Fd = -1;
+    ModeBlob = 0;
+    ModeSet = false;
+    FlipPending = false;
+    Buffers.clear();
+    ConnectorProperties.clear();
+    CrtcProperties.clear();
+    PlaneProperties.clear();
+}
+
+int SKms::GetFd() const
+{
+    return Fd;
+}
+
+unsigned SKms::GetWidth() const
+{
+    return ModeWidth;
+}
+
+unsigned SKms::GetHeight() const
+{
+    return ModeHeight;
+}
+
+bool SKms::Open(const char* device)
+{
+    Fd = open(device, O_RDWR | O_CLOEXEC);
+    if (Fd < 0)
+    {
+        return false;
+    }
+    // Atomic implies universal planes, refused without DRM master (e.g. under a compositor)
+    if (drmSetClientCap(Fd, DRM_CLIENT_CAP_UNIVERSAL_PLANES, 1) != 0 || drmSetClientCap(Fd, DRM_CLIENT_CAP_ATOMIC, 1) != 0)
+    {
+        printf("KMS: %s has no atomic modesetting\n", device);
+        return false;
+    }
+    printf("KMS: %s\n", device);
+    return true;
+}
+
+// First connected connector, its preferred mode and a CRTC one of its encoders can drive
+bool SKms::FindOutput()
+{
+    drmModeRes* res = drmModeGetResources(Fd);
+    if (res == nullptr)
+    {
+        return false;
+    }
+    bool result = false;
+    for (int i = 0; i < res->count_connectors && !result; i++)
+    {
+        drmModeConnector* connector = drmModeGetConnector(Fd, res->connectors[i]);
+        if (connector == nullptr)
+        {
+            continue;
+        }
+        if (connector->connection == DRM_MODE_CONNECTED && connector->count_modes > 0)
+        {
+            drmModeModeInfo* mode = &connector->modes[0];
+            for (int m = 0; m < connector->count_modes; m++)
+            {
+                if (connector->modes[m].type & DRM_MODE_TYPE_PREFERRED)
+                {
+                    mode = &connector->modes[m];
+                    break;
+                }
+            }
+            for (int e = 0; e < connector->count_encoders && !result; e++)
+            {
+                drmModeEncoder* encoder = drmModeGetEncoder(Fd, connector->encoders[e]);
+                if (encoder == nullptr)
+                {
+                    continue;
+                }
+                for (int c = 0; c < res->count_crtcs && !result; c++)
+                {
+                    if (encoder->possible_crtcs & (1u << c))
+                    {
+                        CrtcId = res->crtcs[c];
+                        result = true;
+                    }
+                }
+                drmModeFreeEncoder(encoder);
+            }
+            if (result)
+            {
+                ConnectorId = connector->connector_id;
+                ModeWidth = mode->hdisplay;
+                ModeHeight = mode->vdisplay;
+                result = drmModeCreatePropertyBlob(Fd, mode, sizeof(*mode), &ModeBlob) == 0;
+            }
+        }
+        drmModeFreeConnector(connector);
+    }
+    drmModeFreeResources(res);
+    return result;
+}
+
+// Primary plane of the CRTC if it scans out the format, an overlay plane otherwise
+bool SKms::FindPlane(unsigned fourcc)
+{
+    drmModeRes* res = drmModeGetResources(Fd);
+    drmModePlaneRes* planes = drmModeGetPlaneResources(Fd);
+    if (res == nullptr || planes == nullptr)
+    {
+        drmModeFreeResources(res);
+        drmModeFreePlaneResources(planes);
+        return false;
+    }
+    int crtcIndex = 0;
+    while (crtcIndex < res->count_crtcs && res->crtcs[crtcIndex] != CrtcId)
+    {
+        crtcIndex++;
+    }
+    uint32_t overlay = 0;
+    for (uint32_t i = 0; i < planes->count_planes && PlaneId == 0; i++)
+    {
+        drmModePlane* plane = drmModeGetPlane(Fd, planes->planes[i]);
+        if (plane == nullptr)
+        {
+            continue;
+        }
+        bool format = false;
+        for (uint32_t f = 0; f < plane->count_formats; f++)
+        {
+            format |= plane->formats[f] == fourcc;
+        }
+        if (format && (plane->possible_crtcs & (1u << crtcIndex)))
+        {
+            tProperties properties;
+            LoadProperties(plane->plane_id, DRM_MODE_OBJECT_PLANE, properties);
+            drmModeObjectProperties* values = drmModeObjectGetProperties(Fd, plane->plane_id, DRM_MODE_OBJECT_PLANE);
+            uint64_t type = DRM_PLANE_TYPE_OVERLAY;
+            for (uint32_t p = 0; values != nullptr && p < values->count_props; p++)
+            {
+                if (values->props[p] == properties["type"])
+                {
+                    type = values->prop_values[p];
+                }
+            }
+            drmModeFreeObjectProperties(values);
+            if (type == DRM_PLANE_TYPE_PRIMARY)
+            {
+                PlaneId = plane->plane_id;
+            }
+            else if (type == DRM_PLANE_TYPE_OVERLAY && overlay == 0)
+            {
+                overlay = plane->plane_id;
+            }
+        }
+        drmModeFreePlane(plane);
+    }
+    if (PlaneId == 0)
+    {
+        PlaneId = overlay;
+    }
+    drmModeFreePlaneResources(planes);
+    drmModeFreeResources(res);
+    if (PlaneId == 0)
+    {
+        printf("KMS: no plane scans out %.4s\n", (char*)&fourcc);
+    }
+    return PlaneId != 0;
+}
+
+bool SKms::LoadProperties(uint32_t object, uint32_t type, tProperties& properties)
+{
+    drmModeObjectProperties* props = drmModeObjectGetProperties(Fd, object, type);
+    if (props == nullptr)
+    {
+        return false;
+    }
+    for (uint32_t i = 0; i < props->count_props; i++)
+    {
+        drmModePropertyRes* prop = drmModeGetProperty(Fd, props->props[i]);
+        if (prop != nullptr)
+        {
+            properties[prop->name] = prop->prop_id;
+            drmModeFreeProperty(prop);
+        }
+    }
+    drmModeFreeObjectProperties(props);
+    return true;
+}
+
+int SKms::AddBuffer(int dmaFd, unsigned width, unsigned height, unsigned fourcc, unsigned pitch)
+{
+    uint32_t handle;
+    if (drmPrimeFDToHandle(Fd, dmaFd, &handle) != 0)
+    {
+        printf("drmPrimeFDToHandle: %s\n", strerror(errno));
+        return -1;
+    }
+    uint32_t handles[4] = { handle };
+    uint32_t pitches[4] = { pitch };
+    uint32_t offsets[4] = { 0 };
+    tstBuffer buffer = { 0, width, height };
+    int ret = drmModeAddFB2(Fd, width, height, fourcc, handles, pitches, offsets, &buffer.FbId, 0);
+    // The framebuffer holds its own reference
+    struct drm_gem_close gemClose = { handle, 0 };
+    drmIoctl(Fd, DRM_IOCTL_GEM_CLOSE, &gemClose);
+    if (ret != 0)
+    {
+        printf("drmModeAddFB2 %ux%u %.4s: %s\n", width, height, (char*)&fourcc, strerror(errno));
+        return -1;
+    }
+    Buffers.push_back(buffer);
+    printf("Created framebuffer #%u %ux%u, fourcc %.4s, DMA %d, FB %u\n", (unsigned)Buffers.size() - 1, width, height, (char*)&fourcc, dmaFd, buffer.FbId);
+    return Buffers.size() - 1;
+}
+
+// Removing the framebuffer on screen disables the plane
+void SKms::RemoveBuffer(unsigned index)
+{
+    if (index < Buffers.size() && Buffers[index].FbId != 0)
+    {
+        drmModeRmFB(Fd, Buffers[index].FbId);
+        Buffers[index].FbId = 0;
+    }
+}
+
+bool SKms::Commit(const tstBuffer& buffer, const tstGeometry& geometry, uint32_t flags)
+{
+    drmModeAtomicReq* req = drmModeAtomicAlloc();
+    if (!ModeSet)
+    {
+        drmModeAtomicAddProperty(req, ConnectorId, ConnectorProperties["CRTC_ID"], CrtcId);
+        drmModeAtomicAddProperty(req, CrtcId, CrtcProperties["MODE_ID"], ModeBlob);
+        drmModeAtomicAddProperty(req, CrtcId, CrtcProperties["ACTIVE"], 1);
+        flags |= DRM_MODE_ATOMIC_ALLOW_MODESET;
+    }
+    drmModeAtomicAddProperty(req, PlaneId, PlaneProperties["FB_ID"], buffer.FbId);
+    drmModeAtomicAddProperty(req, PlaneId, PlaneProperties["CRTC_ID"], CrtcId);
+    // Source in 16.16 fixed point
+    drmModeAtomicAddProperty(req, PlaneId, PlaneProperties["SRC_X"], (uint64_t)geometry.SrcX << 16);
+    drmModeAtomicAddProperty(req, PlaneId, PlaneProperties["SRC_Y"], (uint64_t)geometry.SrcY << 16);
+    drmModeAtomicAddProperty(req, PlaneId, PlaneProperties["SRC_W"], (uint64_t)geometry.SrcWidth << 16);
+    drmModeAtomicAddProperty(req, PlaneId, PlaneProperties["SRC_H"], (uint64_t)geometry.SrcHeight << 16);
+    drmModeAtomicAddProperty(req, PlaneId, PlaneProperties["CRTC_X"], geometry.CrtcX);
+    drmModeAtomicAddProperty(req, PlaneId, PlaneProperties["CRTC_Y"], geometry.CrtcY);
+    drmModeAtomicAddProperty(req, PlaneId, PlaneProperties["CRTC_W"], geometry.CrtcWidth);
+    drmModeAtomicAddProperty(req, PlaneId, PlaneProperties["CRTC_H"], geometry.CrtcHeight);
+    int ret = drmModeAtomicCommit(Fd, req, flags, this);
+    drmModeAtomicFree(req);
+    return ret == 0;
+}
+
+// Scaled to the full mode if the plane allows it, centered 1:1 (cropped if larger) otherwise.
+// Tested once per buffer size.
+bool SKms::Place(const tstBuffer& buffer)
+{
+    if (Geometry.Width == buffer.Width && Geometry.Height == buffer.Height)
+    {
+        return true;
+    }
+    tstGeometry scaled = { buffer.Width, buffer.Height, 0, 0, buffer.Width, buffer.Height, 0, 0, ModeWidth, ModeHeight };
+    if (Commit(buffer, scaled, DRM_MODE_ATOMIC_TEST_ONLY))
+    {
+        Geometry = scaled;
+        return true;
+    }
+    unsigned width = buffer.Width < ModeWidth ? buffer.Width : ModeWidth;
+    unsigned height = buffer.Height < ModeHeight ? buffer.Height : ModeHeight;
+    tstGeometry centered =
+    {
+        buffer.Width, buffer.Height,
+        (buffer.Width - width) / 2, (buffer.Height - height) / 2, width, height,
+        (int32_t)(ModeWidth - width) / 2, (int32_t)(ModeHeight - height) / 2, width, height
+    };
+    if (Commit(buffer, centered, DRM_MODE_ATOMIC_TEST_ONLY))
+    {
+        printf("KMS: plane cannot scale %ux%u to %ux%u, shown unscaled\n", buffer.Width, buffer.Height, ModeWidth, ModeHeight);
+        Geometry = centered;
+        return true;
+    }
+    printf("KMS: plane rejects %ux%u on %ux%u\n", buffer.Width, buffer.Height, ModeWidth, ModeHeight);
+    return false;
+}
+
+bool SKms::Show(unsigned index)
+{
+    if (index >= Buffers.size() || Buffers[index].FbId == 0)
+    {
+        return false;
+    }
+    // One commit in flight, the next one would fail with EBUSY
+    WaitFlip(-1);
+    const tstBuffer& buffer = Buffers[index];
+    if (!Place(buffer))
+    {
+        return false;
+    }
+    if (!Commit(buffer, Geometry, DRM_MODE_ATOMIC_NONBLOCK | DRM_MODE_PAGE_FLIP_EVENT))
+    {
+        printf("drmModeAtomicCommit: %s\n", strerror(errno));
+        return false;
+    }
+    ModeSet = true;
+    FlipPending = true;
+    CommitSeq++;
+    return true;
+}
+
+bool SKms::WaitFlip(int timeoutMs)
+{
+    if (FlipPending)
+    {
+        struct pollfd pfd = { Fd, POLLIN, 0 };
+        if (poll(&pfd, 1, timeoutMs) > 0)
+        {
+            drmEventContext context;
+            memset(&context, 0, sizeof(context));
+            context.version = 2;
+            context.page_flip_handler = OnPageFlip;
+            drmHandleEvent(Fd, &context);
+        }
+    }
+    return !FlipPending;
+}
+
+uint64_t SKms::Fence() const
+{
+    return CommitSeq;
+}
+
+bool SKms::IsFenceSignaled(uint64_t fence) const
+{
+    return CompletedSeq > fence;
+}
+
+void SKms::OnPageFlip(int fd, unsigned sequence, unsigned sec, unsigned usec, void* data)
+{
+    SKms* kms = (SKms*)data;
+    kms->FlipPending = false;
+    kms->CompletedSeq = kms->CommitSeq;
+}
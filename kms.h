@@ -0,0 +1,78 @@
+#pragma once
+
+#include <stdint.h>
+#include <map>
+#include <string>
+#include <vector>
+
+// Atomic KMS presentation: dmabufs wrapped in DRM framebuffers and page flipped onto a plane of the
+// first connected output, no GL composition. The plane scales a buffer not matching the mode, where
+// it cannot (e.g. vkms) the buffer is shown centered and unscaled.
+class SKms
+{
+public:
+    SKms();
+    bool Create(const char* device, unsigned fourcc); // nullptr takes the first card with a connected output, fourcc 0 defers SelectPlane()
+    bool SelectPlane(unsigned fourcc); // Plane scanning out the DRM fourcc on the CRTC, primary preferred
+    std::vector<unsigned> GetPlaneFormats() const; // DRM fourccs any plane of the CRTC scans out
+    void Destroy();
+    int GetFd() const;
+    unsigned GetWidth() const; // Mode size
+    unsigned GetHeight() const;
+    int AddBuffer(int dmaFd, unsigned width, unsigned height, unsigned fourcc, unsigned pitch);
+    void RemoveBuffer(unsigned index);
+    bool Show(unsigned index); // Waits for a pending flip, then commits without blocking
+    bool WaitFlip(int timeoutMs); // False if the flip is still pending after the timeout
+    uint64_t Fence() const; // Commit showing the current buffer, 0 before the first one
+    bool IsFenceSignaled(uint64_t fence) const; // A later commit is on screen, the buffer is not scanned out anymore
+
+private:
+    typedef std::map<std::string, uint32_t> tProperties; // Name to property id
+
+    struct tstBuffer
+    {
+        uint32_t FbId; // 0 after removal, keeps the other indices valid
+        unsigned Width;
+        unsigned Height;
+    };
+
+    // Plane source and CRTC destination of one buffer size
+    struct tstGeometry
+    {
+        unsigned Width;
+        unsigned Height;
+        uint32_t SrcX;
+        uint32_t SrcY;
+        uint32_t SrcWidth;
+        uint32_t SrcHeight;
+        int32_t CrtcX;
+        int32_t CrtcY;
+        uint32_t CrtcWidth;
+        uint32_t CrtcHeight;
+    };
+
+    bool Open(const char* device);
+    bool FindOutput();
+    bool FindPlane(unsigned fourcc);
+    bool LoadProperties(uint32_t object, uint32_t type, tProperties& properties);
+    bool Commit(const tstBuffer& buffer, const tstGeometry& geometry, uint32_t flags);
+    bool Place(const tstBuffer& buffer);
+    static void OnPageFlip(int fd, unsigned sequence, unsigned sec, unsigned usec, void* data);
+
+    int Fd;
+    uint32_t ConnectorId;
+    uint32_t CrtcId;
+    uint32_t PlaneId;
+    uint32_t ModeBlob;
+    unsigned ModeWidth;
+    unsigned ModeHeight;
+    tProperties ConnectorProperties;
+    tProperties CrtcProperties;
+    tProperties PlaneProperties;
+    bool ModeSet; // The first commit also sets the mode
+    bool FlipPending;
+    uint64_t CommitSeq; // Commits issued
+    uint64_t CompletedSeq; // Commits on screen
+    tstGeometry Geometry; // Of the last shown buffer size
+    std::vector<tstBuffer> Buffers;
+};
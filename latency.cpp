@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "latency.h"
+
+using namespace std;
+
+uint64_t MonotonicNs()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+SLatencyHistogram::SLatencyHistogram() :
+    Counts((64 - SubBits + 2) * HalfCount, 0),
+    Total(0),
+    Max(0)
+{
+}
+
+// Values below SubCount map 1:1, above the octave (msb) selects the shift
+// and the top SubBits bits the linear sub-bucket.
+unsigned SLatencyHistogram::BucketIndex(uint64_t ns)
+{
+    if (ns < SubCount)
+    {
+        return (unsigned)ns;
+    }
+    unsigned msb = 63 - __builtin_clzll(ns);
+    unsigned shift = msb - SubBits + 1;
+    unsigned sub = (unsigned)(ns >> shift); // HalfCount..SubCount-1
+    return shift * HalfCount + sub;
+}
+
+// Middle of the bucket
+uint64_t SLatencyHistogram::BucketValue(unsigned index)
+{
+    if (index < SubCount)
+    {
+        return index;
+    }
+    unsigned shift = index / HalfCount - 1;
+    uint64_t sub = index - shift * HalfCount;
+    return (sub << shift) + ((1ull << shift) >> 1);
+}
+
+void SLatencyHistogram::Record(uint64_t ns)
+{
+    Counts[BucketIndex(ns)]++;
+    Total++;
+    if (ns > Max)
+    {
+        Max = ns;
+    }
+}
+
+void SLatencyHistogram::Reset()
+{
+    Counts.assign(Counts.size(), 0);
+    Total = 0;
+    Max = 0;
+}
+
+uint64_t SLatencyHistogram::Count() const
+{
+    return Total;
+}
+
+uint64_t SLatencyHistogram::Percentile(double percent) const
+{
+    if (Total == 0)
+    {
+        return 0;
+    }
+    uint64_t rank = (uint64_t)(percent / 100.0 * Total + 0.5);
+    if (rank == 0)
+    {
+        rank = 1;
+    }
+    uint64_t sum = 0;
+    for (unsigned i = 0; i < Counts.size(); i++)
+    {
+        sum += Counts[i];
+        if (sum >= rank)
+        {
+            uint64_t value = BucketValue(i);
+            return value < Max ? value : Max;
+        }
+    }
+    return Max;
+}
+
+void SLatencyHistogram::Print(const string& name) const
+{
+    printf("%-14s n = %8llu  p50 = %8.3f ms  p99 = %8.3f ms  p99.9 = %8.3f ms  max = %8.3f ms\n",
+        name.c_str(), (unsigned long long)Total,
+        Percentile(50.0) / 1e6, Percentile(99.0) / 1e6, Percentile(99.9) / 1e6, Max / 1e6);
+}
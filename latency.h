@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// CLOCK_MONOTONIC in ns, same clock as the V4L buffer timestamps
+uint64_t MonotonicNs();
+
+// HDR style latency histogram: log2 octaves split into linear sub-buckets,
+// constant relative precision (< 1 %) from ns up to minutes with fixed memory.
+class SLatencyHistogram
+{
+public:
+    SLatencyHistogram();
+    void Record(uint64_t ns);
+    void Reset();
+    uint64_t Count() const;
+    uint64_t Percentile(double percent) const; // ns
+    void Print(const std::string& name) const;
+
+private:
+    static const unsigned SubBits = 7; // Values below 128 exact, then HalfCount (64) sub-buckets per octave: midpoint within 1/128
+    static const unsigned SubCount = 1 << SubBits;
+    static const unsigned HalfCount = SubCount / 2;
+
+    static unsigned BucketIndex(uint64_t ns);
+    static uint64_t BucketValue(unsigned index);
+
+    std::vector<uint64_t> Counts;
+    uint64_t Total;
+    uint64_t Max;
+};
@@ -0,0 +1,65 @@
+// Startup cost of the GL/EGL entry point loaders on a surfaceless context:
+//   ./loaderbench [glad|lazy [iterations]]
+// The first iteration in a process is the cold start, run each loader in its own process to compare
+// those. lazy resolves every entry of its table, the upper bound of what a run resolves on first use.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+#include "glloader.h"
+#include "headlessplatform.h"
+#include "latency.h"
+
+using namespace std;
+
+static uint64_t LoadGlad()
+{
+    uint64_t start = MonotonicNs();
+    gladLoadEGLLoader((GLADloadproc)eglGetProcAddress);
+    gladLoadGLES2Loader((GLADloadproc)eglGetProcAddress);
+    return MonotonicNs() - start;
+}
+
+static uint64_t LoadLazy()
+{
+    uint64_t start = MonotonicNs();
+    LazyLoadEGL((GLADloadproc)eglGetProcAddress);
+    LazyLoadGLES2((GLADloadproc)eglGetProcAddress);
+    unsigned missing = ResolveLazyEntries();
+    HasGlExtension("GL_OES_EGL_image_external");
+    HasEglExtension(eglGetCurrentDisplay(), "EGL_EXT_image_dma_buf_import");
+    uint64_t ns = MonotonicNs() - start;
+    if (missing != 0)
+    {
+        printf("%u entry points missing\n", missing);
+    }
+    return ns;
+}
+
+int main(int argc, char* argv[])
+{
+    bool lazy = argc > 1 && strcmp(argv[1], "lazy") == 0;
+    unsigned iterations = argc > 2 ? atoi(argv[2]) : 100;
+
+    // Loads lazily itself, with nothing resolved yet the first iteration is still cold
+    SHeadlessPlatform platform(64, 64, 0);
+    if (!platform.Create())
+    {
+        return 1;
+    }
+
+    vector<uint64_t> ns;
+    for (unsigned i = 0; i < iterations; i++)
+    {
+        ns.push_back(lazy ? LoadLazy() : LoadGlad());
+    }
+    uint64_t cold = ns[0];
+    sort(ns.begin() + 1, ns.end());
+    printf("%s loader: cold %.3f ms, warm median %.3f ms over %u iterations\n", lazy ? "Lazy" : "glad",
+        cold / 1e6, ns.size() > 1 ? ns[ns.size() / 2] / 1e6 : 0.0, iterations);
+
+    platform.Destroy();
+    return 0;
+}
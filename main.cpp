@@ -1,23 +1,42 @@
 #include <string.h>
 #include <stdio.h>
+#include <signal.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
 
 #include <vector>
 #include <string>
 #include <chrono>
+#include <future>
+#include <memory>
 
-#include <GLFW/glfw3.h>
+#include <libdrm/drm_fourcc.h>
 
 #include "glad/glad.h"
 #include "glad/glad_egl.h"
 
+#include "gbmplatform.h"
+#include "glfwplatform.h"
+#include "glloader.h"
+#include "headlessplatform.h"
+#include "importcache.h"
+#include "gpuconvert.h"
+#include "formatchain.h"
+#include "kms.h"
+#include "programcache.h"
+#include "shadervariants.h"
+#include "startupprofile.h"
+#include "synthetic.h"
 #include "video.h"
 
 using namespace std;
 
+// Fixed attribute locations, shared by all fragment shader variants
 static const std::string sVertex = R"glsl(
 #version 310 es
-in vec2 VertexPosition;
-in vec2 vertex_UV;
+layout(location = 0) in vec2 VertexPosition;
+layout(location = 1) in vec2 vertex_UV;
 out vec2 UV;
 void main()
 {
@@ -26,23 +45,54 @@ void main()
 };
 )glsl";
 
-static const std::string sFragment = R"glsl(
-#version 310 es
-#extension GL_OES_EGL_image_external : enable
-precision mediump float;
-in vec2 UV;
-uniform samplerExternalOES Texture;
-out vec4 finalColor;
-void main()
+// Window system providing the GL context
+enum EPlatform
 {
-	vec4 fc = texture2D(Texture, UV);
-	finalColor = vec4(fc.b, fc.g, fc.r, fc.a);
+	ePF_Glfw, // X11 or Wayland window
+	ePF_Gbm, // DRM/KMS without window system, e.g. kiosks started from a VT
+	ePF_Headless, // No display, renders into targetTexture. Benchmarks and servers.
 };
-)glsl";
 
+static const EPlatform Platform = ePF_Glfw;
 static const bool FullScreen = true;
+static const unsigned HeadlessWidth = 1920;
+static const unsigned HeadlessHeight = 1080;
+static const unsigned HeadlessRefresh = 0; // Virtual refresh rate in Hz, 0 renders uncapped
+
+// Where the frames come from
+enum ECaptureSource
+{
+	eCS_Unicam, // tc358743 HDMI bridge
+	eCS_V4l2, // Any V4L2 capture device, e.g. vivid
+	eCS_Synthetic, // In-process generator, no capture hardware
+};
+
+static const ECaptureSource CaptureSource = eCS_Unicam;
+static const char* V4l2Device = "/dev/video0"; // eCS_V4l2
+static const unsigned SyntheticWidth = 1920;
+static const unsigned SyntheticHeight = 1080;
+static const unsigned SyntheticFps = 60;
+static const unsigned SyntheticJitterUs = 500; // Uniform +- around the frame grid
+static const unsigned DmaBuffers = 4; // Ring depth of each video queue, 3-4 frames in flight
+static const SVideo::EPresentMode PresentMode = SVideo::ePM_Mailbox; // Monitoring: latency before completeness
+static const SVideo::ECaptureMode CaptureMode = SVideo::eCM_Rgb24Isp; // eCM_UyvyDirect for 1080p50/60
+static const bool NegotiateChain = true; // Replaces CaptureMode by the cheapest chain of the probed formats, weights from chainbench
+static const bool FullChroma = true; // The negotiated chain keeps 4:4:4, false lets UYVY capture save CSI-2 bandwidth
+static const bool GpuScale = true; // Compute conversion scales to the display size in the same pass
+static const bool KmsScanout = false; // Passthrough: ISP buffers scanned out on a DRM plane, no GL. Needs DRM master.
+static const bool ParallelStartup = true; // Probe the video devices while the GL context comes up, false for the serial baseline
+static const char* StartupProfile = "startup"; // Phase timeline written to startup.json and startup.csv on exit, nullptr disables
 static EGLDisplay EglDisplay;
-static vector<GLuint> SourceTexture;
+static const unsigned ImportCacheSize = 64; // Imported buffers kept, ring depths of the presented queues with margin
+static SImportCache ImportCache(ImportCacheSize);
+static vector<unsigned> ImportFormats; // eglQueryDmaBufFormatsEXT, empty if not supported
+static SShaderVariants::tstFormatPair SourcePair = { 0, 0, false, false }; // Of the imported images, selects the shader
+static unsigned SourceWidth; // Pixels, packed YUV samples two per texel
+static bool SourcePairChanged = true;
+static SGpuConvert GpuConvert;
+static SKms Kms;
+static volatile sig_atomic_t PrintLatency = 0; // kill -USR1 prints the latency percentiles
+static volatile sig_atomic_t Quit = 0; // Ctrl-C without a window to close
 
 static void APIENTRY funcname(GLenum source, GLenum type, GLuint id, GLenum severity, GLsizei length, const GLchar* message, const void* userParam)
 {
@@ -51,16 +101,114 @@ static void APIENTRY funcname(GLenum source, GLenum type, GLuint id, GLenum seve
 		type, severity, message);
 }
 
-unsigned CreateSourceImage(int dmaFd, int width, int height, int fourcc)
+static void OnSigUsr1(int)
+{
+	PrintLatency = 1;
+}
+
+static void OnSigInt(int)
+{
+	Quit = 1;
+}
+
+// Layout of the presented buffers before they exist, lets the shader compile while the devices are probed
+static unsigned ExpectedSourceFourcc()
+{
+	switch (CaptureMode)
+	{
+	case SVideo::eCM_Rgb24Isp:
+		return DRM_FORMAT_ABGR8888;
+	case SVideo::eCM_UyvyDirect:
+		return DRM_FORMAT_UYVY;
+	default:
+		return 0; // Compute target
+	}
+}
+
+// Calibrated on the device by chainbench, estimates otherwise
+static SFormatChain::tstWeights LoadChainWeights()
+{
+	SFormatChain::tstWeights weights = SFormatChain::DefaultWeights();
+	string path = SFormatChain::WeightsFile();
+	if (!path.empty() && SFormatChain::LoadWeights(path, weights))
+	{
+		printf("Chain weights loaded from %s\n", path.c_str());
+	}
+	return weights;
+}
+
+// The plane ignores alpha
+static unsigned OpaqueFourcc(unsigned fourcc)
+{
+	switch (fourcc)
+	{
+	case DRM_FORMAT_ABGR8888:
+		return DRM_FORMAT_XBGR8888;
+	case DRM_FORMAT_ARGB8888:
+		return DRM_FORMAT_XRGB8888;
+	default:
+		return fourcc;
+	}
+}
+
+// Render thread, the video pipeline follows the framebuffer
+static void OnFramebufferSize(SVideo& video, unsigned width, unsigned height)
+{
+	glViewport(0, 0, width, height);
+	video.SetTargetSize(width, height);
+	if (GpuScale)
+	{
+		GpuConvert.SetTargetSize(width, height);
+	}
+}
+
+// The render loop switches the display program when the pair or the width changes
+static void SetSourcePair(const SShaderVariants::tstFormatPair& pair, unsigned width)
 {
+	if (pair.Memory != SourcePair.Memory || pair.Import != SourcePair.Import || pair.Bt709 != SourcePair.Bt709 ||
+		pair.FullRange != SourcePair.FullRange || width != SourceWidth)
+	{
+		SourcePair = pair;
+		SourceWidth = width;
+		SourcePairChanged = true;
+	}
+}
+
+unsigned CreateSourceImage(int dmaFd, int width, int height, int fourcc, int pitch, bool bt709, bool fullRange)
+{
+	if (KmsScanout)
+	{
+		return Kms.AddBuffer(dmaFd, width, height, OpaqueFourcc(fourcc), pitch);
+	}
+	SShaderVariants::tstFormatPair pair = SShaderVariants::Negotiate(fourcc, bt709, fullRange, ImportFormats);
+	bool packed = SShaderVariants::Packed(pair);
+	SetSourcePair(pair, width);
+	// The same buffer under another fd is not imported again
+	SImportCache::tstKey key;
+	if (!SImportCache::MakeKey(dmaFd, fourcc, width, height, pitch, (bt709 ? 1 : 0) | (fullRange ? 2 : 0), DRM_FORMAT_MOD_INVALID, key))
+	{
+		return -1;
+	}
+	unsigned id;
+	if (ImportCache.Find(key, id))
+	{
+		printf("Reused image #%u, DMA %d\n", id, dmaFd);
+		return id;
+	}
+	SStartupPhase phase("Import DMA " + to_string(dmaFd));
+	bool yuv = pair.Import == DRM_FORMAT_UYVY || pair.Import == DRM_FORMAT_YUYV;
 	EGLint attribs[] =
 	{
-		EGL_WIDTH, width,
+		EGL_WIDTH, packed ? width / 2 : width,
 		EGL_HEIGHT, height,
-		EGL_LINUX_DRM_FOURCC_EXT, fourcc,
+		EGL_LINUX_DRM_FOURCC_EXT, (EGLint)pair.Import,
 		EGL_DMA_BUF_PLANE0_FD_EXT, dmaFd,
 		EGL_DMA_BUF_PLANE0_OFFSET_EXT, 0,
-		EGL_DMA_BUF_PLANE0_PITCH_EXT, width * 4,
+		EGL_DMA_BUF_PLANE0_PITCH_EXT, pitch,
+		// Hints only for YUV, the list ends early for RGB formats
+		yuv ? EGL_YUV_COLOR_SPACE_HINT_EXT : EGL_NONE, bt709 ? EGL_ITU_REC709_EXT : EGL_ITU_REC601_EXT,
+		EGL_SAMPLE_RANGE_HINT_EXT, fullRange ? EGL_YUV_FULL_RANGE_EXT : EGL_YUV_NARROW_RANGE_EXT,
+		EGL_YUV_CHROMA_HORIZONTAL_SITING_HINT_EXT, EGL_YUV_CHROMA_SITING_0_EXT, // Cosited 4:2:2
 		EGL_NONE
 	};
 	EGLImage image = eglCreateImageKHR(EglDisplay, EGL_NO_CONTEXT, EGL_LINUX_DMA_BUF_EXT, NULL, attribs);
@@ -72,14 +220,15 @@ unsigned CreateSourceImage(int dmaFd, int width, int height, int fourcc)
 		GLuint texture;
 		glGenTextures(1, &texture);
 		glBindTexture(GL_TEXTURE_EXTERNAL_OES, texture);
-		SourceTexture.push_back(texture);
-		glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
-		glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		// Filtering would mix the two pixels of a packed YUV texel
+		glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MIN_FILTER, packed ? GL_NEAREST : GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_EXTERNAL_OES, GL_TEXTURE_MAG_FILTER, packed ? GL_NEAREST : GL_LINEAR);
 		glEGLImageTargetTexture2DOES(GL_TEXTURE_EXTERNAL_OES, image);
 		glBindTexture(GL_TEXTURE_EXTERNAL_OES, 0);
 		eglDestroyImageKHR(EglDisplay, image);
-		printf("Created image #%d %dx%d, fourcc %.4s, DMA %d, texture %u\n", SourceTexture.size() - 1, width, height, (char*)&fourcc, dmaFd, texture);
-		return SourceTexture.size() - 1; // Index of texture name
+		id = ImportCache.Insert(key, texture);
+		printf("Created image #%u %dx%d, fourcc %.4s as %.4s, DMA %d, texture %u\n", id, width, height, (char*)&fourcc, (char*)&pair.Import, dmaFd, texture);
+		return id; // Buffer id in the import cache
 	}
 	else
 	{
@@ -88,89 +237,300 @@ unsigned CreateSourceImage(int dmaFd, int width, int height, int fourcc)
 	}
 }
 
-void SelectTexture(unsigned index)
+void DeleteSourceImage(unsigned index)
+{
+	if (KmsScanout)
+	{
+		Kms.RemoveBuffer(index);
+		return;
+	}
+	ImportCache.Erase(index); // Pool reallocated, the buffer is gone
+}
+
+unsigned CreateConvertSource(int dmaFd, unsigned length, int width, int height, int pitch, bool uyvy, bool bt709, bool fullRange)
+{
+	SStartupPhase phase("Import convert source DMA " + to_string(dmaFd));
+	unsigned index = GpuConvert.AddSource(dmaFd, length, width, height, pitch, uyvy ? SGpuConvert::eSF_Uyvy : SGpuConvert::eSF_Rgb24, bt709, fullRange);
+	// The display samples the RGBA8 target, also after a source change switched from imported images
+	SShaderVariants::tstFormatPair pair = { 0, 0, false, false };
+	SetSourcePair(pair, GpuConvert.GetTargetWidth());
+	return index;
+}
+
+void DeleteConvertSource(unsigned index)
+{
+	GpuConvert.RemoveSource(index);
+}
+
+void ConvertTexture(unsigned index)
+{
+	GpuConvert.Convert(index);
+}
+
+// Signals once the GPU finished every command before it, the buffer swap flushes it
+// With KMS scanout the fence is the commit showing the buffer, signaled once a later one is on screen
+void* InsertFence()
+{
+	if (KmsScanout)
+	{
+		return (void*)(uintptr_t)Kms.Fence();
+	}
+	return glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
+
+// Polled, never waits for the GPU
+bool IsFenceSignaled(void* fence)
+{
+	if (KmsScanout)
+	{
+		return Kms.IsFenceSignaled((uintptr_t)fence);
+	}
+	GLint status = GL_UNSIGNALED;
+	glGetSynciv((GLsync)fence, GL_SYNC_STATUS, 1, nullptr, &status);
+	return status == GL_SIGNALED;
+}
+
+void DeleteFence(void* fence)
+{
+	if (!KmsScanout)
+	{
+		glDeleteSync((GLsync)fence);
+	}
+}
+
+bool SelectTexture(unsigned index)
 {
-	if (index < SourceTexture.size())
+	if (KmsScanout)
+	{
+		return Kms.Show(index);
+	}
+	GLuint texture = ImportCache.GetTexture(index);
+	if (texture != 0) // Else released, the last good frame stays bound
 	{
-		GLuint texture = SourceTexture[index];
 		glBindTexture(GL_TEXTURE_EXTERNAL_OES, texture);
 	}
+	return true;
+}
+
+// dmabuf layouts the EGL implementation imports, without modifiers
+static void QueryImportFormats()
+{
+	EGLint count = 0;
+	if (!HasEglExtension(EglDisplay, "EGL_EXT_image_dma_buf_import_modifiers") || !eglQueryDmaBufFormatsEXT(EglDisplay, 0, nullptr, &count))
+	{
+		return;
+	}
+	vector<EGLint> formats(count);
+	eglQueryDmaBufFormatsEXT(EglDisplay, count, formats.data(), &count);
+	ImportFormats.assign(formats.begin(), formats.begin() + count);
+}
+
+// Shader for the format pair of the imported images, switched when a source change renegotiated it
+static void UseSourceProgram(SShaderVariants& variants)
+{
+	SourcePairChanged = false;
+	GLuint program = variants.GetProgram(SourcePair);
+	glUseProgram(program);
+	glUniform1f(glGetUniformLocation(program, "SourceWidth"), (float)SourceWidth);
+}
+
+static SCaptureSource* CreateCaptureSource()
+{
+	switch (CaptureSource)
+	{
+	case eCS_V4l2:
+		return new SV4l2Source(V4l2Device);
+	case eCS_Synthetic:
+		return new SSyntheticSource(SyntheticWidth, SyntheticHeight, SyntheticFps, SyntheticJitterUs);
+	default:
+		return new SUnicamSource("/dev/video0");
+	}
+}
+
+// Passthrough without GL: every new frame is page flipped onto the plane, the flip paces the loop
+static int MainKms()
+{
+	SVideo video(DmaBuffers, PresentMode, CaptureMode);
+	SFormatChain formatChain(LoadChainWeights());
+	{
+		SStartupPhase phase("KMS setup");
+		if (!Kms.Create(nullptr, 0)) // The plane follows the negotiated format
+		{
+			return 1;
+		}
+		if (NegotiateChain)
+		{
+			SFormatChain::tstCaps display = {};
+			display.Scanout = true;
+			display.Display = Kms.GetPlaneFormats();
+			display.FullChroma = FullChroma;
+			video.SetFormatChain(&formatChain, display);
+		}
+		phase.Next("Probe");
+		video.SetCaptureSource(CreateCaptureSource());
+		video.SetTargetSize(Kms.GetWidth(), Kms.GetHeight()); // ISP scales to the mode, the plane only upscales
+		bool probed = video.Probe();
+		if (video.GetPresentFourcc() == 0 || !Kms.SelectPlane(OpaqueFourcc(video.GetPresentFourcc())))
+		{
+			printf("KMS scanout needs ISP or direct UYVY capture on a plane taking it\n");
+			video.Destroy();
+			Kms.Destroy();
+			return 1;
+		}
+		phase.Next("Start video");
+		if (probed)
+		{
+			video.Start();
+		}
+	}
+	StartupMark("Video started");
+	signal(SIGUSR1, OnSigUsr1);
+	signal(SIGINT, OnSigInt);
+	signal(SIGTERM, OnSigInt);
+
+	bool firstFrame = true;
+	while (!Quit)
+	{
+		if (video.FrameProcessing())
+		{
+			video.FrameSubmitted(); // Commit issued
+			Kms.WaitFlip(-1);
+			video.FramePresented();
+			if (firstFrame)
+			{
+				firstFrame = false;
+				StartupMark("First frame presented");
+				EndStartupProfile();
+			}
+		}
+		else
+		{
+			// Woken by the pipeline thread for the next frame or a source change, a signal ends the wait
+			struct pollfd pfd = { video.GetReadyFd(), POLLIN, 0 };
+			poll(&pfd, 1, -1);
+		}
+		if (PrintLatency)
+		{
+			PrintLatency = 0;
+			video.PrintLatency();
+		}
+	}
+
+	video.PrintLatency();
+
+	video.Destroy(); // Joins the pipeline thread
+	Kms.Destroy();
+	if (StartupProfile != nullptr)
+	{
+		WriteStartupProfile(StartupProfile);
+	}
+	return 0;
 }
 
 int main()
 {
-	glfwInit();
-	glfwWindowHint(GLFW_VISIBLE, GLFW_TRUE);
-	glfwWindowHint(GLFW_DOUBLEBUFFER, GLFW_TRUE);
-	glfwWindowHint(GLFW_CLIENT_API, GLFW_OPENGL_ES_API);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
-	glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
-	glfwWindowHint(GLFW_CONTEXT_CREATION_API, GLFW_EGL_CONTEXT_API);
-	GLFWmonitor* monitor = glfwGetPrimaryMonitor();
-	const GLFWvidmode* mode = glfwGetVideoMode(monitor);
-	GLFWwindow* glfwWindow = glfwCreateWindow(mode->width, mode->height, "Raspberry PI 4 tearing", FullScreen ? monitor : nullptr, nullptr);
-	glfwMakeContextCurrent(glfwWindow);
-	EglDisplay = eglGetCurrentDisplay();
-	eglGetCurrentDisplay();
-	glfwSwapInterval(1);
-	gladLoadGLES2Loader((GLADloadproc)glfwGetProcAddress);
-	gladLoadEGLLoader((GLADloadproc)glfwGetProcAddress);
+	if (KmsScanout)
+	{
+		return MainKms();
+	}
+
+	// Device probing and buffer allocation need no GL context, they run on a worker thread while the
+	// context comes up and the shaders compile. Joined where the EGL images are created.
+	SVideo video(DmaBuffers, PresentMode, CaptureMode);
+	video.SetCaptureSource(CreateCaptureSource());
+	SFormatChain formatChain(LoadChainWeights());
+	if (NegotiateChain)
+	{
+		// The probe runs before the context exists, it prices the import formats chainbench recorded.
+		// Start() re-picks the display format against the ones EGL lists.
+		SFormatChain::tstCaps display = {};
+		display.GpuConvert = true;
+		display.Display = formatChain.GetWeights().Import;
+		display.FullChroma = FullChroma;
+		video.SetFormatChain(&formatChain, display);
+	}
+	if (Platform == ePF_Headless)
+	{
+		video.SetTargetSize(HeadlessWidth, HeadlessHeight); // Known before the context, saves reallocating the ISP capture in Start()
+	}
+	future<bool> probe = async(ParallelStartup ? launch::async : launch::deferred, [&video]
+	{
+		SStartupPhase phase("Probe");
+		bool result = video.Probe();
+		StartupMark("Video probed");
+		return result;
+	});
+
+	unique_ptr<SPlatform> platform;
+	switch (Platform)
+	{
+	case ePF_Gbm:
+		platform.reset(new SGbmPlatform());
+		break;
+	case ePF_Headless:
+		platform.reset(new SHeadlessPlatform(HeadlessWidth, HeadlessHeight, HeadlessRefresh));
+		break;
+	default:
+		platform.reset(new SGlfwPlatform(FullScreen));
+		break;
+	}
+	{
+		SStartupPhase phase("Create platform");
+		if (!platform->Create())
+		{
+			return 1;
+		}
+		EglDisplay = eglGetCurrentDisplay();
+		phase.Next("Query import formats");
+		QueryImportFormats();
+	}
+	StartupMark("GL context");
 
 	glDebugMessageCallback(funcname, nullptr);
 	glEnable(GL_DEBUG_OUTPUT_SYNCHRONOUS);
 	//glEnable(GL_DEBUG_OUTPUT);
 
-	SVideo video;
-	video.Create();
-
-	GLint result = GL_FALSE;
-	const GLchar* ShaderSourcePointer;
-	GLuint VertexShaderID = glCreateShader(GL_VERTEX_SHADER);
-	ShaderSourcePointer = sVertex.c_str();
-	glShaderSource(VertexShaderID, 1, &ShaderSourcePointer, NULL);
-	glCompileShader(VertexShaderID);
-	glGetShaderiv(VertexShaderID, GL_COMPILE_STATUS, &result);
-	if (result == GL_FALSE) {
-		int InfoLogLength;
-		glGetShaderiv(VertexShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-		vector<char> ShaderErrorMessage(InfoLogLength + 1);
-		glGetShaderInfoLog(VertexShaderID, InfoLogLength, NULL, &ShaderErrorMessage[0]);
-		printf("%s\n", &ShaderErrorMessage[0]);
-	}
-
-	GLuint FragmentShaderID = glCreateShader(GL_FRAGMENT_SHADER);
-	ShaderSourcePointer = sFragment.c_str();
-	glShaderSource(FragmentShaderID, 1, &ShaderSourcePointer, NULL);
-	glCompileShader(FragmentShaderID);
-	glGetShaderiv(FragmentShaderID, GL_COMPILE_STATUS, &result);
-	if (result == GL_FALSE) {
-		int InfoLogLength;
-		glGetShaderiv(FragmentShaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
-		vector<char> ShaderErrorMessage(InfoLogLength + 1);
-		glGetShaderInfoLog(FragmentShaderID, InfoLogLength, NULL, &ShaderErrorMessage[0]);
-		printf("%s\n", &ShaderErrorMessage[0]);
-	}
-
-	vector<GLuint> shaderIDs = { VertexShaderID, FragmentShaderID };
-	GLuint program = glCreateProgram();
-	for (auto& sID : shaderIDs)
-	{
-		glAttachShader(program, sID);
-	}
-	glLinkProgram(program);
-	glGetProgramiv(program, GL_LINK_STATUS, &result);
-	if (result == GL_FALSE) {
-		int InfoLogLength;
-		glGetProgramiv(program, GL_INFO_LOG_LENGTH, &InfoLogLength);
-		vector<char> ProgramErrorMessage(InfoLogLength + 1);
-		glGetProgramInfoLog(program, InfoLogLength, NULL, &ProgramErrorMessage[0]);
-		printf("%s\n", &ProgramErrorMessage[0]);
-	}
-
-	GLuint uvLoc = glGetAttribLocation(program, "vertex_UV");
-	GLuint vertexLoc = glGetAttribLocation(program, "VertexPosition");
+	unsigned framebufferWidth;
+	unsigned framebufferHeight;
+	platform->GetFramebufferSize(framebufferWidth, framebufferHeight);
+	if (GpuScale)
+	{
+		GpuConvert.SetTargetSize(framebufferWidth, framebufferHeight);
+	}
+
+	// The fragment shader follows the format pair of the imported images, see UseSourceProgram().
+	// The expected pair is compiled ahead, a source negotiating another one compiles on first use.
+	SProgramCache programCache;
+	SShaderVariants variants(programCache, sVertex);
+	{
+		SStartupPhase phase("Prewarm display shader");
+		variants.GetProgram(SShaderVariants::Negotiate(ExpectedSourceFourcc(), true, false, ImportFormats));
+		StartupMark("Shaders");
 
-	glUseProgram(program);
+		phase.Next("Wait for probe");
+		if (probe.get())
+		{
+			phase.Next("Start video");
+			video.SetTargetSize(framebufferWidth, framebufferHeight); // ISP scales to the framebuffer
+			if (!ImportFormats.empty())
+			{
+				video.SetDisplayFormats(ImportFormats);
+			}
+			video.Start();
+		}
+	}
+	unsigned presentFourcc = video.GetPresentFourcc(); // Negotiated by the probe
+	if (presentFourcc != 0 && !HasGlExtension("GL_OES_EGL_image_external_essl3"))
+	{
+		printf("GL_OES_EGL_image_external_essl3 missing, imported frames cannot be sampled\n");
+	}
+	StartupMark("Images created");
+	signal(SIGUSR1, OnSigUsr1);
+	signal(SIGINT, OnSigInt);
+	signal(SIGTERM, OnSigInt);
+
+	GLuint uvLoc = 1; // Locations fixed in sVertex
+	GLuint vertexLoc = 0;
 
 	GLuint vao;
 	glGenVertexArrays(1, &vao);
@@ -201,15 +561,71 @@ int main()
 	GLuint targetTexture;
 	glGenTextures(1, &targetTexture);
 	glBindTexture(GL_TEXTURE_2D, targetTexture);
-	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, mode->width, mode->height, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+	glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, framebufferWidth, framebufferHeight, 0, GL_RGB, GL_UNSIGNED_BYTE, nullptr);
+	if (Platform == ePF_Headless)
+	{
+		// No default framebuffer, the quad is drawn into targetTexture
+		GLuint targetFramebuffer;
+		glGenFramebuffers(1, &targetFramebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, targetFramebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, targetTexture, 0);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+		{
+			printf("Target framebuffer incomplete\n");
+		}
+		glViewport(0, 0, framebufferWidth, framebufferHeight);
+	}
 
-	while (!glfwWindowShouldClose(glfwWindow))
+	bool firstFrame = true;
+	while (platform->PollEvents() && !Quit)
 	{
-		video.FrameProcessing();
+		bool newFrame = video.FrameProcessing(); // Never blocks, the last good frame stays bound
+		if (SourcePairChanged)
+		{
+			UseSourceProgram(variants);
+		}
 		glDrawElements(GL_TRIANGLES, indexBuffer.size(), GL_UNSIGNED_SHORT, nullptr);
-		glfwSwapBuffers(glfwWindow);
-		glfwPollEvents();
+		video.FrameSubmitted(); // Fences the draw sampling the current frame
+		if (newFrame && firstFrame)
+		{
+			SStartupPhase phase("First SwapBuffers");
+			platform->SwapBuffers();
+		}
+		else
+		{
+			platform->SwapBuffers();
+		}
+		video.FramePresented();
+		if (newFrame && firstFrame)
+		{
+			firstFrame = false;
+			StartupMark("First frame presented");
+			EndStartupProfile();
+		}
+		unsigned width;
+		unsigned height;
+		platform->GetFramebufferSize(width, height);
+		if (width != framebufferWidth || height != framebufferHeight)
+		{
+			framebufferWidth = width;
+			framebufferHeight = height;
+			OnFramebufferSize(video, width, height);
+		}
+		if (PrintLatency)
+		{
+			PrintLatency = 0;
+			video.PrintLatency();
+		}
 	}
 
+	video.PrintLatency();
+
+	video.Destroy(); // Joins the pipeline thread
+	GpuConvert.Destroy();
+	platform->Destroy();
+	if (StartupProfile != nullptr)
+	{
+		WriteStartupProfile(StartupProfile);
+	}
 	return 0;
 }
@@ -0,0 +1,16 @@
+#pragma once
+
+// Window system behind the renderer: a current GLES 3.1 context with the glad entry points loaded
+// and a default framebuffer presented with vsync. Render thread only.
+class SPlatform
+{
+public:
+    virtual ~SPlatform()
+    {
+    };
+    virtual bool Create() = 0;
+    virtual void Destroy() = 0;
+    virtual void GetFramebufferSize(unsigned& width, unsigned& height) const = 0;
+    virtual void SwapBuffers() = 0;
+    virtual bool PollEvents() = 0; // False once the application should quit
+};
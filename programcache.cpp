@@ -0,0 +1,243 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <chrono>
+
+#include "glad/glad.h"
+
+#include "programcache.h"
+#include "startupprofile.h"
+
+using namespace std;
+
+static const uint32_t Magic = 0x31475250; // 'PRG1'
+
+// Ahead of the binary in a cache file
+struct tstFileHeader
+{
+    uint32_t Magic;
+    uint32_t Format; // glGetProgramBinary binaryFormat
+    uint64_t Key; // Guards against truncated names and copied files
+    uint32_t Length;
+};
+
+static uint64_t Fnv1a(uint64_t hash, const void* data, size_t length)
+{
+    const unsigned char* p = (const unsigned char*)data;
+    for (size_t i = 0; i < length; i++)
+    {
+        hash = (hash ^ p[i]) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static unsigned Elapsed(chrono::steady_clock::time_point start)
+{
+    return (unsigned)chrono::duration_cast<chrono::microseconds>(chrono::steady_clock::now() - start).count();
+}
+
+string DefaultCacheDirectory()
+{
+    string cache;
+    if (getenv("XDG_CACHE_HOME") != nullptr)
+    {
+        cache = getenv("XDG_CACHE_HOME");
+    }
+    else if (getenv("HOME") != nullptr)
+    {
+        cache = string(getenv("HOME")) + "/.cache";
+    }
+    string directory;
+    if (!cache.empty())
+    {
+        mkdir(cache.c_str(), 0755);
+        directory = cache + "/tearing";
+    }
+    if (!directory.empty() && mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST)
+    {
+        printf("Cache %s: %s\n", directory.c_str(), strerror(errno));
+        directory.clear();
+    }
+    return directory;
+}
+
+SProgramCache::SProgramCache(const char* directory) :
+    Directory(directory != nullptr ? directory : DefaultCacheDirectory())
+{
+}
+
+// Cached binary if the driver accepts it, else compiled and stored. Prints the time either way.
+unsigned SProgramCache::GetProgram(const tShaders& shaders)
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    GLint formats = 0;
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+    bool cache = !Directory.empty() && formats > 0;
+    uint64_t key = cache ? Key(shaders) : 0;
+    GLuint program = cache ? Load(key) : 0;
+    if (program != 0)
+    {
+        printf("Program %016llx loaded from cache in %u us\n", (unsigned long long)key, Elapsed(start));
+        return program;
+    }
+
+    program = CompileProgram(shaders, cache);
+    if (program != 0 && cache)
+    {
+        Store(key, program);
+    }
+    printf("Program %016llx compiled in %u us\n", (unsigned long long)key, Elapsed(start));
+    return program;
+}
+
+unsigned SProgramCache::CompileProgram(const tShaders& shaders, bool retrievable)
+{
+    GLint result = GL_FALSE;
+    vector<GLuint> shaderIDs;
+    for (const pair<unsigned, string>& shader : shaders)
+    {
+        SStartupPhase phase(shader.first == GL_VERTEX_SHADER ? "Compile vertex shader" : shader.first == GL_FRAGMENT_SHADER ?
+            "Compile fragment shader" : "Compile shader");
+        GLuint shaderID = glCreateShader(shader.first);
+        const GLchar* sourcePointer = shader.second.c_str();
+        glShaderSource(shaderID, 1, &sourcePointer, NULL);
+        glCompileShader(shaderID);
+        glGetShaderiv(shaderID, GL_COMPILE_STATUS, &result);
+        if (result == GL_FALSE) {
+            int InfoLogLength;
+            glGetShaderiv(shaderID, GL_INFO_LOG_LENGTH, &InfoLogLength);
+            vector<char> ShaderErrorMessage(InfoLogLength + 1);
+            glGetShaderInfoLog(shaderID, InfoLogLength, NULL, &ShaderErrorMessage[0]);
+            printf("%s\n", &ShaderErrorMessage[0]);
+        }
+        shaderIDs.push_back(shaderID);
+    }
+
+    SStartupPhase phase("Link program"); // Mesa may link in the background, the status query waits for it
+    GLuint program = glCreateProgram();
+    if (retrievable)
+    {
+        glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    }
+    for (GLuint shaderID : shaderIDs)
+    {
+        glAttachShader(program, shaderID);
+    }
+    glLinkProgram(program);
+    for (GLuint shaderID : shaderIDs)
+    {
+        glDeleteShader(shaderID); // Flagged, freed with the program
+    }
+    glGetProgramiv(program, GL_LINK_STATUS, &result);
+    if (result == GL_FALSE) {
+        int InfoLogLength;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &InfoLogLength);
+        vector<char> ProgramErrorMessage(InfoLogLength + 1);
+        glGetProgramInfoLog(program, InfoLogLength, NULL, &ProgramErrorMessage[0]);
+        printf("%s\n", &ProgramErrorMessage[0]);
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+// Sources plus the driver identity, a binary is only valid for the driver build that produced it
+uint64_t SProgramCache::Key(const tShaders& shaders) const
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (const pair<unsigned, string>& shader : shaders)
+    {
+        hash = Fnv1a(hash, &shader.first, sizeof(shader.first));
+        hash = Fnv1a(hash, shader.second.c_str(), shader.second.size() + 1);
+    }
+    for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
+    {
+        const char* value = (const char*)glGetString(name);
+        value = value != nullptr ? value : "";
+        hash = Fnv1a(hash, value, strlen(value) + 1);
+    }
+    return hash;
+}
+
+string SProgramCache::FileName(uint64_t key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "/%016llx.bin", (unsigned long long)key);
+    return Directory + name;
+}
+
+// 0 if there is no usable binary, a rejected one is left to be overwritten
+unsigned SProgramCache::Load(uint64_t key) const
+{
+    FILE* file = fopen(FileName(key).c_str(), "rb");
+    if (file == nullptr)
+    {
+        return 0;
+    }
+    tstFileHeader header;
+    vector<char> binary;
+    struct stat status;
+    bool valid = fread(&header, sizeof(header), 1, file) == 1 && header.Magic == Magic && header.Key == key;
+    // A damaged length must not allocate more than the file holds
+    valid = valid && fstat(fileno(file), &status) == 0 && header.Length <= (uint64_t)status.st_size - sizeof(header);
+    if (valid)
+    {
+        binary.resize(header.Length);
+        valid = fread(binary.data(), 1, binary.size(), file) == binary.size();
+    }
+    fclose(file);
+    if (!valid)
+    {
+        printf("Program cache %s: invalid file\n", FileName(key).c_str());
+        return 0;
+    }
+
+    SStartupPhase phase("Load program binary");
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, header.Format, binary.data(), binary.size());
+    GLint result = GL_FALSE;
+    glGetProgramiv(program, GL_LINK_STATUS, &result);
+    if (result == GL_FALSE)
+    {
+        printf("Program cache %s: binary rejected by the driver\n", FileName(key).c_str());
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+// Written to a temporary file and renamed, a concurrent start never reads a partial binary
+void SProgramCache::Store(uint64_t key, unsigned program) const
+{
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if (length <= 0)
+    {
+        return;
+    }
+    SStartupPhase phase("Store program binary");
+    tstFileHeader header = { Magic, 0, key, 0 };
+    vector<char> binary(length);
+    GLsizei written = 0;
+    glGetProgramBinary(program, length, &written, &header.Format, binary.data());
+    header.Length = written;
+
+    string name = FileName(key);
+    string temporary = name + ".tmp" + to_string(getpid());
+    FILE* file = fopen(temporary.c_str(), "wb");
+    if (file == nullptr)
+    {
+        printf("Program cache %s: %s\n", temporary.c_str(), strerror(errno));
+        return;
+    }
+    bool result = fwrite(&header, sizeof(header), 1, file) == 1 && fwrite(binary.data(), 1, written, file) == (size_t)written;
+    result &= fclose(file) == 0;
+    if (!result || rename(temporary.c_str(), name.c_str()) != 0)
+    {
+        printf("Program cache %s: %s\n", name.c_str(), strerror(errno));
+        unlink(temporary.c_str());
+    }
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Disk cache of linked GL programs: glGetProgramBinary blobs in one file per program, named by a hash
+// of the shader sources, GL_RENDERER and GL_VERSION. A missing file or a binary the driver rejects
+// (e.g. after a Mesa update keeping the version string) falls back to compiling the sources.
+class SProgramCache
+{
+public:
+    typedef std::vector<std::pair<unsigned, std::string>> tShaders; // Shader type and source
+
+    SProgramCache(const char* directory = nullptr); // nullptr: $XDG_CACHE_HOME/tearing or ~/.cache/tearing
+    unsigned GetProgram(const tShaders& shaders); // 0 if compiling fails
+
+private:
+    static unsigned CompileProgram(const tShaders& shaders, bool retrievable);
+    uint64_t Key(const tShaders& shaders) const;
+    std::string FileName(uint64_t key) const;
+    unsigned Load(uint64_t key) const;
+    void Store(uint64_t key, unsigned program) const;
+
+    std::string Directory; // Empty disables the cache
+};
+
+std::string DefaultCacheDirectory(); // $XDG_CACHE_HOME/tearing or ~/.cache/tearing, created. Empty if unusable.
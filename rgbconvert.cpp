@@ -0,0 +1,113 @@
+#include <stddef.h>
+
+#include "rgbconvert.h"
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+static void LineScalar(const unsigned char* in, unsigned char* out, unsigned width)
+{
+    for (unsigned x = 0; x < width; x++, in += 3, out += 4)
+    {
+        out[0] = in[2];
+        out[1] = in[1];
+        out[2] = in[0];
+        out[3] = 255;
+    }
+}
+
+#if defined(__ARM_NEON)
+// De-interleaving loads and interleaving stores, 16 pixels per step
+static void LineNeon(const unsigned char* in, unsigned char* out, unsigned width)
+{
+    unsigned x = 0;
+    for (; x + 16 <= width; x += 16)
+    {
+        uint8x16x3_t rgb = vld3q_u8(in + 3 * x);
+        uint8x16x4_t bgra;
+        bgra.val[0] = rgb.val[2];
+        bgra.val[1] = rgb.val[1];
+        bgra.val[2] = rgb.val[0];
+        bgra.val[3] = vdupq_n_u8(255);
+        vst4q_u8(out + 4 * x, bgra);
+    }
+    LineScalar(in + 3 * x, out + 4 * x, width - x);
+}
+#elif defined(__x86_64__) || defined(__i386__)
+// 4 pixels per 16 byte load, which reads 4 bytes past them: the last 2 pixels of a line stay scalar
+__attribute__((target("ssse3")))
+static void LineSsse3(const unsigned char* in, unsigned char* out, unsigned width)
+{
+    const __m128i shuffle = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+    unsigned x = 0;
+    for (; x + 18 <= width; x += 16)
+    {
+        const unsigned char* p = in + 3 * x;
+        __m128i* o = (__m128i*)(out + 4 * x);
+        _mm_storeu_si128(o + 0, _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 0)), shuffle), alpha));
+        _mm_storeu_si128(o + 1, _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 12)), shuffle), alpha));
+        _mm_storeu_si128(o + 2, _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 24)), shuffle), alpha));
+        _mm_storeu_si128(o + 3, _mm_or_si128(_mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(p + 36)), shuffle), alpha));
+    }
+    LineScalar(in + 3 * x, out + 4 * x, width - x);
+}
+
+// The shuffle stays within 128 bit lanes, a dword permute first moves pixels 4..7 into the upper lane.
+// 8 pixels per 32 byte load, which reads 8 bytes past them: the last 3 pixels of a line stay scalar.
+__attribute__((target("avx2")))
+static void LineAvx2(const unsigned char* in, unsigned char* out, unsigned width)
+{
+    const __m256i permute = _mm256_setr_epi32(0, 1, 2, 3, 3, 4, 5, 6);
+    const __m256i shuffle = _mm256_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1,
+        2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m256i alpha = _mm256_set1_epi32((int)0xff000000);
+    unsigned x = 0;
+    for (; x + 19 <= width; x += 16)
+    {
+        const unsigned char* p = in + 3 * x;
+        __m256i* o = (__m256i*)(out + 4 * x);
+        __m256i a = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)(p + 0)), permute);
+        __m256i b = _mm256_permutevar8x32_epi32(_mm256_loadu_si256((const __m256i*)(p + 24)), permute);
+        _mm256_storeu_si256(o + 0, _mm256_or_si256(_mm256_shuffle_epi8(a, shuffle), alpha));
+        _mm256_storeu_si256(o + 1, _mm256_or_si256(_mm256_shuffle_epi8(b, shuffle), alpha));
+    }
+    LineScalar(in + 3 * x, out + 4 * x, width - x);
+}
+#endif
+
+vector<tstRgbKernel> RgbKernels()
+{
+    vector<tstRgbKernel> kernels;
+    kernels.push_back({ "scalar", LineScalar });
+#if defined(__ARM_NEON)
+    kernels.push_back({ "neon", LineNeon });
+#elif defined(__x86_64__) || defined(__i386__)
+    if (__builtin_cpu_supports("ssse3"))
+    {
+        kernels.push_back({ "ssse3", LineSsse3 });
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        kernels.push_back({ "avx2", LineAvx2 });
+    }
+#endif
+    return kernels;
+}
+
+// The conversion streams without reuse, a line (one input and one output line fit into L1) is the
+// cache block. Software prefetch measured slower than the hardware stream prefetchers.
+void ConvertRgb24ToBgr32(const unsigned char* in, unsigned inPitch, unsigned char* out, unsigned outPitch,
+    unsigned width, unsigned first, unsigned count)
+{
+    static const tRgbLineKernel line = RgbKernels().back().Line;
+    for (unsigned y = first; y < first + count; y++)
+    {
+        line(in + (size_t)y * inPitch, out + (size_t)y * outPitch, width);
+    }
+}
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <vector>
+
+// CPU version of the ISP 'RGB3' -> 'BGR4' conversion: the first and third byte of each pixel swap
+// and a fourth byte of 255 is appended. SIMD line kernels with a scalar tail, selected at runtime.
+typedef void (*tRgbLineKernel)(const unsigned char* in, unsigned char* out, unsigned width);
+
+struct tstRgbKernel
+{
+    const char* Name;
+    tRgbLineKernel Line;
+};
+
+// Kernels this CPU runs, the fastest last
+std::vector<tstRgbKernel> RgbKernels();
+
+// Rows [first, first + count) with the fastest kernel
+void ConvertRgb24ToBgr32(const unsigned char* in, unsigned inPitch, unsigned char* out, unsigned outPitch,
+    unsigned width, unsigned first, unsigned count);
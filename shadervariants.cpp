@@ -0,0 +1,171 @@
+#include <stdio.h>
+#include <string.h>
+#include <libdrm/drm_fourcc.h>
+#include <algorithm>
+
+#include "glad/glad.h"
+
+#include "shadervariants.h"
+
+using namespace std;
+
+// Component in each memory byte of the 4 byte formats: r, g, b, a, x unused, u/v chroma, y/z the
+// luma of the first/second pixel of a packed YUV pair
+struct tstLayout
+{
+    unsigned Fourcc;
+    const char* Bytes;
+};
+
+// Preferred imports first
+static const tstLayout Layouts[] =
+{
+    { DRM_FORMAT_ABGR8888, "rgba" },
+    { DRM_FORMAT_XBGR8888, "rgbx" },
+    { DRM_FORMAT_ARGB8888, "bgra" },
+    { DRM_FORMAT_XRGB8888, "bgrx" },
+    { DRM_FORMAT_RGBA8888, "abgr" },
+    { DRM_FORMAT_RGBX8888, "xbgr" },
+    { DRM_FORMAT_BGRA8888, "argb" },
+    { DRM_FORMAT_BGRX8888, "xrgb" },
+    { DRM_FORMAT_UYVY, "uyvz" },
+    { DRM_FORMAT_YUYV, "yuzv" },
+    { DRM_FORMAT_VYUY, "vyuz" },
+    { DRM_FORMAT_YVYU, "yvzu" },
+};
+
+static const tstLayout* FindLayout(unsigned fourcc)
+{
+    for (const tstLayout& layout : Layouts)
+    {
+        if (layout.Fourcc == fourcc)
+        {
+            return &layout;
+        }
+    }
+    return nullptr;
+}
+
+static bool IsYuv(const tstLayout& layout)
+{
+    return strchr(layout.Bytes, 'y') != nullptr;
+}
+
+// Sampled component holding a memory component, e.g. 'b' for memory 'r' of an ARGB8888 import
+static char Sampled(const tstLayout& memory, const tstLayout& import, char component)
+{
+    return import.Bytes[strchr(memory.Bytes, component) - memory.Bytes];
+}
+
+SShaderVariants::SShaderVariants(SProgramCache& cache, const string& vertex) :
+    Cache(cache),
+    Vertex(vertex),
+    Programs()
+{
+}
+
+// The memory layout itself, else an importable RGB layout with the colour bytes in the same places
+// (no swizzle), else any that samples every colour byte
+SShaderVariants::tstFormatPair SShaderVariants::Negotiate(unsigned memory, bool bt709, bool fullRange, const vector<unsigned>& importable)
+{
+    const tstLayout* source = FindLayout(memory);
+    bool direct = importable.empty() || find(importable.begin(), importable.end(), memory) != importable.end();
+    if (source == nullptr || direct)
+    {
+        return { memory, memory, false, false }; // YUV hints are applied by the import
+    }
+    for (int pass = 0; pass < 2; pass++)
+    {
+        for (const tstLayout& import : Layouts)
+        {
+            if (IsYuv(import) || find(importable.begin(), importable.end(), import.Fourcc) == importable.end())
+            {
+                continue;
+            }
+            bool usable = true;
+            for (int i = 0; i < 4; i++)
+            {
+                bool colour = source->Bytes[i] != 'a' && source->Bytes[i] != 'x';
+                usable &= !colour || (pass == 0 ? import.Bytes[i] == source->Bytes[i] : import.Bytes[i] != 'x');
+            }
+            if (usable)
+            {
+                bool yuv = IsYuv(*source);
+                return { memory, import.Fourcc, yuv && bt709, yuv && fullRange };
+            }
+        }
+    }
+    printf("No importable layout for %.4s\n", (char*)&memory);
+    return { memory, memory, false, false };
+}
+
+bool SShaderVariants::Packed(const tstFormatPair& pair)
+{
+    const tstLayout* memory = FindLayout(pair.Memory);
+    return pair.Import != pair.Memory && memory != nullptr && IsYuv(*memory);
+}
+
+string SShaderVariants::FragmentSource(const tstFormatPair& pair)
+{
+    bool packed = Packed(pair);
+    string source = "#version 310 es\n";
+    if (pair.Import != 0)
+    {
+        source += "#extension GL_OES_EGL_image_external_essl3 : require\n";
+    }
+    source += packed ? "precision highp float; // Pixel position within the texel\n" : "precision mediump float;\n";
+    source += "in vec2 UV;\n";
+    source += pair.Import != 0 ? "uniform samplerExternalOES Texture;\n" : "uniform sampler2D Texture;\n";
+    if (packed)
+    {
+        source += "uniform float SourceWidth; // Pixels, two per texel\n";
+    }
+    source += "out vec4 finalColor;\n"
+        "void main()\n"
+        "{\n"
+        "    vec4 texel = texture(Texture, UV);\n";
+
+    const tstLayout* memory = FindLayout(pair.Memory);
+    const tstLayout* import = FindLayout(pair.Import);
+    char line[256];
+    if (pair.Import == pair.Memory || memory == nullptr || import == nullptr)
+    {
+        source += "    finalColor = texel;\n";
+    }
+    else if (!packed)
+    {
+        snprintf(line, sizeof(line), "    finalColor = vec4(texel.%c, texel.%c, texel.%c, 1.0);\n",
+            Sampled(*memory, *import, 'r'), Sampled(*memory, *import, 'g'), Sampled(*memory, *import, 'b'));
+        source += line;
+    }
+    else
+    {
+        snprintf(line, sizeof(line), "    float y = fract(UV.x * SourceWidth * 0.5) < 0.5 ? texel.%c : texel.%c;\n"
+            "    vec3 yuv = vec3(y, texel.%c, texel.%c);\n",
+            Sampled(*memory, *import, 'y'), Sampled(*memory, *import, 'z'), Sampled(*memory, *import, 'u'), Sampled(*memory, *import, 'v'));
+        source += line;
+        source += pair.FullRange ? "    yuv -= vec3(0.0, 128.0, 128.0) / 255.0;\n" :
+            "    yuv = (yuv * 255.0 - vec3(16.0, 128.0, 128.0)) / vec3(219.0, 224.0, 224.0);\n";
+        // R = Y + Kr' V, G = Y - Kgu U - Kgv V, B = Y + Kb' U
+        snprintf(line, sizeof(line), "    finalColor = vec4(yuv.x + %.6f * yuv.z, yuv.x - %.6f * yuv.y - %.6f * yuv.z, yuv.x + %.6f * yuv.y, 1.0);\n",
+            pair.Bt709 ? 1.5748 : 1.402, pair.Bt709 ? 0.187324 : 0.344136, pair.Bt709 ? 0.468124 : 0.714136, pair.Bt709 ? 1.8556 : 1.772);
+        source += line;
+    }
+    source += "}\n";
+    return source;
+}
+
+unsigned SShaderVariants::GetProgram(const tstFormatPair& pair)
+{
+    string fragment = FragmentSource(pair);
+    map<string, unsigned>::iterator it = Programs.find(fragment);
+    if (it != Programs.end())
+    {
+        return it->second;
+    }
+    printf("Shader variant: memory %.4s, import %.4s\n", pair.Memory != 0 ? (char*)&pair.Memory : "RGBA",
+        pair.Import != 0 ? (char*)&pair.Import : "RGBA");
+    unsigned program = Cache.GetProgram({ { GL_VERTEX_SHADER, Vertex }, { GL_FRAGMENT_SHADER, fragment } });
+    Programs[fragment] = program;
+    return program;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+
+#include "programcache.h"
+
+// Display fragment shaders generated from the pair of the layout a buffer has in memory and the DRM
+// fourcc it is imported with. The import is chosen to match the memory layout, so the shader only
+// samples; where the EGL implementation lacks that fourcc, the nearest importable one is used and the
+// shader swizzles, or for packed YUV applies the matrix and range the import hints would have.
+class SShaderVariants
+{
+public:
+    struct tstFormatPair
+    {
+        unsigned Memory; // DRM fourcc of the bytes in the buffer, 0 for the RGBA8 compute target
+        unsigned Import; // DRM fourcc given to eglCreateImageKHR, 0 for the RGBA8 compute target
+        bool Bt709; // Packed YUV only
+        bool FullRange;
+    };
+
+    SShaderVariants(SProgramCache& cache, const std::string& vertex);
+    // Empty importable list: the query is unsupported, the memory layout is assumed to import
+    static tstFormatPair Negotiate(unsigned memory, bool bt709, bool fullRange, const std::vector<unsigned>& importable);
+    static bool Packed(const tstFormatPair& pair); // YUV imported as 32 bit RGB, two pixels per texel, uniform SourceWidth
+    static std::string FragmentSource(const tstFormatPair& pair);
+    unsigned GetProgram(const tstFormatPair& pair); // Compiled or loaded on first use
+
+private:
+    SProgramCache& Cache;
+    const std::string Vertex;
+    std::map<std::string, unsigned> Programs; // By fragment source
+};
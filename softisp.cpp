@@ -0,0 +1,307 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
+#include <linux/udmabuf.h>
+
+#include "rgbconvert.h"
+#include "softisp.h"
+
+#define CLEAR(x) memset(&(x), 0, sizeof(x))
+
+using namespace std;
+
+// Contiguous memory first, the display controller can scan it out directly
+static const char* const HeapNames[] = { "/dev/dma_heap/linux,cma", "/dev/dma_heap/system" };
+static const unsigned Alignment = 64; // Converted lines start on a cache line
+static const unsigned BandBytes = 128 * 1024; // Input and output of a band, half a core's share of the Pi 4 L2
+
+static void SyncDmaBuf(int fd, uint64_t flags)
+{
+    struct dma_buf_sync sync;
+    CLEAR(sync);
+    sync.flags = flags;
+    if (ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync) != 0 && errno != ENOTTY) // Plain memfd of a synthetic source
+    {
+        printf("DMA_BUF_IOCTL_SYNC: %s\n", strerror(errno));
+    }
+}
+
+SSoftIsp::SSoftIsp() :
+    HeapFd(-1),
+    UdmabufFd(-1),
+    Width(0),
+    Height(0),
+    SourceBytesPerLine(0),
+    TargetBytesPerLine(0),
+    Sources(),
+    Targets(),
+    QueuedSources(),
+    QueuedTargets(),
+    DoneSources(),
+    DoneTargets(),
+    Pool()
+{
+}
+
+void SSoftIsp::StartWorkers(const vector<unsigned>& cores)
+{
+    Pool.Start(cores);
+}
+
+void SSoftIsp::SetFormat(unsigned width, unsigned height, unsigned sourceBytesPerLine)
+{
+    Width = width;
+    Height = height;
+    SourceBytesPerLine = sourceBytesPerLine;
+    TargetBytesPerLine = (width * 4 + Alignment - 1) / Alignment * Alignment;
+    printf("Software ISP: width = %u, height = %u, RGB3 -> BGR4, stride = %u\n", Width, Height, TargetBytesPerLine);
+}
+
+unsigned SSoftIsp::GetBytesPerLine() const
+{
+    return TargetBytesPerLine;
+}
+
+// The capture dmabufs are only read, the fd stays owned by the capture queue
+bool SSoftIsp::AddSource(int dmaFd, unsigned length)
+{
+    tstBuffer buffer = { dmaFd, nullptr, length };
+    buffer.Map = (unsigned char*)mmap(nullptr, length, PROT_READ, MAP_SHARED, dmaFd, 0);
+    if (buffer.Map == MAP_FAILED)
+    {
+        printf("Software ISP mmap DMA fd %d: %s\n", dmaFd, strerror(errno));
+        return false;
+    }
+    Sources.push_back(buffer);
+    return true;
+}
+
+void SSoftIsp::FreeSources()
+{
+    for (const tstBuffer& buffer : Sources)
+    {
+        munmap(buffer.Map, buffer.Length);
+    }
+    Sources.clear();
+    FlushSources();
+}
+
+// DMA heap, else a udmabuf around a memfd
+int SSoftIsp::AllocDmaBuf(unsigned size)
+{
+    if (HeapFd < 0 && UdmabufFd < 0)
+    {
+        for (const char* name : HeapNames)
+        {
+            HeapFd = open(name, O_RDWR | O_CLOEXEC);
+            if (HeapFd >= 0)
+            {
+                printf("Software ISP buffers from %s\n", name);
+                break;
+            }
+        }
+        if (HeapFd < 0)
+        {
+            UdmabufFd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+            if (UdmabufFd < 0)
+            {
+                printf("Software ISP: no DMA heap and /dev/udmabuf: %s\n", strerror(errno));
+                return -1;
+            }
+            printf("Software ISP buffers from /dev/udmabuf\n");
+        }
+    }
+
+    if (HeapFd >= 0)
+    {
+        struct dma_heap_allocation_data data;
+        CLEAR(data);
+        data.len = size;
+        data.fd_flags = O_RDWR | O_CLOEXEC;
+        if (ioctl(HeapFd, DMA_HEAP_IOCTL_ALLOC, &data) != 0)
+        {
+            printf("DMA_HEAP_IOCTL_ALLOC %u bytes: %s\n", size, strerror(errno));
+            return -1;
+        }
+        return data.fd;
+    }
+
+    int memFd = memfd_create("softisp", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memFd < 0 || ftruncate(memFd, size) != 0)
+    {
+        printf("memfd %u bytes: %s\n", size, strerror(errno));
+        if (memFd >= 0)
+        {
+            close(memFd);
+        }
+        return -1;
+    }
+    // udmabuf requires the memfd to be sealed against shrinking
+    fcntl(memFd, F_ADD_SEALS, F_SEAL_SHRINK);
+    struct udmabuf_create create;
+    CLEAR(create);
+    create.memfd = memFd;
+    create.flags = UDMABUF_FLAGS_CLOEXEC;
+    create.size = size;
+    int fd = ioctl(UdmabufFd, UDMABUF_CREATE, &create);
+    if (fd < 0)
+    {
+        printf("UDMABUF_CREATE: %s\n", strerror(errno));
+    }
+    close(memFd); // The udmabuf holds the pages
+    return fd;
+}
+
+unsigned SSoftIsp::AllocTargets(unsigned count, vector<int>& dmaFd)
+{
+    unsigned page = sysconf(_SC_PAGESIZE);
+    unsigned size = (TargetBytesPerLine * Height + page - 1) / page * page;
+    for (unsigned i = 0; i < count; i++)
+    {
+        tstBuffer buffer = { AllocDmaBuf(size), nullptr, size };
+        if (buffer.DmaFd < 0)
+        {
+            return i;
+        }
+        buffer.Map = (unsigned char*)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, buffer.DmaFd, 0);
+        if (buffer.Map == MAP_FAILED)
+        {
+            printf("Software ISP mmap: %s\n", strerror(errno));
+            close(buffer.DmaFd);
+            return i;
+        }
+        int fd = fcntl(buffer.DmaFd, F_DUPFD_CLOEXEC, 0);
+        if (fd < 0)
+        {
+            printf("Software ISP DMA fd: %s\n", strerror(errno));
+            munmap(buffer.Map, size);
+            close(buffer.DmaFd);
+            return i;
+        }
+        printf("Software ISP DMA fd %d for buffer index %u\n", fd, i);
+        Targets.push_back(buffer);
+        dmaFd.push_back(fd);
+    }
+    return count;
+}
+
+void SSoftIsp::FreeTargets()
+{
+    for (const tstBuffer& buffer : Targets)
+    {
+        munmap(buffer.Map, buffer.Length);
+        close(buffer.DmaFd);
+    }
+    Targets.clear();
+    FlushTargets();
+}
+
+void SSoftIsp::QueueSource(unsigned index)
+{
+    QueuedSources.push_back(index);
+}
+
+void SSoftIsp::QueueTarget(unsigned index)
+{
+    QueuedTargets.push_back(index);
+}
+
+int SSoftIsp::DequeueSource()
+{
+    if (DoneSources.empty())
+    {
+        return -1;
+    }
+    int index = DoneSources.front();
+    DoneSources.pop_front();
+    return index;
+}
+
+int SSoftIsp::DequeueTarget()
+{
+    if (DoneTargets.empty())
+    {
+        return -1;
+    }
+    int index = DoneTargets.front();
+    DoneTargets.pop_front();
+    return index;
+}
+
+void SSoftIsp::FlushSources()
+{
+    QueuedSources.clear();
+    DoneSources.clear();
+}
+
+void SSoftIsp::FlushTargets()
+{
+    QueuedTargets.clear();
+    DoneTargets.clear();
+}
+
+// Like the ISP, in queue order while both queues hold a buffer
+void SSoftIsp::Process()
+{
+    while (!QueuedSources.empty() && !QueuedTargets.empty())
+    {
+        unsigned source = QueuedSources.front();
+        unsigned target = QueuedTargets.front();
+        QueuedSources.pop_front();
+        QueuedTargets.pop_front();
+        if (source < Sources.size() && target < Targets.size())
+        {
+            Convert(Sources[source], Targets[target]);
+        }
+        DoneSources.push_back(source);
+        DoneTargets.push_back(target);
+    }
+}
+
+// The syncs make the CPU view coherent with the capture DMA and the GPU on non-coherent SoCs
+void SSoftIsp::Convert(const tstBuffer& source, const tstBuffer& target)
+{
+    SyncDmaBuf(source.DmaFd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ);
+    SyncDmaBuf(target.DmaFd, DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE);
+    ConvertFrame(Pool, source.Map, SourceBytesPerLine, target.Map, TargetBytesPerLine, Width, Height);
+    SyncDmaBuf(target.DmaFd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE);
+    SyncDmaBuf(source.DmaFd, DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ);
+}
+
+// Bands of whole lines sized for the caches, the frame is done when the last band is
+void SSoftIsp::ConvertFrame(SThreadPool& pool, const unsigned char* in, unsigned inPitch, unsigned char* out, unsigned outPitch,
+    unsigned width, unsigned height)
+{
+    unsigned rows = BandBytes / (inPitch + outPitch);
+    rows = rows != 0 ? rows : 1;
+    unsigned bands = (height + rows - 1) / rows;
+    pool.ParallelFor(bands, [&](unsigned band)
+    {
+        unsigned first = band * rows;
+        ConvertRgb24ToBgr32(in, inPitch, out, outPitch, width, first, first + rows < height ? rows : height - first);
+    });
+}
+
+void SSoftIsp::Destroy()
+{
+    Pool.Stop();
+    FreeSources();
+    FreeTargets();
+    if (HeapFd >= 0)
+    {
+        close(HeapFd);
+    }
+    if (UdmabufFd >= 0)
+    {
+        close(UdmabufFd);
+    }
+    HeapFd = -1;
+    UdmabufFd = -1;
+}
@@ -0,0 +1,59 @@
+#pragma once
+
+#include <deque>
+#include <vector>
+
+#include "threadpool.h"
+
+// CPU stand-in for the ISP when /dev/video12 is missing or busy. Behaves like the M2M device with
+// an output queue of mmapped RGB24 capture buffers and a capture queue of BGR32 dmabufs from a DMA
+// heap, imported as EGL images like the ISP capture buffers. Process() converts every queued pair
+// with the SIMD kernels of rgbconvert.h, split into row bands on a pool of pinned workers.
+// Does not scale, the converted frames have the source size.
+class SSoftIsp
+{
+public:
+    SSoftIsp();
+    void StartWorkers(const std::vector<unsigned>& cores); // Without workers the caller converts alone
+    void SetFormat(unsigned width, unsigned height, unsigned sourceBytesPerLine);
+    unsigned GetBytesPerLine() const; // Of the converted frames
+    bool AddSource(int dmaFd, unsigned length); // Index order of the capture queue
+    void FreeSources();
+    unsigned AllocTargets(unsigned count, std::vector<int>& dmaFd); // The caller owns the returned fds
+    void FreeTargets();
+    void QueueSource(unsigned index);
+    void QueueTarget(unsigned index);
+    int DequeueSource(); // -1 if none is done
+    int DequeueTarget();
+    void FlushSources(); // Stream off, queued buffers return without being dequeued
+    void FlushTargets();
+    void Process();
+    void Destroy();
+    static void ConvertFrame(SThreadPool& pool, const unsigned char* in, unsigned inPitch, unsigned char* out, unsigned outPitch,
+        unsigned width, unsigned height);
+
+private:
+    struct tstBuffer
+    {
+        int DmaFd; // Sync ioctls, the capture queue owns source fds
+        unsigned char* Map;
+        unsigned Length;
+    };
+
+    int AllocDmaBuf(unsigned size);
+    void Convert(const tstBuffer& source, const tstBuffer& target);
+
+    int HeapFd; // /dev/dma_heap, -1 falls back to udmabuf
+    int UdmabufFd;
+    unsigned Width;
+    unsigned Height;
+    unsigned SourceBytesPerLine;
+    unsigned TargetBytesPerLine;
+    std::vector<tstBuffer> Sources;
+    std::vector<tstBuffer> Targets;
+    std::deque<int> QueuedSources;
+    std::deque<int> QueuedTargets;
+    std::deque<int> DoneSources;
+    std::deque<int> DoneTargets;
+    SThreadPool Pool;
+};
@@ -0,0 +1,134 @@
+// Single core throughput of the RGB24 -> BGR32 kernels and of the software ISP on dmabufs, then the
+// scaling of the row band conversion over 1 .. all cores:
+//   ./softispbench [width height [frames]]
+// GB/s counts the bytes read and written, 7 per pixel.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <thread>
+#include <vector>
+
+#include "latency.h"
+#include "rgbconvert.h"
+#include "softisp.h"
+
+using namespace std;
+
+static void Report(const char* name, unsigned width, unsigned height, unsigned frames, uint64_t ns)
+{
+    double bytes = 7.0 * width * height * frames;
+    printf("%-10s %7.3f ms/frame %7.2f GB/s\n", name, ns / 1e6 / frames, bytes / ns);
+}
+
+int main(int argc, char* argv[])
+{
+    unsigned width = argc > 2 ? atoi(argv[1]) : 1920;
+    unsigned height = argc > 2 ? atoi(argv[2]) : 1080;
+    unsigned frames = argc > 3 ? atoi(argv[3]) : 200;
+    unsigned inPitch = (width * 3 + 31) / 32 * 32; // unicam alignment
+    unsigned outPitch = width * 4;
+
+    vector<unsigned char> in((size_t)inPitch * height);
+    vector<unsigned char> reference((size_t)outPitch * height);
+    vector<unsigned char> out((size_t)outPitch * height);
+    for (size_t i = 0; i < in.size(); i++)
+    {
+        in[i] = (unsigned char)(i * 7 + i / 4096);
+    }
+    printf("%ux%u, %u frames, one core\n", width, height, frames);
+
+    // Each kernel against the scalar result, then timed after a warm-up frame
+    vector<tstRgbKernel> kernels = RgbKernels();
+    for (const tstRgbKernel& kernel : kernels)
+    {
+        vector<unsigned char>& target = &kernel == &kernels[0] ? reference : out;
+        for (unsigned y = 0; y < height; y++)
+        {
+            kernel.Line(&in[(size_t)y * inPitch], &target[(size_t)y * outPitch], width);
+        }
+        if (target != reference)
+        {
+            printf("%s differs from the scalar kernel\n", kernel.Name);
+            return 1;
+        }
+        uint64_t start = MonotonicNs();
+        for (unsigned frame = 0; frame < frames; frame++)
+        {
+            for (unsigned y = 0; y < height; y++)
+            {
+                kernel.Line(&in[(size_t)y * inPitch], &target[(size_t)y * outPitch], width);
+            }
+        }
+        Report(kernel.Name, width, height, frames, MonotonicNs() - start);
+    }
+
+    uint64_t start = MonotonicNs();
+    for (unsigned frame = 0; frame < frames; frame++)
+    {
+        ConvertRgb24ToBgr32(in.data(), inPitch, out.data(), outPitch, width, 0, height);
+    }
+    Report("frame", width, height, frames, MonotonicNs() - start);
+
+    // Full software ISP path: memfd source, DMA heap or udmabuf target, with the DMA_BUF syncs
+    int memFd = memfd_create("softispbench", MFD_CLOEXEC);
+    if (memFd < 0 || ftruncate(memFd, in.size()) != 0 || pwrite(memFd, in.data(), in.size(), 0) != (ssize_t)in.size())
+    {
+        printf("memfd: %s\n", strerror(errno));
+        return 1;
+    }
+    SSoftIsp isp;
+    vector<int> dmaFd;
+    isp.SetFormat(width, height, inPitch);
+    if (!isp.AddSource(memFd, in.size()) || isp.AllocTargets(1, dmaFd) != 1)
+    {
+        printf("Software ISP buffers unavailable, dmabuf run skipped\n");
+    }
+    else
+    {
+        start = MonotonicNs();
+        for (unsigned frame = 0; frame < frames; frame++)
+        {
+            isp.QueueSource(0);
+            isp.QueueTarget(0);
+            isp.Process();
+            isp.DequeueSource();
+            isp.DequeueTarget();
+        }
+        Report("softisp", width, height, frames, MonotonicNs() - start);
+        close(dmaFd[0]);
+    }
+    isp.Destroy();
+    close(memFd);
+
+    // Workers pinned to cores 0 .. n - 1, the main thread only waits
+    double single = 0;
+    for (unsigned n = 1; n <= thread::hardware_concurrency(); n++)
+    {
+        vector<unsigned> cores;
+        for (unsigned core = 0; core < n; core++)
+        {
+            cores.push_back(core);
+        }
+        SThreadPool pool;
+        pool.Start(cores);
+        SSoftIsp::ConvertFrame(pool, in.data(), inPitch, out.data(), outPitch, width, height);
+        if (out != reference)
+        {
+            printf("Row bands on %u cores differ from the scalar kernel\n", n);
+            return 1;
+        }
+        start = MonotonicNs();
+        for (unsigned frame = 0; frame < frames; frame++)
+        {
+            SSoftIsp::ConvertFrame(pool, in.data(), inPitch, out.data(), outPitch, width, height);
+        }
+        uint64_t ns = MonotonicNs() - start;
+        pool.Stop();
+        single = n == 1 ? (double)ns : single;
+        printf("%u cores    %7.3f ms/frame %7.2f GB/s %5.2fx\n", n, ns / 1e6 / frames, 7.0 * width * height * frames / ns, single / ns);
+    }
+    return 0;
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <atomic>
+
+// Lock-free ring for exactly one producer thread and one consumer thread.
+// Capacity must be a power of two, one slot is never used.
+template <typename T, unsigned Capacity>
+class SSpscRing
+{
+public:
+    SSpscRing() : Head(0), Tail(0)
+    {
+        static_assert((Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+    }
+
+    // Producer thread only. False if the ring is full.
+    bool Push(const T& item)
+    {
+        unsigned head = Head.load(std::memory_order_relaxed);
+        unsigned next = (head + 1) & (Capacity - 1);
+        if (next == Tail.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        Items[head] = item;
+        Head.store(next, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer thread only. False if the ring is empty.
+    bool Pop(T& item)
+    {
+        unsigned tail = Tail.load(std::memory_order_relaxed);
+        if (tail == Head.load(std::memory_order_acquire))
+        {
+            return false;
+        }
+        item = Items[tail];
+        Tail.store((tail + 1) & (Capacity - 1), std::memory_order_release);
+        return true;
+    }
+
+    // Consumer thread only
+    bool Empty() const
+    {
+        return Tail.load(std::memory_order_relaxed) == Head.load(std::memory_order_acquire);
+    }
+
+private:
+    T Items[Capacity];
+    alignas(64) std::atomic<unsigned> Head; // Written by the producer
+    alignas(64) std::atomic<unsigned> Tail; // Written by the consumer
+};
@@ -0,0 +1,181 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#include "latency.h"
+#include "startupprofile.h"
+
+using namespace std;
+
+struct tstPhase
+{
+    string Name;
+    unsigned Thread; // Kernel tid, as in top and perf
+    uint64_t Begin; // ns since Origin
+    uint64_t End; // Equals Begin for a milestone
+    bool Milestone;
+};
+
+static const uint64_t Origin = MonotonicNs(); // Static initialization, before main()
+static mutex Lock;
+static vector<tstPhase> Phases;
+static atomic<bool> Recording(true);
+
+static unsigned ThreadId()
+{
+    return (unsigned)syscall(SYS_gettid);
+}
+
+static void Record(const string& name, uint64_t begin, uint64_t end, bool milestone)
+{
+    lock_guard<mutex> lock(Lock);
+    if (Recording)
+    {
+        Phases.push_back({ name, ThreadId(), begin - Origin, end - Origin, milestone });
+    }
+}
+
+// starttime of /proc/self/stat, field 22 in clock ticks since boot
+static double ProcessStartMs()
+{
+    FILE* file = fopen("/proc/self/stat", "r");
+    if (file == nullptr)
+    {
+        return 0;
+    }
+    char line[1024];
+    size_t length = fread(line, 1, sizeof(line) - 1, file);
+    fclose(file);
+    line[length] = '\0';
+    const char* field = strrchr(line, ')'); // The command name may contain spaces
+    unsigned long long ticks = 0;
+    for (int i = 2; field != nullptr && i < 22; i++)
+    {
+        field = strchr(field + 1, ' ');
+    }
+    if (field == nullptr || sscanf(field, " %llu", &ticks) != 1)
+    {
+        return 0;
+    }
+    return ticks * 1000.0 / sysconf(_SC_CLK_TCK);
+}
+
+static string JsonEscape(const string& text)
+{
+    string escaped;
+    for (char c : text)
+    {
+        if (c == '"' || c == '\\')
+        {
+            escaped += '\\';
+        }
+        escaped += c;
+    }
+    return escaped;
+}
+
+SStartupPhase::SStartupPhase(const string& name) :
+    Name(),
+    Begin(0)
+{
+    if (Recording)
+    {
+        Name = name;
+        Begin = MonotonicNs();
+    }
+}
+
+SStartupPhase::~SStartupPhase()
+{
+    if (Begin != 0)
+    {
+        Record(Name, Begin, MonotonicNs(), false);
+    }
+}
+
+void SStartupPhase::Next(const string& name)
+{
+    uint64_t now = MonotonicNs();
+    if (Begin != 0)
+    {
+        Record(Name, Begin, now, false);
+    }
+    Name.clear();
+    Begin = 0;
+    if (Recording)
+    {
+        Name = name;
+        Begin = now;
+    }
+}
+
+void StartupMark(const string& milestone)
+{
+    uint64_t now = MonotonicNs();
+    printf("Startup %5u ms: %s\n", (unsigned)((now - Origin) / 1000000), milestone.c_str());
+    Record(milestone, now, now, true);
+}
+
+void EndStartupProfile()
+{
+    Recording = false;
+}
+
+bool WriteStartupProfile(const string& path)
+{
+    lock_guard<mutex> lock(Lock);
+    double originMs = Origin / 1e6;
+    double processStartMs = ProcessStartMs();
+    unsigned pid = getpid();
+
+    string jsonName = path + ".json";
+    FILE* json = fopen(jsonName.c_str(), "w");
+    if (json == nullptr)
+    {
+        printf("Startup profile %s: %s\n", jsonName.c_str(), strerror(errno));
+        return false;
+    }
+    fprintf(json, "{\"traceEvents\":[\n");
+    for (size_t i = 0; i < Phases.size(); i++)
+    {
+        const tstPhase& phase = Phases[i];
+        if (phase.Milestone)
+        {
+            fprintf(json, "{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"g\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f}",
+                JsonEscape(phase.Name).c_str(), pid, phase.Thread, phase.Begin / 1e3);
+        }
+        else
+        {
+            fprintf(json, "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                JsonEscape(phase.Name).c_str(), pid, phase.Thread, phase.Begin / 1e3, (phase.End - phase.Begin) / 1e3);
+        }
+        fprintf(json, i + 1 < Phases.size() ? ",\n" : "\n");
+    }
+    fprintf(json, "],\n\"displayTimeUnit\":\"ms\",\n\"otherData\":{\"originMonotonicMs\":%.3f,\"processStartSinceBootMs\":%.3f}}\n",
+        originMs, processStartMs);
+    bool result = fclose(json) == 0;
+
+    string csvName = path + ".csv";
+    FILE* csv = fopen(csvName.c_str(), "w");
+    if (csv == nullptr)
+    {
+        printf("Startup profile %s: %s\n", csvName.c_str(), strerror(errno));
+        return false;
+    }
+    fprintf(csv, "# origin CLOCK_MONOTONIC %.3f ms, process start %.3f ms since boot\n", originMs, processStartMs);
+    fprintf(csv, "phase,thread,begin_ms,end_ms,duration_ms\n");
+    for (const tstPhase& phase : Phases)
+    {
+        // Names are ours, quoted in case one gets a comma
+        fprintf(csv, "\"%s\",%u,%.3f,%.3f,%.3f\n", phase.Name.c_str(), phase.Thread, phase.Begin / 1e6, phase.End / 1e6,
+            (phase.End - phase.Begin) / 1e6);
+    }
+    result &= fclose(csv) == 0;
+    printf("Startup profile: %zu phases written to %s and %s\n", Phases.size(), jsonName.c_str(), csvName.c_str());
+    return result;
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+// Cold start broken down into phases. An SStartupPhase records its name, thread and begin/end from
+// construction to destruction or Next(), StartupMark() an instant milestone. Recording ends with
+// EndStartupProfile() once the first frame is on screen, later reallocations stay out of it.
+// Times are relative to the load of the binary, the file also holds that instant on
+// CLOCK_MONOTONIC and the exec time since boot for boot-to-picture. Any thread.
+class SStartupPhase
+{
+public:
+    SStartupPhase(const std::string& name);
+    ~SStartupPhase();
+    void Next(const std::string& name); // Ends this phase and begins the following one of the same scope
+
+private:
+    std::string Name;
+    uint64_t Begin; // 0 if not recording
+};
+
+void StartupMark(const std::string& milestone); // Also printed with the ms since start
+void EndStartupProfile();
+// <path>.json in the Chrome trace event format (chrome://tracing, Perfetto), <path>.csv one row per phase
+bool WriteStartupProfile(const std::string& path);
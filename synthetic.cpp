@@ -0,0 +1,328 @@
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <linux/udmabuf.h>
+#include <linux/videodev2.h>
+#include <random>
+
+#include "latency.h"
+#include "startupprofile.h"
+#include "synthetic.h"
+
+using namespace std;
+
+static const unsigned ScrollPixels = 8; // Per frame, even for UYVY pairs
+
+SSyntheticSource::SSyntheticSource(unsigned width, unsigned height, unsigned fps, unsigned jitterUs) :
+    Name("synthetic"),
+    Fps(fps != 0 ? fps : 60),
+    JitterUs(jitterUs),
+    Format({ width & ~1u, height, 0, false, true, false }),
+    EventFd(-1),
+    UdmabufFd(-1),
+    Buffers(),
+    Pattern(),
+    Dropped(0),
+    QueueLock(),
+    Queued(),
+    Done(),
+    Run(false),
+    Generator()
+{
+}
+
+bool SSyntheticSource::Open()
+{
+    EventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (EventFd < 0)
+    {
+        printf("eventfd: %s\n", strerror(errno));
+        return false;
+    }
+    UdmabufFd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+    if (UdmabufFd < 0)
+    {
+        printf("/dev/udmabuf: %s, buffers are plain memfds (GPU conversion upload only)\n", strerror(errno));
+    }
+    printf("Synthetic capture %ux%u@%u Hz, jitter +-%u us\n", Format.Width, Format.Height, Fps, JitterUs);
+    return true;
+}
+
+void SSyntheticSource::Close()
+{
+    StreamOff();
+    FreeBuffers();
+    if (UdmabufFd >= 0)
+    {
+        close(UdmabufFd);
+    }
+    if (EventFd >= 0)
+    {
+        close(EventFd);
+    }
+    UdmabufFd = -1;
+    EventFd = -1;
+}
+
+const string& SSyntheticSource::GetName() const
+{
+    return Name;
+}
+
+int SSyntheticSource::GetFd() const
+{
+    return EventFd;
+}
+
+bool SSyntheticSource::SubscribeSourceChange()
+{
+    return true; // Fixed timings
+}
+
+vector<uint32_t> SSyntheticSource::GetFormats()
+{
+    return { V4L2_PIX_FMT_RGB24, V4L2_PIX_FMT_UYVY };
+}
+
+// The configured size wins over the requested one, like the DV timings of a real source
+bool SSyntheticSource::SetupTimings(tstFormat& format)
+{
+    format.Width = Format.Width;
+    format.Height = Format.Height;
+    return true;
+}
+
+bool SSyntheticSource::SetupFormat(tstFormat& format)
+{
+    Format.Uyvy = format.Uyvy;
+    Format.BytesPerLine = (Format.Width * (Format.Uyvy ? 2 : 3) + 63) & ~63u; // GPU friendly pitch
+    format = Format;
+    BuildPattern();
+    printf("Synthetic capture (final): width = %u, height = %u, 4cc = %s, stride = %u\n",
+        Format.Width, Format.Height, Format.Uyvy ? "UYVY" : "RGB3", Format.BytesPerLine);
+    return true;
+}
+
+unsigned SSyntheticSource::AllocBuffers(unsigned count, vector<int>& dmaFd, vector<unsigned>& length)
+{
+    SStartupPhase phase("Synthetic buffers");
+    unsigned page = sysconf(_SC_PAGESIZE);
+    unsigned size = (Format.BytesPerLine * Format.Height + page - 1) / page * page;
+    count = count < MaxBuffers ? count : MaxBuffers;
+    for (unsigned i = 0; i < count; i++)
+    {
+        tstBuffer buffer = { -1, nullptr, size, 0 };
+        buffer.MemFd = memfd_create("synthetic", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+        if (buffer.MemFd < 0 || ftruncate(buffer.MemFd, size) != 0)
+        {
+            printf("memfd %u bytes: %s\n", size, strerror(errno));
+            if (buffer.MemFd >= 0)
+            {
+                close(buffer.MemFd); // Not in Buffers yet, FreeBuffers() misses it
+            }
+            return 0;
+        }
+        buffer.Map = (unsigned char*)mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, buffer.MemFd, 0);
+        Buffers.push_back(buffer);
+        if (buffer.Map == MAP_FAILED)
+        {
+            Buffers.back().Map = nullptr;
+            printf("mmap: %s\n", strerror(errno));
+            return 0;
+        }
+        Fill(Buffers.back(), 0);
+
+        int fd;
+        if (UdmabufFd >= 0)
+        {
+            // udmabuf requires the memfd to be sealed against shrinking
+            fcntl(buffer.MemFd, F_ADD_SEALS, F_SEAL_SHRINK);
+            struct udmabuf_create create;
+            memset(&create, 0, sizeof(create));
+            create.memfd = buffer.MemFd;
+            create.flags = UDMABUF_FLAGS_CLOEXEC;
+            create.offset = 0;
+            create.size = size;
+            fd = ioctl(UdmabufFd, UDMABUF_CREATE, &create);
+        }
+        else
+        {
+            fd = fcntl(buffer.MemFd, F_DUPFD_CLOEXEC, 0);
+        }
+        if (fd < 0)
+        {
+            printf("UDMABUF_CREATE: %s\n", strerror(errno));
+            return 0;
+        }
+        printf("Synthetic DMA fd %d for buffer index %u\n", fd, i);
+        dmaFd.push_back(fd);
+        length.push_back(size);
+    }
+    return count;
+}
+
+void SSyntheticSource::FreeBuffers()
+{
+    for (const tstBuffer& buffer : Buffers)
+    {
+        if (buffer.Map != nullptr)
+        {
+            munmap(buffer.Map, buffer.Length);
+        }
+        close(buffer.MemFd);
+    }
+    Buffers.clear();
+}
+
+bool SSyntheticSource::StreamOn()
+{
+    if (!Generator.joinable())
+    {
+        Dropped = 0;
+        Run = true;
+        Generator = thread(&SSyntheticSource::GeneratorLoop, this);
+    }
+    return true;
+}
+
+bool SSyntheticSource::StreamOff()
+{
+    if (Generator.joinable())
+    {
+        Run = false;
+        Generator.join();
+        printf("Synthetic capture: %u frames dropped without a queued buffer\n", Dropped);
+    }
+    // Queued and completed buffers return to the caller
+    lock_guard<mutex> lock(QueueLock);
+    Queued.clear();
+    Done.clear();
+    return true;
+}
+
+void SSyntheticSource::Queue(unsigned index)
+{
+    lock_guard<mutex> lock(QueueLock);
+    Queued.push_back(index);
+}
+
+int SSyntheticSource::Dequeue(uint64_t& timestamp)
+{
+    uint64_t count;
+    if (read(EventFd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+        printf("eventfd read: %s\n", strerror(errno));
+    }
+    lock_guard<mutex> lock(QueueLock);
+    if (Done.empty())
+    {
+        return -1;
+    }
+    int index = Done.front();
+    Done.pop_front();
+    timestamp = Buffers[index].Timestamp;
+    return index;
+}
+
+bool SSyntheticSource::SourceChanged()
+{
+    return false;
+}
+
+// Frame start times on a fixed grid plus uniform jitter, late frames do not shift the grid
+void SSyntheticSource::GeneratorLoop()
+{
+    minstd_rand random(1); // Same jitter sequence every run
+    uniform_int_distribution<int> jitter(-(int)JitterUs, (int)JitterUs);
+    uint64_t period = 1000000000ull / Fps;
+    uint64_t next = MonotonicNs() + period;
+    unsigned frame = 0;
+    while (Run)
+    {
+        uint64_t due = next + (int64_t)jitter(random) * 1000;
+        struct timespec ts = { (time_t)(due / 1000000000ull), (long)(due % 1000000000ull) };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+        {
+        }
+        next += period;
+        frame++;
+        int index = -1;
+        {
+            lock_guard<mutex> lock(QueueLock);
+            if (!Queued.empty())
+            {
+                index = Queued.front();
+                Queued.pop_front();
+            }
+        }
+        if (index < 0)
+        {
+            Dropped++;
+            continue;
+        }
+        Buffers[index].Timestamp = MonotonicNs(); // Frame start, like unicam
+        Fill(Buffers[index], frame);
+        {
+            lock_guard<mutex> lock(QueueLock);
+            Done.push_back(index);
+        }
+        uint64_t wake = 1;
+        if (write(EventFd, &wake, sizeof(wake)) < 0)
+        {
+            printf("eventfd write: %s\n", strerror(errno));
+        }
+    }
+}
+
+// Full frame write like the capture DMA, every line copied from the scrolled pattern
+void SSyntheticSource::Fill(tstBuffer& buffer, unsigned frame)
+{
+    unsigned bytesPerPixel = Format.Uyvy ? 2 : 3;
+    unsigned offset = (frame * ScrollPixels) % Format.Width * bytesPerPixel;
+    unsigned lineBytes = Format.Width * bytesPerPixel;
+    for (unsigned y = 0; y < Format.Height; y++)
+    {
+        memcpy(buffer.Map + y * Format.BytesPerLine, Pattern.data() + offset, lineBytes);
+    }
+}
+
+// 100 % colour bars, RGB24 in the B, G, R byte order of the tc358743, UYVY as limited range BT.709
+void SSyntheticSource::BuildPattern()
+{
+    static const unsigned char bars[8][3] =
+    {
+        { 255, 255, 255 }, { 255, 255, 0 }, { 0, 255, 255 }, { 0, 255, 0 },
+        { 255, 0, 255 }, { 255, 0, 0 }, { 0, 0, 255 }, { 0, 0, 0 }
+    };
+    unsigned width = Format.Width;
+    Pattern.resize(2 * width * (Format.Uyvy ? 2 : 3));
+    unsigned char* p = Pattern.data();
+    for (unsigned x = 0; x < 2 * width; x += 2)
+    {
+        const unsigned char* c = bars[(x % width) * 8 / width];
+        if (Format.Uyvy)
+        {
+            float y = 0.2126f * c[0] + 0.7152f * c[1] + 0.0722f * c[2];
+            unsigned char luma = (unsigned char)(16.5f + y * 219.0f / 255.0f);
+            *p++ = (unsigned char)(128.5f + (c[2] - y) / 1.8556f * 224.0f / 255.0f); // U
+            *p++ = luma;
+            *p++ = (unsigned char)(128.5f + (c[0] - y) / 1.5748f * 224.0f / 255.0f); // V
+            *p++ = luma;
+        }
+        else
+        {
+            for (int i = 0; i < 2; i++)
+            {
+                *p++ = c[2];
+                *p++ = c[1];
+                *p++ = c[0];
+            }
+        }
+    }
+}
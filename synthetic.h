@@ -0,0 +1,63 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "capture.h"
+
+// In-process frame generator standing in for an HDMI bridge: memfd backed buffers exported as
+// dmabufs through udmabuf, filled with scrolling colour bars at a fixed rate with random jitter.
+// Lets the ISP, EGL import and render stages be load tested on any Linux box.
+class SSyntheticSource : public SCaptureSource
+{
+public:
+    SSyntheticSource(unsigned width, unsigned height, unsigned fps, unsigned jitterUs);
+    bool Open() override;
+    void Close() override;
+    const std::string& GetName() const override;
+    int GetFd() const override;
+    bool SubscribeSourceChange() override;
+    std::vector<uint32_t> GetFormats() override;
+    bool SetupTimings(tstFormat& format) override;
+    bool SetupFormat(tstFormat& format) override;
+    unsigned AllocBuffers(unsigned count, std::vector<int>& dmaFd, std::vector<unsigned>& length) override;
+    void FreeBuffers() override;
+    bool StreamOn() override;
+    bool StreamOff() override;
+    void Queue(unsigned index) override;
+    int Dequeue(uint64_t& timestamp) override;
+    bool SourceChanged() override;
+
+private:
+    static const unsigned MaxBuffers = 32; // VIDEO_MAX_FRAME
+
+    struct tstBuffer
+    {
+        int MemFd;
+        unsigned char* Map;
+        unsigned Length; // Page aligned
+        uint64_t Timestamp; // Written by the generator before the index is handed back
+    };
+
+    void GeneratorLoop();
+    void Fill(tstBuffer& buffer, unsigned frame);
+    void BuildPattern();
+
+    const std::string Name;
+    const unsigned Fps;
+    const unsigned JitterUs;
+    tstFormat Format;
+    int EventFd; // Signals completed frames
+    int UdmabufFd; // /dev/udmabuf, -1 falls back to plain memfd (mmap importers only)
+    std::vector<tstBuffer> Buffers;
+    std::vector<unsigned char> Pattern; // Two lines of colour bars, a line is copied from a scrolling offset
+    unsigned Dropped; // Frames without a queued buffer, generator thread only
+    std::mutex QueueLock; // Once per frame, uncontended
+    std::deque<int> Queued; // Pipeline -> generator
+    std::deque<int> Done; // Generator -> pipeline
+    std::atomic<bool> Run;
+    std::thread Generator;
+};
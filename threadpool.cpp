@@ -0,0 +1,148 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "threadpool.h"
+
+using namespace std;
+
+SThreadPool::SThreadPool() :
+    Workers(),
+    Lock(),
+    Wake(),
+    Done(),
+    Task(nullptr),
+    Generation(0),
+    Remaining(0),
+    Run(false)
+{
+}
+
+void SThreadPool::Start(const vector<unsigned>& cores)
+{
+    Stop();
+    Run = true;
+    for (unsigned i = 0; i < cores.size(); i++)
+    {
+        Workers.emplace_back(new tstWorker());
+    }
+    // All deques exist before the first worker can steal
+    for (unsigned i = 0; i < cores.size(); i++)
+    {
+        Workers[i]->Thread = thread(&SThreadPool::WorkerLoop, this, i, cores[i]);
+    }
+}
+
+void SThreadPool::Stop()
+{
+    {
+        lock_guard<mutex> lock(Lock);
+        Run = false;
+    }
+    Wake.notify_all();
+    for (unique_ptr<tstWorker>& worker : Workers)
+    {
+        worker->Thread.join();
+    }
+    Workers.clear();
+}
+
+unsigned SThreadPool::GetWorkers() const
+{
+    return Workers.size();
+}
+
+// Contiguous ranges per worker keep neighbouring bands on one core until stealing starts
+void SThreadPool::ParallelFor(unsigned count, const function<void(unsigned)>& task)
+{
+    if (Workers.empty())
+    {
+        for (unsigned i = 0; i < count; i++)
+        {
+            task(i);
+        }
+        return;
+    }
+
+    unique_lock<mutex> lock(Lock);
+    Task = &task;
+    Remaining = count;
+    unsigned workers = Workers.size();
+    for (unsigned w = 0; w < workers; w++)
+    {
+        lock_guard<mutex> workerLock(Workers[w]->Lock);
+        for (unsigned i = w * count / workers; i < (w + 1) * count / workers; i++)
+        {
+            Workers[w]->Tasks.push_back(i);
+        }
+    }
+    Generation++;
+    Wake.notify_all();
+    Done.wait(lock, [this] { return Remaining == 0; });
+}
+
+// Own tasks first, then one from the back of the next worker that has some
+bool SThreadPool::RunOne(unsigned self)
+{
+    unsigned workers = Workers.size();
+    for (unsigned k = 0; k < workers; k++)
+    {
+        tstWorker& victim = *Workers[(self + k) % workers];
+        unsigned index;
+        {
+            lock_guard<mutex> lock(victim.Lock);
+            if (victim.Tasks.empty())
+            {
+                continue;
+            }
+            if (k == 0)
+            {
+                index = victim.Tasks.front();
+                victim.Tasks.pop_front();
+            }
+            else
+            {
+                index = victim.Tasks.back();
+                victim.Tasks.pop_back();
+            }
+        }
+        (*Task)(index);
+        if (Remaining.fetch_sub(1) == 1)
+        {
+            lock_guard<mutex> lock(Lock);
+            Done.notify_all();
+        }
+        return true;
+    }
+    return false;
+}
+
+void SThreadPool::WorkerLoop(unsigned self, unsigned core)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(core, &set);
+    int retVal = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (retVal != 0)
+    {
+        printf("Worker %u on core %u: %s\n", self, core, strerror(retVal));
+    }
+
+    unsigned seen = 0;
+    while (true)
+    {
+        {
+            unique_lock<mutex> lock(Lock);
+            Wake.wait(lock, [&] { return !Run || Generation != seen; });
+            if (!Run)
+            {
+                return;
+            }
+            seen = Generation;
+        }
+        while (RunOne(self))
+        {
+        }
+    }
+}
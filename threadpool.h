@@ -0,0 +1,45 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent workers for data parallel loops. Each worker owns a deque of task indices, takes from
+// its front and steals from the back of the others when it runs dry, so bands slowed down by page
+// faults or preemption are balanced without a shared queue.
+class SThreadPool
+{
+public:
+    SThreadPool();
+    void Start(const std::vector<unsigned>& cores); // One worker pinned to each core
+    void Stop();
+    unsigned GetWorkers() const;
+    // Runs task(0) .. task(count - 1) and returns when all have finished. Without workers the calling
+    // thread runs them, otherwise it only waits.
+    void ParallelFor(unsigned count, const std::function<void(unsigned)>& task);
+
+private:
+    struct tstWorker
+    {
+        std::mutex Lock; // Owner pops the front, thieves the back, both short
+        std::deque<unsigned> Tasks;
+        std::thread Thread;
+    };
+
+    void WorkerLoop(unsigned self, unsigned core);
+    bool RunOne(unsigned self);
+
+    std::vector<std::unique_ptr<tstWorker>> Workers;
+    std::mutex Lock;
+    std::condition_variable Wake; // New loop or stop
+    std::condition_variable Done; // Last task of a loop finished
+    const std::function<void(unsigned)>* Task; // Of the current loop
+    unsigned Generation; // Loops started
+    std::atomic<unsigned> Remaining; // Tasks of the current loop not finished
+    bool Run;
+};
@@ -1,288 +1,927 @@
 #include <string.h>
+#include <errno.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <linux/videodev2.h>
 #include <libdrm/drm_fourcc.h>
 #include <chrono>
 
+#include "startupprofile.h"
 #include "video.h"
 
 #define CLEAR(x) memset(&(x), 0, sizeof(x))
 
 using namespace std;
 
-unsigned CreateSourceImage(int dmaFd, int width, int height, int fourcc);
-void SelectTexture(unsigned index);
+unsigned CreateSourceImage(int dmaFd, int width, int height, int fourcc, int pitch, bool bt709, bool fullRange);
+void DeleteSourceImage(unsigned index);
+bool SelectTexture(unsigned index); // false if the buffer could not be shown
+unsigned CreateConvertSource(int dmaFd, unsigned length, int width, int height, int pitch, bool uyvy, bool bt709, bool fullRange);
+void DeleteConvertSource(unsigned index);
+void ConvertTexture(unsigned index);
+void* InsertFence();
+bool IsFenceSignaled(void* fence);
+void DeleteFence(void* fence);
 
-static const char* DriverName = "unicam";
+// ISP capture needs one buffer for the GPU, one waiting for the fence of its last draw and one in the ISP
+static const unsigned MinDmaBuffers = 3;
 
-SVideo::SVideo() :
-    V4lFd(-1),
+// Render thread core while the software ISP is active, its workers are pinned to the other cores
+static const unsigned RenderCore = 0;
+
+// Startup profile phase names, by EQueueName
+static const char* QueueNames[] = { "V4L capture", "ISP output", "ISP capture" };
+
+SVideo::SVideo(unsigned dmaBuffers, EPresentMode presentMode, ECaptureMode captureMode) :
+    Source(new SUnicamSource("/dev/video0")),
     IspFd(-1),
+    IspCaps(),
+    SoftIspActive(false),
+    SoftIsp(),
+    EpollFd(-1),
+    WakeFd(-1),
+    ReadyFd(-1),
     SourceWidth(1280),
     SourceHeight(720),
-    DmaBuffers(1),
+    DmaBuffers(dmaBuffers < MinDmaBuffers ? MinDmaBuffers : dmaBuffers > MaxDmaBuffers ? MaxDmaBuffers : dmaBuffers),
+    PresentMode(presentMode),
+    CaptureMode(captureMode),
+    FormatChain(nullptr),
+    ChainCaps(),
+    DisplayFormats(),
+    DisplayFormatsSet(false),
+    V4lBytesPerLine(0),
+    TargetWidth(0),
+    TargetHeight(0),
+    IspWidth(0),
+    IspHeight(0),
+    IspBytesPerLine(0),
+    YuvBt709(true),
+    YuvFullRange(false),
     IspOutputBufferSize(0),
     QueueDesc({
-        { -1, V4L2_BUF_TYPE_VIDEO_CAPTURE, V4L2_MEMORY_MMAP }, // eQN_V4lCapture
-        { -1, V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, V4L2_MEMORY_DMABUF }, // eQN_IspOutput
-        { -1, V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, V4L2_MEMORY_MMAP }} ), // eQN_IspCapture
-    V4lName("/dev/video0"),
+        { V4L2_BUF_TYPE_VIDEO_CAPTURE, V4L2_MEMORY_MMAP }, // eQN_V4lCapture
+        { V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, V4L2_MEMORY_DMABUF }, // eQN_IspOutput
+        { V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, V4L2_MEMORY_MMAP }} ), // eQN_IspCapture
     IspName("/dev/video12"),
     V4lDmaFd(),
+    V4lLength(),
     IspDmaFd(),
-    Texture()
+    Texture(),
+    V4lTimes(),
+    IspInFlight(),
+    PresentTimes(),
+    GpuTimes(),
+    Latency(),
+    GpuIndex(-1),
+    GpuSelected(false),
+    Fence(MaxDmaBuffers, nullptr),
+    Retired(),
+    ReadyFrames(),
+    ReleasedFrames(),
+    SourceChanged(false),
+    TargetResized(false),
+    PipelineRun(false),
+    PipelineThread()
+{
+}
+
+// Before Create() or Probe(), replaces the default unicam capture
+void SVideo::SetCaptureSource(SCaptureSource* source)
+{
+    Source.reset(source);
+}
+
+void SVideo::SetFormatChain(const SFormatChain* formatChain, const SFormatChain::tstCaps& display)
+{
+    FormatChain = formatChain;
+    ChainCaps = display;
+}
+
+void SVideo::SetDisplayFormats(const std::vector<uint32_t>& formats)
 {
+    DisplayFormats = formats;
+    DisplayFormatsSet = true;
 }
 
+// Probe() and Start() in sequence on the render thread
 bool SVideo::Create()
+{
+    return Probe() && Start();
+}
+
+// Any thread, no GL context needed, so it can overlap the context creation and shader compilation.
+// Opens the devices, negotiates the DV timings and formats, allocates the buffers and queues them.
+// The ISP capture is sized for the target size set before, Start() follows a later SetTargetSize().
+bool SVideo::Probe()
 {
     bool result = true;
 
-    V4lFd = open(V4lName.c_str(), O_RDWR);
-    IspFd = open(IspName.c_str(), O_RDWR);
+    SStartupPhase phase("Open " + Source->GetName());
+    bool sourceOpen = Source->Open();
+    if (UseIsp() || FormatChain != nullptr)
+    {
+        phase.Next("Open " + IspName);
+        IspFd = open(IspName.c_str(), O_RDWR | O_NONBLOCK);
+        if (IspFd < 0)
+        {
+            printf("Could not open %s: %s\n", IspName.c_str(), strerror(errno));
+        }
+        else
+        {
+            result &= IspCaps.Open(IspFd);
+        }
+    }
+    // Chains are priced at the size the source sends
+    if (sourceOpen)
+    {
+        result &= SetupSourceTimings();
+    }
+    if (sourceOpen && FormatChain != nullptr)
+    {
+        phase.Next("Negotiate format chain");
+        result &= NegotiateChain(); // The ISP stays open, Start() or a source change may switch to it
+    }
+    SoftIspActive = UseIsp() && IspFd < 0;
+    if (SoftIspActive)
+    {
+        printf("Converting on the CPU instead of %s\n", IspName.c_str()); // Workers start with the render thread in Start()
+    }
 
-    if (V4lFd >= 0 && IspFd >= 0)
+    phase.Next("Negotiate formats and buffers");
+    if (sourceOpen)
     {
-        result &= SetupV4lCaptureFormat();
-        result &= SetupIspOutputFormat();
-        result &= SetupIspCaptureFormat();
-        result &= SetupV4lCaptureQueue();
-        result &= SetupIspOutputQueue();
-        result &= SetupIspCaptureQueue();
+        result &= SetupEpoll();
+        result &= Source->SubscribeSourceChange();
+        result &= SetupFormatsAndQueues();
+    }
+    else
+    {
+        printf("Could not open %s\n", Source->GetName().c_str());
+        Destroy();
+    }
+    return result && sourceOpen;
+}
 
-        int type;
-        int retVal;
+// Render thread, after a successful Probe(). Joins the probed queues with the GL context: creates the
+// EGL images of the presented buffers, starts streaming and the pipeline thread.
+bool SVideo::Start()
+{
+    bool result = true;
 
-        // Start video capture
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        retVal = ioctl(V4lFd, VIDIOC_STREAMON, &type);
-        if (retVal != 0)
+    if (FormatChain != nullptr && DisplayFormatsSet)
+    {
+        // Probe() priced the display with the formats set before it, confirmed against the real ones
+        ChainCaps.Display = DisplayFormats;
+        ECaptureMode mode = ChooseChain();
+        if (mode != CaptureMode)
         {
-            result = false;
-            printf("VIDIOC_STREAMON: %s\n", strerror(retVal));
+            result &= SwitchChain(mode);
         }
+    }
+    if (SoftIspActive)
+    {
+        StartSoftIsp();
+    }
 
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-        retVal = ioctl(IspFd, VIDIOC_STREAMON, &type);
-        if (retVal != 0)
-        {
-            result = false;
-            printf("VIDIOC_STREAMON: %s\n", strerror(retVal));
-        }
+    unsigned ispWidth;
+    unsigned ispHeight;
+    IspCaptureSize(ispWidth, ispHeight);
+    if (UseIsp() && (ispWidth != IspWidth || ispHeight != IspHeight))
+    {
+        // Target size changed during the probe, the queue is not streaming yet
+        FreeQueue(eQN_IspCapture);
+        result &= SetupIspCaptureFormat();
+        result &= SetupIspCaptureQueue();
+    }
+    result &= CreateImages();
+    result &= StreamOnAll();
 
-        type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-        retVal = ioctl(IspFd, VIDIOC_STREAMON, &type);
-        if (retVal != 0)
+    if (result)
+    {
+        StartPipeline();
+    }
+    return result;
+}
+
+// Render thread. Probe() may run on another thread, so the render thread is pinned here, before the
+// workers, and no worker shares its core. The pipeline thread started later inherits the core, it only
+// moves buffers.
+void SVideo::StartSoftIsp()
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(RenderCore, &set);
+    int retVal = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (retVal != 0)
+    {
+        printf("Render thread on core %u: %s\n", RenderCore, strerror(retVal));
+    }
+    std::vector<unsigned> cores;
+    for (unsigned core = 0; core < thread::hardware_concurrency(); core++)
+    {
+        if (core != RenderCore)
         {
-            result = false;
-            printf("VIDIOC_STREAMON: %s\n", strerror(retVal));
+            cores.push_back(core);
         }
     }
-    else
+    SoftIsp.StartWorkers(cores);
+}
+
+// Capture, then the ISP queues, in the order the frames pass them
+bool SVideo::StreamOnAll()
+{
+    bool result = StreamOn(eQN_V4lCapture);
+    if (UseIsp())
     {
-        if (V4lFd < 0)
+        result &= StreamOn(eQN_IspCapture);
+        result &= StreamOn(eQN_IspOutput);
+    }
+    return result;
+}
+
+// Render thread. EGL image, or compute shader source, per presented buffer.
+bool SVideo::CreateImages()
+{
+    SStartupPhase phase("CreateImages");
+    const std::vector<int>& dmaFd = UseIsp() ? IspDmaFd : V4lDmaFd;
+    Texture.resize(dmaFd.size());
+    for (unsigned i = 0; i < dmaFd.size(); i++)
+    {
+        if (UseIsp())
         {
-            printf("Could not open %s\n", V4lName.c_str());
+            // Memory layout of the frame, the import fourcc and shader are negotiated from it
+            Texture[i] = CreateSourceImage(dmaFd[i], IspWidth, IspHeight, GetPresentFourcc(), IspBytesPerLine, false, true);
         }
-        if (IspFd < 0)
+        else if (CaptureMode == eCM_UyvyDirect)
         {
-            printf("Could not open %s\n", IspName.c_str());
+            // Sampled as YUV by the GPU, the hints select the matrix and range of the conversion
+            Texture[i] = CreateSourceImage(dmaFd[i], SourceWidth, SourceHeight, DRM_FORMAT_UYVY, V4lBytesPerLine, YuvBt709, YuvFullRange);
+        }
+        else
+        {
+            // Raw bytes, unpacked by the compute shader
+            Texture[i] = CreateConvertSource(dmaFd[i], V4lLength[i], SourceWidth, SourceHeight, V4lBytesPerLine, CaptureUyvy(), YuvBt709, YuvFullRange);
         }
-        Destroy();
     }
-    return result;
+    return true;
 }
 
 void SVideo::Destroy()
 {
+    StopPipeline();
+    DropFrames(); // Fences belong to the GL context of the render thread
+
     // Stop video capture
-    int retVal;
-    int type;
-    if (V4lFd >= 0)
+    if (Source->GetFd() >= 0)
     {
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-        retVal = ioctl(V4lFd, VIDIOC_STREAMOFF, &type);
-        if (retVal != 0)
-        {
-            printf("VIDIOC_STREAMON: %s\n", strerror(retVal));
-        }
-        close(V4lFd);
+        StreamOff(eQN_V4lCapture);
+        Source->Close();
     }
     if (IspFd >= 0)
     {
-        type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-        retVal = ioctl(IspFd, VIDIOC_STREAMOFF, &type);
-        if (retVal != 0)
+        if (UseIsp()) // Open for the negotiation otherwise
         {
-            printf("VIDIOC_STREAMON: %s\n", strerror(retVal));
+            StreamOff(eQN_IspCapture);
+            StreamOff(eQN_IspOutput);
         }
-        type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-        retVal = ioctl(IspFd, VIDIOC_STREAMOFF, &type);
-        if (retVal != 0)
+        IspCaps.Close();
+        close(IspFd);
+    }
+    if (SoftIspActive)
+    {
+        StreamOff(eQN_IspCapture);
+        StreamOff(eQN_IspOutput);
+        SoftIsp.Destroy();
+        SoftIspActive = false;
+    }
+    if (EpollFd >= 0)
+    {
+        close(EpollFd);
+    }
+    if (WakeFd >= 0)
+    {
+        close(WakeFd);
+    }
+    if (ReadyFd >= 0)
+    {
+        close(ReadyFd);
+    }
+    IspFd = -1;
+    EpollFd = -1;
+    WakeFd = -1;
+    ReadyFd = -1;
+}
+
+void SVideo::StartPipeline()
+{
+    PipelineRun = true;
+    PipelineThread = thread(&SVideo::PipelineLoop, this);
+}
+
+void SVideo::StopPipeline()
+{
+    if (PipelineThread.joinable())
+    {
+        PipelineRun = false;
+        uint64_t wake = 1;
+        if (write(WakeFd, &wake, sizeof(wake)) < 0)
         {
-            printf("VIDIOC_STREAMON: %s\n", strerror(retVal));
+            printf("eventfd write: %s\n", strerror(errno));
         }
-        close(IspFd);
+        PipelineThread.join();
     }
 }
 
-bool SVideo::SetupV4lCaptureFormat()
+// Readiness of the V4L capture device and of both ISP queues
+bool SVideo::SetupEpoll()
 {
     bool result = true;
-    int retVal;
 
-    ListFormats(V4lFd, "V4L2 capture", V4L2_BUF_TYPE_VIDEO_CAPTURE, "V4L2_BUF_TYPE_VIDEO_CAPTURE");
-
-    // Check the correct loaded driver. 
-    // "no dtoverlay" or "dtoverlay=tc358743"
-    // "bm2835 mmal" or "unicam"
-    // "mmal service 16.1" or "unicam"
-    struct v4l2_capability cap;
-    CLEAR(cap);
-    // video0
-    // 0x04000000 V4L2_CAP_STREAMING The device supports the streaming I/O method.
-    // 0x01000000 V4L2_CAP_READWRITE The device supports the read() and/or write() I/O methods.
-    // 0x00800000 V4L2_CAP_META_CAPTURE The device supports the Metadata Interface capture interface.
-    // 0x00200000 V4L2_CAP_EXT_PIX_FORMAT The device supports the struct v4l2_pix_format extended fields.
-    // 0x00000001 V4L2_CAP_VIDEO_CAPTURE The device supports the single-planar API through the Video Capture interface.
-    retVal = ioctl(V4lFd, VIDIOC_QUERYCAP, &cap);
-    if (retVal != 0)
+    EpollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (EpollFd < 0)
+    {
+        printf("epoll_create1: %s\n", strerror(errno));
+        return false;
+    }
+
+    struct epoll_event ev;
+    CLEAR(ev);
+    ev.events = EPOLLIN | EPOLLPRI; // Capture buffer done, V4L event pending
+    ev.data.fd = Source->GetFd();
+    if (epoll_ctl(EpollFd, EPOLL_CTL_ADD, Source->GetFd(), &ev) != 0)
     {
         result = false;
-        printf("VIDIOC_QUERYCAP: %s\n", strerror(retVal));
+        printf("epoll_ctl %s: %s\n", Source->GetName().c_str(), strerror(errno));
     }
-    if (strncmp((const char*)cap.driver, DriverName, strlen(DriverName)) != 0)
+
+    CLEAR(ev);
+    ev.events = EPOLLIN | EPOLLOUT; // ISP capture buffer done, ISP output buffer consumed
+    ev.data.fd = IspFd;
+    if (IspFd >= 0 && epoll_ctl(EpollFd, EPOLL_CTL_ADD, IspFd, &ev) != 0)
     {
         result = false;
-        printf("Wrong driver. Set dtoverlay=tc358743 in /boot/config.txt\n");
+        printf("epoll_ctl %s: %s\n", IspName.c_str(), strerror(errno));
     }
 
-    struct v4l2_dv_timings tmg;
-    CLEAR(tmg);
-    retVal = ioctl(V4lFd, VIDIOC_QUERY_DV_TIMINGS, &tmg);
-    if (retVal != 0)
+    WakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    CLEAR(ev);
+    ev.events = EPOLLIN;
+    ev.data.fd = WakeFd;
+    if (WakeFd < 0 || epoll_ctl(EpollFd, EPOLL_CTL_ADD, WakeFd, &ev) != 0)
+    {
+        result = false;
+        printf("eventfd: %s\n", strerror(errno));
+    }
+
+    ReadyFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ReadyFd < 0)
     {
         result = false;
-        printf("VIDIOC_QUERY_DV_TIMINGS: %s\n", strerror(retVal));
+        printf("eventfd: %s\n", strerror(errno));
+    }
+    return result;
+}
+
+SVideo::ECaptureMode SVideo::GetCaptureMode() const
+{
+    return CaptureMode;
+}
+
+unsigned SVideo::GetPresentFourcc() const
+{
+    switch (CaptureMode)
+    {
+    case eCM_Rgb24Isp:
+        // The tc358743 sends B, G, R as 'RGB3', so the ISP 'BGR4' holds R, G, B, A
+        return DRM_FORMAT_ABGR8888;
+    case eCM_UyvyIsp:
+        // Converted from YUV, 'BGR4' holds B, G, R, A as V4L2 documents it
+        return DRM_FORMAT_ARGB8888;
+    case eCM_UyvyDirect:
+        return DRM_FORMAT_UYVY;
+    default:
+        return 0;
+    }
+}
+
+// Source open with its timings set, IspFd open if there is an ISP. Adds the capture and ISP formats
+// to ChainCaps and replaces CaptureMode by the cheapest chain.
+bool SVideo::NegotiateChain()
+{
+    ChainCaps.Capture = Source->GetFormats();
+    if (IspFd >= 0)
+    {
+        ChainCaps.IspOutput = IspCaps.GetFormats(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, "ISP output");
+        ChainCaps.IspCapture = IspCaps.GetFormats(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, "ISP capture");
     }
     else
     {
-        unsigned fps = (unsigned)(tmg.bt.pixelclock / ((tmg.bt.width + tmg.bt.hsync) * (tmg.bt.height + tmg.bt.vsync)));
-        printf("HDMI input Width/Height: %u/%u@%uHz\n", tmg.bt.width, tmg.bt.height, fps);
-        retVal = ioctl(V4lFd, VIDIOC_S_DV_TIMINGS, &tmg);
-        if (retVal != 0)
+        // What SSoftIsp converts
+        ChainCaps.IspOutput = { V4L2_PIX_FMT_RGB24 };
+        ChainCaps.IspCapture = { V4L2_PIX_FMT_BGR32 };
+    }
+    CaptureMode = ChooseChain();
+    return true;
+}
+
+// Cheapest chain of ChainCaps at the source size, the current mode if there is none
+SVideo::ECaptureMode SVideo::ChooseChain() const
+{
+    SFormatChain::tstChain chain;
+    if (!FormatChain->Negotiate(ChainCaps, SourceWidth, SourceHeight, chain))
+    {
+        printf("Keeping capture mode %d\n", (int)CaptureMode);
+        return CaptureMode;
+    }
+    printf("Negotiated %ux%u: ", SourceWidth, SourceHeight);
+    SFormatChain::Print(chain);
+    bool uyvy = chain.Capture == V4L2_PIX_FMT_UYVY;
+    if (chain.IspCapture != 0)
+    {
+        return uyvy ? eCM_UyvyIsp : eCM_Rgb24Isp;
+    }
+    if (chain.GpuConvert)
+    {
+        return uyvy ? eCM_UyvyGpu : eCM_Rgb24Gpu;
+    }
+    return eCM_UyvyDirect;
+}
+
+// Render thread, pipeline stopped. Frees the buffers of the current chain, including images and
+// frames held for drawing, and sets up the formats and queues of the other one. Nothing streams after.
+bool SVideo::SwitchChain(ECaptureMode mode)
+{
+    printf("Capture mode %d -> %d\n", (int)CaptureMode, (int)mode);
+    StreamOff(eQN_V4lCapture);
+    if (UseIsp())
+    {
+        StreamOff(eQN_IspOutput);
+        StreamOff(eQN_IspCapture);
+    }
+    DropFrames();
+    FreeQueue(eQN_V4lCapture);
+    if (UseIsp())
+    {
+        FreeQueue(eQN_IspOutput);
+        FreeQueue(eQN_IspCapture);
+    }
+    CaptureMode = mode;
+    if (!SoftIspActive && UseIsp() && IspFd < 0)
+    {
+        printf("Converting on the CPU instead of %s\n", IspName.c_str()); // The caller starts the workers
+        SoftIspActive = true; // Stays set once the workers run, Destroy() stops them
+    }
+    return SetupFormatsAndQueues();
+}
+
+bool SVideo::UseIsp() const
+{
+    return CaptureMode == eCM_Rgb24Isp || CaptureMode == eCM_UyvyIsp;
+}
+
+bool SVideo::UseGpuConvert() const
+{
+    return CaptureMode == eCM_Rgb24Gpu || CaptureMode == eCM_UyvyGpu;
+}
+
+bool SVideo::CaptureUyvy() const
+{
+    return CaptureMode == eCM_UyvyIsp || CaptureMode == eCM_UyvyDirect || CaptureMode == eCM_UyvyGpu;
+}
+
+// Queue whose buffers are imported as EGL images and drawn
+SVideo::EQueueName SVideo::PresentQueue() const
+{
+    return UseIsp() ? eQN_IspCapture : eQN_V4lCapture;
+}
+
+bool SVideo::StreamOn(EQueueName queue)
+{
+    SStartupPhase phase(string("STREAMON ") + QueueNames[queue]);
+    if (queue == eQN_V4lCapture)
+    {
+        return Source->StreamOn();
+    }
+    if (SoftIspActive)
+    {
+        return true;
+    }
+    int type = QueueDesc[queue].Type;
+    int retVal = ioctl(IspFd, VIDIOC_STREAMON, &type);
+    if (retVal != 0)
+    {
+        printf("VIDIOC_STREAMON: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+// All buffers queued to the driver or ISP are returned to SVideo, buffers held by the GPU stay there
+bool SVideo::StreamOff(EQueueName queue)
+{
+    if (queue == eQN_V4lCapture)
+    {
+        if (!Source->StreamOff())
         {
-            result = false;
-            printf("VIDIOC_S_DV_TIMINGS: %s\n", strerror(retVal));
+            return false;
+        }
+    }
+    else if (SoftIspActive)
+    {
+        if (queue == eQN_IspOutput)
+        {
+            SoftIsp.FlushSources();
         }
         else
         {
-            SourceWidth = tmg.bt.width;
-            SourceHeight = tmg.bt.height;
+            SoftIsp.FlushTargets();
         }
     }
-
-    struct v4l2_format fmt;
-    CLEAR(fmt);
-    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    retVal = ioctl(V4lFd, VIDIOC_G_FMT, &fmt);
-    if (retVal != 0)
-    {
-        result = false;
-        printf("VIDIOC_G_FMT: %s\n", strerror(retVal));
-    }
     else
     {
-        fmt.fmt.pix.width = SourceWidth;
-        fmt.fmt.pix.height = SourceHeight;
-        // v4l2-ctl -d /dev/video0 --list-formats
-        // [0]: 'RGB3' (24-bit RGB 8-8-8)
-        fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB24; // v4l2_fourcc('R', 'G', 'B', '3') 24  RGB-8-8-8
-        fmt.fmt.pix.field = V4L2_FIELD_NONE;
-        retVal = ioctl(V4lFd, VIDIOC_S_FMT, &fmt);
+        int type = QueueDesc[queue].Type;
+        int retVal = ioctl(IspFd, VIDIOC_STREAMOFF, &type);
         if (retVal != 0)
         {
-            result = false;
-            printf("VIDIOC_S_FMT: %s\n", strerror(retVal));
+            printf("VIDIOC_STREAMOFF: %s\n", strerror(errno));
+            return false;
         }
-        else
+    }
+    if (queue == eQN_IspOutput || queue == eQN_IspCapture)
+    {
+        // Frames queued to the ISP or converted but not dequeued are dropped. Frames the ISP still
+        // converts after a resize have no entry left and are not recorded, rather than taking the
+        // stamps of older ones.
+        IspInFlight.clear();
+    }
+    std::vector<EBufferOwner>& owners = QueueDesc[queue].Owner;
+    for (unsigned i = 0; i < owners.size(); i++)
+    {
+        if (owners[i] == eBO_Driver || owners[i] == eBO_Isp)
         {
-            retVal = ioctl(V4lFd, VIDIOC_G_FMT, &fmt);
-            if (retVal != 0)
+            owners[i] = eBO_None;
+            if (queue == eQN_IspOutput)
             {
-                result = false;
-                printf("VIDIOC_G_FMT: %s\n", strerror(retVal));
+                SetOwner(eQN_V4lCapture, i, eBO_None); // Same index, the ISP read the capture buffer
+            }
+        }
+    }
+    return true;
+}
+
+// Release the buffers of a stopped queue so its format can be changed
+void SVideo::FreeQueue(EQueueName queue)
+{
+    const tstQueueDesc& qd = QueueDesc[queue];
+    if (queue == eQN_V4lCapture || queue == eQN_IspCapture)
+    {
+        std::vector<int>& dmaFd = queue == eQN_V4lCapture ? V4lDmaFd : IspDmaFd;
+        for (int fd : dmaFd)
+        {
+            close(fd);
+        }
+        dmaFd.clear();
+    }
+    if (queue == eQN_V4lCapture)
+    {
+        V4lLength.clear();
+    }
+    if (queue == PresentQueue())
+    {
+        for (unsigned texture : Texture)
+        {
+            if (UseGpuConvert())
+            {
+                DeleteConvertSource(texture);
             }
             else
             {
-                printf("V4L capture (final): width = %u, height = %u, 4cc = %.4s\n",
-                    fmt.fmt.pix.width, fmt.fmt.pix.height,
-                    (char*)&fmt.fmt.pix.pixelformat);
+                DeleteSourceImage(texture);
             }
         }
+        Texture.clear();
+    }
+
+    if (queue == eQN_V4lCapture)
+    {
+        Source->FreeBuffers();
+    }
+    else if (SoftIspActive)
+    {
+        if (queue == eQN_IspOutput)
+        {
+            SoftIsp.FreeSources();
+        }
+        else
+        {
+            SoftIsp.FreeTargets();
+        }
+    }
+    else
+    {
+        struct v4l2_requestbuffers req;
+        CLEAR(req);
+        req.type = qd.Type;
+        req.memory = qd.Memory;
+        req.count = 0;
+        int retVal = ioctl(IspFd, VIDIOC_REQBUFS, &req);
+        if (retVal != 0)
+        {
+            printf("VIDIOC_REQBUFS free: %s\n", strerror(errno));
+        }
     }
+    QueueDesc[queue].Owner.clear();
+}
+
+// Render thread, recreating the EGL images needs the GL context.
+// Stops the pipeline, renegotiates the DV timings and formats and resumes. Capture and ISP output
+// are always reallocated because the driver refuses new timings with buffers allocated, the ISP
+// capture buffers and their EGL images only if their size changed. A new size reprices the format
+// chain, a cheaper one replaces all queues.
+bool SVideo::HandleSourceChange()
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool result = true;
+    unsigned oldWidth = SourceWidth;
+    unsigned oldHeight = SourceHeight;
+
+    StopPipeline();
+    StreamOff(eQN_V4lCapture);
+    if (UseIsp())
+    {
+        StreamOff(eQN_IspOutput);
+        FreeQueue(eQN_IspOutput);
+    }
+    else
+    {
+        DropFrames(); // Capture buffers are drawn directly
+    }
+    FreeQueue(eQN_V4lCapture);
+
+    result &= SetupSourceTimings();
+    ECaptureMode mode = CaptureMode;
+    if (FormatChain != nullptr && (SourceWidth != oldWidth || SourceHeight != oldHeight))
+    {
+        mode = ChooseChain();
+    }
+    if (mode != CaptureMode)
+    {
+        bool softIsp = SoftIspActive;
+        result &= SwitchChain(mode);
+        result &= CreateImages();
+        result &= StreamOnAll();
+        if (SoftIspActive && !softIsp)
+        {
+            StartSoftIsp();
+        }
+    }
+    else
+    {
+        result &= SetupV4lCaptureFormat();
+        unsigned ispWidth;
+        unsigned ispHeight;
+        IspCaptureSize(ispWidth, ispHeight);
+        bool resized = ispWidth != IspWidth || ispHeight != IspHeight;
+        if (UseIsp() && resized)
+        {
+            StreamOff(eQN_IspCapture);
+            DropFrames();
+            FreeQueue(eQN_IspCapture);
+        }
+        if (UseIsp())
+        {
+            result &= SetupIspOutputFormat();
+        }
+        if (UseIsp() && resized)
+        {
+            result &= SetupIspCaptureFormat();
+        }
+        result &= SetupV4lCaptureQueue();
+        if (UseIsp())
+        {
+            result &= SetupIspOutputQueue();
+        }
+        if (UseIsp() && resized)
+        {
+            result &= SetupIspCaptureQueue();
+        }
+        if (!UseIsp() || resized)
+        {
+            result &= CreateImages();
+        }
+        if (UseIsp() && resized)
+        {
+            result &= StreamOn(eQN_IspCapture);
+        }
+        result &= StreamOn(eQN_V4lCapture);
+        if (UseIsp())
+        {
+            result &= StreamOn(eQN_IspOutput);
+        }
+    }
+
+    StartPipeline(); // Even on failure, to catch the next source change
+    unsigned ms = (unsigned)chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    printf("Source change %ux%u -> %ux%u %s in %u ms\n", oldWidth, oldHeight, SourceWidth, SourceHeight, result ? "done" : "failed", ms);
+    return result;
+}
+
+// Render thread. Only the ISP capture queue follows the framebuffer, capture and ISP output keep streaming.
+bool SVideo::HandleTargetResize()
+{
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    bool result = true;
+    unsigned oldWidth = IspWidth;
+    unsigned oldHeight = IspHeight;
+
+    StopPipeline();
+    StreamOff(eQN_IspCapture);
+    DropFrames();
+    FreeQueue(eQN_IspCapture);
+    result &= SetupIspCaptureFormat();
+    result &= SetupIspCaptureQueue();
+    result &= CreateImages();
+    result &= StreamOn(eQN_IspCapture);
+    StartPipeline();
+
+    unsigned ms = (unsigned)chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now() - start).count();
+    printf("ISP capture %ux%u -> %ux%u %s in %u ms\n", oldWidth, oldHeight, IspWidth, IspHeight, result ? "done" : "failed", ms);
+    return result;
+}
+
+// The ISP downscales to the framebuffer in the same pass, upscaling is left to the GPU.
+// The software ISP does not scale.
+void SVideo::IspCaptureSize(unsigned& width, unsigned& height) const
+{
+    if (SoftIspActive)
+    {
+        width = SourceWidth;
+        height = SourceHeight;
+        return;
+    }
+    width = TargetWidth != 0 && TargetWidth < SourceWidth ? TargetWidth : SourceWidth;
+    height = TargetHeight != 0 && TargetHeight < SourceHeight ? TargetHeight : SourceHeight;
+}
+
+// Render thread. Framebuffer size the ISP capture follows, 0 for the source size.
+// Before Start() it only sets the initial size, not while Probe() runs on another thread.
+void SVideo::SetTargetSize(unsigned width, unsigned height)
+{
+    TargetWidth = width;
+    TargetHeight = height;
+    unsigned ispWidth;
+    unsigned ispHeight;
+    IspCaptureSize(ispWidth, ispHeight);
+    if (UseIsp() && PipelineThread.joinable() && (ispWidth != IspWidth || ispHeight != IspHeight))
+    {
+        TargetResized = true;
+    }
+}
+
+// Pipeline stopped. Forget the completed frames of presented buffers about to be freed.
+void SVideo::DropFrames()
+{
+    int index;
+    while (ReadyFrames.Pop(index))
+    {
+    }
+    while (ReleasedFrames.Pop(index))
+    {
+    }
+    for (unsigned i = 0; i < Fence.size(); i++)
+    {
+        if (Fence[i] != nullptr)
+        {
+            DeleteFence(Fence[i]);
+            Fence[i] = nullptr;
+        }
+    }
+    Retired.clear();
+    GpuIndex = -1;
+    GpuSelected = false;
+}
+
+// Frame size the source sends, set before the chain is priced. Without buffers on the capture queue.
+bool SVideo::SetupSourceTimings()
+{
+    SStartupPhase phase("SetupSourceTimings");
+    SCaptureSource::tstFormat format = { SourceWidth, SourceHeight, 0, CaptureUyvy(), true, false };
+    bool result = Source->SetupTimings(format);
+    SourceWidth = format.Width;
+    SourceHeight = format.Height;
+    return result;
+}
+
+// Capture and ISP formats and buffers of the current chain, nothing streaming yet
+bool SVideo::SetupFormatsAndQueues()
+{
+    bool result = SetupV4lCaptureFormat();
+    if (UseIsp())
+    {
+        result &= SetupIspOutputFormat();
+        result &= SetupIspCaptureFormat();
+    }
+    result &= SetupV4lCaptureQueue();
+    if (UseIsp())
+    {
+        result &= SetupIspOutputQueue();
+        result &= SetupIspCaptureQueue();
+    }
+    return result;
+}
+
+// The source negotiates its pixel format at the size of its timings, the later stages follow it
+bool SVideo::SetupV4lCaptureFormat()
+{
+    SStartupPhase phase("SetupV4lCaptureFormat");
+    SCaptureSource::tstFormat format = { SourceWidth, SourceHeight, 0, CaptureUyvy(), true, false };
+    bool result = Source->SetupFormat(format);
+    SourceWidth = format.Width;
+    SourceHeight = format.Height;
+    V4lBytesPerLine = format.BytesPerLine;
+    YuvBt709 = format.Bt709;
+    YuvFullRange = format.FullRange;
     return result;
 }
 
 bool SVideo::SetupIspOutputFormat()
 {
+    SStartupPhase phase("SetupIspOutputFormat");
     bool result = true;
     int retVal;
 
-    ListFormats(IspFd, "ISP output", V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, "V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE");
+    if (SoftIspActive)
+    {
+        if (CaptureUyvy())
+        {
+            printf("The CPU ISP converts RGB24 only\n");
+            return false;
+        }
+        SoftIsp.SetFormat(SourceWidth, SourceHeight, V4lBytesPerLine);
+        return true;
+    }
 
-    struct v4l2_capability cap;
-    CLEAR(cap);
-    // video12
+    // video12, capabilities queried once in Probe()
     // 0x04000000 V4L2_CAP_STREAMING The device supports the streaming I / O method.
     // 0x00200000 V4L2_CAP_EXT_PIX_FORMAT The device supports the struct v4l2_pix_format extended fields.
     // 0x00004000 V4L2_CAP_VIDEO_M2M_MPLANE The device supports the multiplanar API through the Video Memory-To-Memory interface.
-    retVal = ioctl(IspFd, VIDIOC_QUERYCAP, &cap);
-    if (retVal != 0)
-    {
-        result = false;
-        printf("VIDIOC_QUERYCAP: %s\n", strerror(retVal));
-    }
+    IspCaps.GetFormats(V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE, "ISP output");
 
     struct v4l2_format fmt;
     CLEAR(fmt);
     fmt.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-    retVal = ioctl(IspFd, VIDIOC_G_FMT, &fmt);
+    // v4l2-ctl -d /dev/video12 --list-formats
+    // [31]: 'RGB3' (24-bit RGB 8-8-8)
+    // [ 6]: 'UYVY' (UYVY 4:2:2)
+    uint32_t pixelFormat = CaptureUyvy() ? V4L2_PIX_FMT_UYVY : V4L2_PIX_FMT_RGB24;
+    bool cached = IspCaps.FindFormat(fmt.type, SourceWidth, SourceHeight, pixelFormat, fmt);
+    retVal = cached ? 0 : ioctl(IspFd, VIDIOC_G_FMT, &fmt);
     if (retVal != 0)
     {
         result = false;
-        printf("VIDIOC_G_FMT: %s\n", strerror(retVal));
+        printf("VIDIOC_G_FMT: %s\n", strerror(errno));
     }
     else
     {
         fmt.fmt.pix.width = SourceWidth;
         fmt.fmt.pix.height = SourceHeight;
-        // v4l2-ctl -d /dev/video12 --list-formats
-        // [31]: 'RGB3' (24-bit RGB 8-8-8)
-        fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_RGB24; // v4l2_fourcc('B', 'G', 'R', '4') 32  BGR-8-8-8-8
+        fmt.fmt.pix.pixelformat = pixelFormat;
         fmt.fmt.pix.field = V4L2_FIELD_NONE;
         fmt.fmt.pix_mp.width = fmt.fmt.pix.width;
         fmt.fmt.pix_mp.height = fmt.fmt.pix.height;
         fmt.fmt.pix_mp.pixelformat = fmt.fmt.pix.pixelformat;
+        if (CaptureUyvy())
+        {
+            // The ISP converts with the matrix and range the source reported
+            fmt.fmt.pix_mp.colorspace = YuvBt709 ? V4L2_COLORSPACE_REC709 : V4L2_COLORSPACE_SMPTE170M;
+            fmt.fmt.pix_mp.ycbcr_enc = YuvBt709 ? V4L2_YCBCR_ENC_709 : V4L2_YCBCR_ENC_601;
+            fmt.fmt.pix_mp.quantization = YuvFullRange ? V4L2_QUANTIZATION_FULL_RANGE : V4L2_QUANTIZATION_LIM_RANGE;
+        }
+        struct v4l2_format request = fmt;
         retVal = ioctl(IspFd, VIDIOC_S_FMT, &fmt);
         if (retVal != 0)
         {
             result = false;
-            printf("VIDIOC_S_FMT: %s\n", strerror(retVal));
+            printf("VIDIOC_S_FMT: %s\n", strerror(errno));
         }
         else
         {
-            retVal = ioctl(IspFd, VIDIOC_G_FMT, &fmt);
+            retVal = cached ? 0 : ioctl(IspFd, VIDIOC_G_FMT, &fmt); // S_FMT already returns the format set
             if (retVal != 0)
             {
                 result = false;
-                printf("VIDIOC_G_FMT: %s\n", strerror(retVal));
+                printf("VIDIOC_G_FMT: %s\n", strerror(errno));
             }
             else
             {
+                IspCaps.StoreFormat(SourceWidth, SourceHeight, pixelFormat, request, fmt);
                 printf("ISP output (final): width = %u, height = %u, 4cc = %.4s\n",
                     fmt.fmt.pix.width, fmt.fmt.pix.height,
                     (char*)&fmt.fmt.pix.pixelformat);
@@ -295,63 +934,67 @@ bool SVideo::SetupIspOutputFormat()
 
 bool SVideo::SetupIspCaptureFormat()
 {
+    SStartupPhase phase("SetupIspCaptureFormat");
     bool result = true;
     int retVal;
 
-    ListFormats(IspFd, "ISP capture", V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, "V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE");
-
-    struct v4l2_capability cap;
-    CLEAR(cap);
-    // video12
-    // 0x04000000 V4L2_CAP_STREAMING The device supports the streaming I / O method.
-    // 0x00200000 V4L2_CAP_EXT_PIX_FORMAT The device supports the struct v4l2_pix_format extended fields.
-    // 0x00004000 V4L2_CAP_VIDEO_M2M_MPLANE The device supports the multiplanar API through the Video Memory-To-Memory interface.
-    retVal = ioctl(IspFd, VIDIOC_QUERYCAP, &cap);
-    if (retVal != 0)
+    if (SoftIspActive)
     {
-        result = false;
-        printf("VIDIOC_QUERYCAP: %s\n", strerror(retVal));
+        IspCaptureSize(IspWidth, IspHeight);
+        IspBytesPerLine = SoftIsp.GetBytesPerLine();
+        return true;
     }
 
+    IspCaps.GetFormats(V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, "ISP capture");
+
+    unsigned width;
+    unsigned height;
+    IspCaptureSize(width, height);
     struct v4l2_format fmt;
     CLEAR(fmt);
     fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
-    retVal = ioctl(IspFd, VIDIOC_G_FMT, &fmt);
+    // v4l2-ctl -d /dev/video12 --list-formats
+    // [8]: 'BGR4' (32-bit BGRA/X 8-8-8-8)
+    bool cached = IspCaps.FindFormat(fmt.type, width, height, V4L2_PIX_FMT_BGR32, fmt);
+    retVal = cached ? 0 : ioctl(IspFd, VIDIOC_G_FMT, &fmt);
     if (retVal != 0)
     {
         result = false;
-        printf("VIDIOC_G_FMT: %s\n", strerror(retVal));
+        printf("VIDIOC_G_FMT: %s\n", strerror(errno));
     }
     else
     {
-        fmt.fmt.pix.width = SourceWidth;
-        fmt.fmt.pix.height = SourceHeight;
-        // v4l2-ctl -d /dev/video12 --list-formats
-        // [8]: 'BGR4' (32-bit BGRA/X 8-8-8-8)
+        fmt.fmt.pix.width = width;
+        fmt.fmt.pix.height = height;
         fmt.fmt.pix.pixelformat = V4L2_PIX_FMT_BGR32; // v4l2_fourcc('B', 'G', 'R', '4') 32  BGR-8-8-8-8
         fmt.fmt.pix.field = V4L2_FIELD_NONE;
         fmt.fmt.pix_mp.width = fmt.fmt.pix.width;
         fmt.fmt.pix_mp.height = fmt.fmt.pix.height;
         fmt.fmt.pix_mp.pixelformat = fmt.fmt.pix.pixelformat;
+        struct v4l2_format request = fmt;
         retVal = ioctl(IspFd, VIDIOC_S_FMT, &fmt);
         if (retVal != 0)
         {
             result = false;
-            printf("VIDIOC_S_FMT: %s\n", strerror(retVal));
+            printf("VIDIOC_S_FMT: %s\n", strerror(errno));
         }
         else
         {
-            retVal = ioctl(IspFd, VIDIOC_G_FMT, &fmt);
+            retVal = cached ? 0 : ioctl(IspFd, VIDIOC_G_FMT, &fmt); // S_FMT already returns the format set
             if (retVal != 0)
             {
                 result = false;
-                printf("VIDIOC_G_FMT: %s\n", strerror(retVal));
+                printf("VIDIOC_G_FMT: %s\n", strerror(errno));
             }
             else
             {
-                printf("ISP capture (final): width = %u, height = %u, 4cc = %.4s\n",
-                    fmt.fmt.pix.width, fmt.fmt.pix.height,
-                    (char*)&fmt.fmt.pix.pixelformat);
+                IspCaps.StoreFormat(width, height, V4L2_PIX_FMT_BGR32, request, fmt);
+                printf("ISP capture (final): width = %u, height = %u, 4cc = %.4s, stride = %u\n",
+                    fmt.fmt.pix_mp.width, fmt.fmt.pix_mp.height,
+                    (char*)&fmt.fmt.pix_mp.pixelformat, fmt.fmt.pix_mp.plane_fmt[0].bytesperline);
+                IspWidth = fmt.fmt.pix_mp.width;
+                IspHeight = fmt.fmt.pix_mp.height;
+                IspBytesPerLine = fmt.fmt.pix_mp.plane_fmt[0].bytesperline; // Aligned for scaled widths
             }
         }
     }
@@ -361,54 +1004,29 @@ bool SVideo::SetupIspCaptureFormat()
 
 bool SVideo::SetupV4lCaptureQueue()
 {
+    SStartupPhase phase("SetupV4lCaptureQueue");
     bool result = true;
-    int retVal;
-    const tstQueueDesc& qd = QueueDesc[eQN_V4lCapture];
 
-    // Export
-    struct v4l2_requestbuffers req;
-    CLEAR(req);
-    req.type = qd.Type;
-    req.memory = qd.Memory;
-    req.count = DmaBuffers;
-    retVal = ioctl(V4lFd, VIDIOC_REQBUFS, &req);
-    if (retVal != 0)
+    unsigned count = Source->AllocBuffers(DmaBuffers, V4lDmaFd, V4lLength);
+    if (count == 0)
     {
-        result = false;
-        printf("VIDIOC_REQBUFS: %s\n", strerror(retVal));
+        return false;
     }
-    printf("VIDIOC_REQBUFS export: num %d, %s, %s\n", req.count, req.type == V4L2_BUF_TYPE_VIDEO_CAPTURE ? "V4L2_BUF_TYPE_VIDEO_CAPTURE" : "type error", req.memory == V4L2_MEMORY_MMAP ? "V4L2_MEMORY_MMAP" : "memory error");
-    DmaBuffers = req.count;
-
-    Texture.resize(req.count);
-    for (unsigned i = 0; i < req.count; i++)
+    DmaBuffers = count; // ISP output imports the same buffers
+    if (!UseIsp() && count < MinDmaBuffers)
     {
-        struct v4l2_buffer buf;
-        CLEAR(buf);
-        buf.index = i;
-        buf.type = qd.Type;
-        buf.memory = qd.Memory;
-        retVal = ioctl(V4lFd, VIDIOC_QUERYBUF, &buf); // length
-        if (retVal != 0)
-        {
-            result = false;
-            printf("VIDIOC_QUERYBUF: %s\n", strerror(retVal));
-        }
-
-        struct v4l2_exportbuffer expbuf;
-        CLEAR(expbuf);
-        expbuf.type = qd.Type;
-        expbuf.index = i;
-        retVal = ioctl(V4lFd, VIDIOC_EXPBUF, &expbuf);
-        if (retVal != 0)
-        {
-            result = false;
-            printf("VIDIOC_EXPBUF: %s\n", strerror(retVal));
-        }
-        printf("VIDIOC_EXPBUF DMA fd %d for buffer index %d\n", expbuf.fd, i);
-
-        V4lDmaFd.push_back(expbuf.fd);
+        result = false;
+        printf("Direct capture needs at least %u buffers\n", MinDmaBuffers);
+    }
 
+    QueueDesc[eQN_V4lCapture].Owner.assign(count, eBO_None);
+    V4lTimes.assign(count, tstFrameTimes());
+    if (!UseIsp())
+    {
+        PresentTimes.assign(count, tstFrameTimes());
+    }
+    for (unsigned i = 0; i < count; i++)
+    {
         EnQueueV4lCapture(i);
     }
     return result;
@@ -416,11 +1034,24 @@ bool SVideo::SetupV4lCaptureQueue()
 
 bool SVideo::SetupIspOutputQueue()
 {
+    SStartupPhase phase("SetupIspOutputQueue");
     bool result = true;
     int retVal;
     const tstQueueDesc& qd = QueueDesc[eQN_IspOutput];
 
+    if (SoftIspActive)
+    {
+        // Mapped for reading, same indices as the capture queue
+        for (int fd : V4lDmaFd)
+        {
+            result &= SoftIsp.AddSource(fd, V4lBytesPerLine * SourceHeight);
+        }
+        QueueDesc[eQN_IspOutput].Owner.assign(V4lDmaFd.size(), eBO_None);
+        return result;
+    }
+
     // Import
+    SStartupPhase ioctlPhase(string("REQBUFS ") + QueueNames[eQN_IspOutput]);
     struct v4l2_requestbuffers req;
     CLEAR(req);
     req.type = qd.Type;
@@ -430,11 +1061,19 @@ bool SVideo::SetupIspOutputQueue()
     if (retVal != 0)
     {
         result = false;
-        printf("VIDIOC_REQBUFS: %s\n", strerror(retVal));
+        printf("VIDIOC_REQBUFS: %s\n", strerror(errno));
     }
     printf("VIDIOC_REQBUFS import: num %d, %s, %s\n", req.count, req.type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE ? "V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE" : "type error", req.memory == V4L2_MEMORY_DMABUF ? "V4L2_MEMORY_DMABUF" : "memory error");
+    if (req.count != DmaBuffers)
+    {
+        result = false;
+        printf("ISP output buffers %u do not match V4L capture buffers %u\n", req.count, DmaBuffers);
+    }
 
-    for (unsigned i = 0; i < req.count; i++)
+    QueueDesc[eQN_IspOutput].Owner.assign(req.count, eBO_None);
+
+    IspOutputBufferSize = IspCaps.GetBufferLength(qd.Type);
+    for (unsigned i = 0; i < req.count && IspOutputBufferSize == 0; i++)
     {
         struct v4l2_buffer buf;
         struct v4l2_plane planes[VIDEO_MAX_PLANES];
@@ -449,20 +1088,40 @@ bool SVideo::SetupIspOutputQueue()
         if (retVal != 0)
         {
             result = false;
-            printf("VIDIOC_QUERYBUF: %s\n", strerror(retVal));
+            printf("VIDIOC_QUERYBUF: %s\n", strerror(errno));
         }
         IspOutputBufferSize = buf.m.planes[0].length;
+        IspCaps.StoreBufferLength(qd.Type, IspOutputBufferSize);
     }
     return result;
 }
 
 bool SVideo::SetupIspCaptureQueue()
 {
+    SStartupPhase phase("SetupIspCaptureQueue");
     bool result = true;
     int retVal;
     const tstQueueDesc& qd = QueueDesc[eQN_IspCapture];
 
+    if (SoftIspActive)
+    {
+        unsigned count = SoftIsp.AllocTargets(DmaBuffers, IspDmaFd);
+        if (count < MinDmaBuffers)
+        {
+            result = false;
+            printf("Software ISP needs at least %u buffers\n", MinDmaBuffers);
+        }
+        QueueDesc[eQN_IspCapture].Owner.assign(count, eBO_None);
+        PresentTimes.assign(count, tstFrameTimes());
+        for (unsigned i = 0; i < count; i++)
+        {
+            EnQueueIspCapture(i);
+        }
+        return result;
+    }
+
     // Export
+    SStartupPhase ioctlPhase(string("REQBUFS ") + QueueNames[eQN_IspCapture]);
     struct v4l2_requestbuffers req;
     CLEAR(req);
     req.type = qd.Type;
@@ -472,13 +1131,21 @@ bool SVideo::SetupIspCaptureQueue()
     if (retVal != 0)
     {
         result = false;
-        printf("VIDIOC_REQBUFS: %s\n", strerror(retVal));
+        printf("VIDIOC_REQBUFS: %s\n", strerror(errno));
     }
     printf("VIDIOC_REQBUFS export: num %d, %s, %s\n", req.count, req.type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE ? "V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE" : "type error", req.memory == V4L2_MEMORY_MMAP ? "V4L2_MEMORY_MMAP" : "memory error");
 
-    Texture.resize(req.count);
+    if (req.count < MinDmaBuffers)
+    {
+        result = false;
+        printf("ISP capture needs at least %u buffers\n", MinDmaBuffers);
+    }
+
+    QueueDesc[eQN_IspCapture].Owner.assign(req.count, eBO_None);
+    PresentTimes.assign(req.count, tstFrameTimes());
     for (unsigned i = 0; i < req.count; i++)
     {
+        ioctlPhase.Next(string("EXPBUF ") + QueueNames[eQN_IspCapture] + " #" + to_string(i));
         struct v4l2_buffer buf;
         struct v4l2_plane planes[VIDEO_MAX_PLANES];
 
@@ -488,11 +1155,18 @@ bool SVideo::SetupIspCaptureQueue()
         buf.memory = qd.Memory;
         buf.length = VIDEO_MAX_PLANES;
         buf.m.planes = planes;
-        retVal = ioctl(IspFd, VIDIOC_QUERYBUF, &buf); // length
-        if (retVal != 0)
+        if (IspCaps.GetBufferLength(qd.Type) == 0)
         {
-            result = false;
-            printf("VIDIOC_QUERYBUF: %s\n", strerror(retVal));
+            retVal = ioctl(IspFd, VIDIOC_QUERYBUF, &buf); // length
+            if (retVal != 0)
+            {
+                result = false;
+                printf("VIDIOC_QUERYBUF: %s\n", strerror(errno));
+            }
+            else
+            {
+                IspCaps.StoreBufferLength(qd.Type, buf.m.planes[0].length);
+            }
         }
 
         struct v4l2_exportbuffer expbuf;
@@ -503,211 +1177,509 @@ bool SVideo::SetupIspCaptureQueue()
         if (retVal != 0)
         {
             result = false;
-            printf("VIDIOC_EXPBUF: %s\n", strerror(retVal));
+            printf("VIDIOC_EXPBUF: %s\n", strerror(errno));
         }
         printf("VIDIOC_EXPBUF DMA fd %d for buffer index %d\n", expbuf.fd, i);
 
         IspDmaFd.push_back(expbuf.fd);
-
-        // Supported 32 bit formats: 
-        // DRM_FORMAT_XRGB8888 ('X', 'R', '2', '4'), DRM_FORMAT_XBGR8888 ('X', 'B', '2', '4'), DRM_FORMAT_ARGB8888 ('A', 'R', '2', '4'), DRM_FORMAT_ABGR8888 ('A', 'B', '2', '4')
-        Texture[i] = CreateSourceImage(expbuf.fd, SourceWidth, SourceHeight, DRM_FORMAT_ARGB8888); // A channel needed for R
-
         EnQueueIspCapture(i);
     }
     return result;
 }
 
-void SVideo::ListFormats(int fd, string devStr, unsigned int type, string typeStr)
-{
-    int retVal;
-    struct v4l2_fmtdesc fmt;
-    int i = 0;
-    do {
-        CLEAR(fmt);
-        fmt.index = i++;
-        fmt.type = type;
-        retVal = ioctl(fd, VIDIOC_ENUM_FMT, &fmt);
-        if (retVal == 0)
-        {
-            printf("%s: [%u] %.4s\n", devStr.c_str(), fmt.index, (char*)&fmt.pixelformat);
-        }
-    } while (retVal == 0);
-}
-
 // Put buffer into V4L queue
 void SVideo::EnQueueV4lCapture(int index)
 {
-    const tstQueueDesc& qd = QueueDesc[eQN_V4lCapture];
-    struct v4l2_buffer buf;
-    CLEAR(buf);
-    buf.type = qd.Type;
-    buf.memory = qd.Memory;
-    buf.index = index;
-    int retVal = ioctl(V4lFd, VIDIOC_QBUF, &buf); // bytesused and length
-    if (retVal != 0)
-    {
-        printf("VIDIOC_QBUF: %s\n", strerror(retVal));
-    }
+    Source->Queue(index);
+    SetOwner(eQN_V4lCapture, index, eBO_Driver);
 }
 
 // Get buffer from V4L queue
 int SVideo::DeQueueV4lCapture()
 {
-    const tstQueueDesc& qd = QueueDesc[eQN_V4lCapture];
-    struct v4l2_buffer buf;
-    CLEAR(buf);
-    buf.type = qd.Type;
-    buf.memory = qd.Memory;
-    int retVal = ioctl(V4lFd, VIDIOC_DQBUF, &buf);
-    if (retVal != 0)
+    uint64_t timestamp;
+    int index = Source->Dequeue(timestamp);
+    if (index < 0)
+    {
+        return -1; // Nothing ready
+    }
+    SetOwner(eQN_V4lCapture, index, eBO_None);
+    if ((unsigned)index < V4lTimes.size())
     {
-        printf("VIDIOC_DQBUF: %s\n", strerror(retVal));
+        V4lTimes[index] = tstFrameTimes();
+        V4lTimes[index].Capture = timestamp;
     }
-    return buf.index;
+    return index;
 }
 
 // Put buffer into ISP output queue
 void SVideo::EnQueueIspOutput(int index)
 {
-    const tstQueueDesc& qd = QueueDesc[eQN_IspOutput];
-    struct v4l2_plane planes[VIDEO_MAX_PLANES];
-    CLEAR(planes);
-    struct v4l2_buffer buf;
-    CLEAR(buf);
-    buf.type = qd.Type;
-    buf.memory = qd.Memory;
-    buf.index = index;
-    buf.length = 1; // Only one plane used
-    buf.m.planes = planes; // Shorten to used planes
-    for (int k = 0; k < VIDEO_MAX_PLANES; k++) // loop can be shortended to buf.length
-    {
-        buf.m.planes[k].m.fd = V4lDmaFd[index];
-        buf.m.planes[k].bytesused = IspOutputBufferSize;
-        buf.m.planes[k].length = IspOutputBufferSize;
-    }
-    int retVal = ioctl(IspFd, VIDIOC_QBUF, &buf);
-    if (retVal != 0)
+    if (SoftIspActive)
+    {
+        SoftIsp.QueueSource(index);
+    }
+    else
+    {
+        const tstQueueDesc& qd = QueueDesc[eQN_IspOutput];
+        struct v4l2_plane planes[VIDEO_MAX_PLANES];
+        CLEAR(planes);
+        struct v4l2_buffer buf;
+        CLEAR(buf);
+        buf.type = qd.Type;
+        buf.memory = qd.Memory;
+        buf.index = index;
+        buf.length = 1; // Only one plane used
+        buf.m.planes = planes; // Shorten to used planes
+        for (int k = 0; k < VIDEO_MAX_PLANES; k++) // loop can be shortended to buf.length
+        {
+            buf.m.planes[k].m.fd = V4lDmaFd[index];
+            buf.m.planes[k].bytesused = IspOutputBufferSize;
+            buf.m.planes[k].length = IspOutputBufferSize;
+        }
+        int retVal = ioctl(IspFd, VIDIOC_QBUF, &buf);
+        if (retVal != 0)
+        {
+            printf("VIDIOC_QBUF: %s\n", strerror(errno));
+        }
+    }
+    SetOwner(eQN_IspOutput, index, eBO_Isp);
+    if ((unsigned)index < V4lTimes.size())
     {
-        printf("VIDIOC_QBUF: %s\n", strerror(retVal));
+        // The ISP converts in order, the capture side dequeues the frames in the same order
+        V4lTimes[index].IspEnqueue = MonotonicNs();
+        IspInFlight.push_back(V4lTimes[index]);
     }
+    SetOwner(eQN_V4lCapture, index, eBO_Isp); // Same index, the ISP reads the capture buffer
 }
 
 // Get buffer from ISP output queue
 int SVideo::DeQueueIspOutput()
 {
-    const tstQueueDesc& qd = QueueDesc[eQN_IspOutput];
-    struct v4l2_plane planes[VIDEO_MAX_PLANES];
-    CLEAR(planes);
-    struct v4l2_buffer buf;
-    CLEAR(buf);
-    buf.type = qd.Type;
-    buf.memory = qd.Memory;
-    buf.length = VIDEO_MAX_PLANES;
-    CLEAR(planes);
-    buf.m.planes = planes;
-    int retVal = ioctl(IspFd, VIDIOC_DQBUF, &buf);
-    if (retVal != 0)
+    int index;
+    if (SoftIspActive)
+    {
+        index = SoftIsp.DequeueSource();
+    }
+    else
+    {
+        const tstQueueDesc& qd = QueueDesc[eQN_IspOutput];
+        struct v4l2_plane planes[VIDEO_MAX_PLANES];
+        CLEAR(planes);
+        struct v4l2_buffer buf;
+        CLEAR(buf);
+        buf.type = qd.Type;
+        buf.memory = qd.Memory;
+        buf.length = VIDEO_MAX_PLANES;
+        CLEAR(planes);
+        buf.m.planes = planes;
+        int retVal = ioctl(IspFd, VIDIOC_DQBUF, &buf);
+        if (retVal != 0 && errno != EAGAIN)
+        {
+            printf("VIDIOC_DQBUF: %s\n", strerror(errno));
+        }
+        index = retVal == 0 ? buf.index : -1;
+    }
+    if (index < 0)
     {
-        printf("VIDIOC_DQBUF: %s\n", strerror(retVal));
+        return -1; // Nothing ready
     }
-    return buf.index;
+    SetOwner(eQN_IspOutput, index, eBO_None);
+    return index;
 }
 
 // Put buffer into ISP capture queue
 void SVideo::EnQueueIspCapture(int index)
 {
-    const tstQueueDesc& qd = QueueDesc[eQN_IspCapture];
-    struct v4l2_plane planes[VIDEO_MAX_PLANES];
-    CLEAR(planes);
-    struct v4l2_buffer buf;
-    CLEAR(buf);
-    buf.type = qd.Type;
-    buf.memory = qd.Memory;
-    buf.index = index;
-    buf.length = VIDEO_MAX_PLANES;
-    buf.m.planes = planes;
-    for (int k = 0; k < VIDEO_MAX_PLANES; k++)
-    {
-        buf.m.planes[k].m.fd = V4lDmaFd[index];
-    }
-    int retVal = ioctl(IspFd, VIDIOC_QBUF, &buf); // bytesused and length
-    if (retVal != 0)
+    if (SoftIspActive)
+    {
+        SoftIsp.QueueTarget(index);
+    }
+    else
     {
-        printf("VIDIOC_QBUF: %s\n", strerror(retVal));
+        const tstQueueDesc& qd = QueueDesc[eQN_IspCapture];
+        struct v4l2_plane planes[VIDEO_MAX_PLANES];
+        CLEAR(planes);
+        struct v4l2_buffer buf;
+        CLEAR(buf);
+        buf.type = qd.Type;
+        buf.memory = qd.Memory;
+        buf.index = index;
+        buf.length = VIDEO_MAX_PLANES;
+        buf.m.planes = planes; // MMAP, the driver owns the memory
+        int retVal = ioctl(IspFd, VIDIOC_QBUF, &buf); // bytesused and length
+        if (retVal != 0)
+        {
+            printf("VIDIOC_QBUF: %s\n", strerror(errno));
+        }
     }
+    SetOwner(eQN_IspCapture, index, eBO_Isp);
 }
 
 // Get buffer from ISP capture queue
 int SVideo::DeQueueIspCapture()
 {
-    const tstQueueDesc& qd = QueueDesc[eQN_IspCapture];
-    struct v4l2_plane planes[VIDEO_MAX_PLANES];
-    CLEAR(planes);
-    struct v4l2_buffer buf;
-    CLEAR(buf);
-    buf.type = qd.Type;
-    buf.memory = qd.Memory;
-    buf.length = VIDEO_MAX_PLANES;
-    CLEAR(planes);
-    buf.m.planes = planes;
-    int retVal = ioctl(IspFd, VIDIOC_DQBUF, &buf);
-    if (retVal != 0)
+    int index;
+    if (SoftIspActive)
+    {
+        index = SoftIsp.DequeueTarget();
+    }
+    else
+    {
+        const tstQueueDesc& qd = QueueDesc[eQN_IspCapture];
+        struct v4l2_plane planes[VIDEO_MAX_PLANES];
+        CLEAR(planes);
+        struct v4l2_buffer buf;
+        CLEAR(buf);
+        buf.type = qd.Type;
+        buf.memory = qd.Memory;
+        buf.length = VIDEO_MAX_PLANES;
+        CLEAR(planes);
+        buf.m.planes = planes;
+        int retVal = ioctl(IspFd, VIDIOC_DQBUF, &buf);
+        if (retVal != 0 && errno != EAGAIN)
+        {
+            printf("VIDIOC_DQBUF: %s\n", strerror(errno));
+        }
+        index = retVal == 0 ? buf.index : -1;
+    }
+    if (index < 0)
     {
-        printf("VIDIOC_DQBUF: %s\n", strerror(retVal));
+        return -1; // Nothing ready
+    }
+    SetOwner(eQN_IspCapture, index, eBO_None);
+    if (!IspInFlight.empty())
+    {
+        if ((unsigned)index < PresentTimes.size())
+        {
+            PresentTimes[index] = IspInFlight.front();
+            PresentTimes[index].IspDequeue = MonotonicNs();
+        }
+        IspInFlight.pop_front();
     }
-    return buf.index;
+    return index;
 }
 
-int SVideo::ProcessQueueV4lCapture()
+// Owner entries of different buffers may be written from the pipeline and the render thread,
+// a single entry only by the thread currently holding the buffer.
+void SVideo::SetOwner(EQueueName queue, int index, EBufferOwner owner)
 {
-    int& lastBufferIndex = QueueDesc[eQN_V4lCapture].LastBufferIndex;
-    int index = DeQueueV4lCapture();
-    if (lastBufferIndex >= 0)
+    std::vector<EBufferOwner>& owners = QueueDesc[queue].Owner;
+    if (index >= 0 && (unsigned)index < owners.size())
     {
-        EnQueueV4lCapture(lastBufferIndex);
+        owners[index] = owner;
+    }
+}
+
+// Move every finished capture buffer to the ISP or directly to the render thread,
+// the driver keeps filling the other ring buffers
+void SVideo::ProcessQueueV4lCapture()
+{
+    int index;
+    while ((index = DeQueueV4lCapture()) >= 0)
+    {
+        if (UseIsp())
+        {
+            EnQueueIspOutput(index);
+        }
+        else
+        {
+            // No conversion stage, the ISP stage is measured as zero
+            PresentTimes[index] = V4lTimes[index];
+            PresentTimes[index].IspEnqueue = MonotonicNs();
+            PresentTimes[index].IspDequeue = PresentTimes[index].IspEnqueue;
+            PublishFrame(index);
+        }
     }
-    lastBufferIndex = index;
-    return index;
 }
 
-void SVideo::ProcessQueueIspOutput(int index)
+// Return every source buffer consumed by the ISP to the driver
+void SVideo::ProcessQueueIspOutput()
 {
-    int& lastBufferIndex = QueueDesc[eQN_IspOutput].LastBufferIndex;
-    EnQueueIspOutput(index);
-    if (lastBufferIndex >= 0)
+    int index;
+    while ((index = DeQueueIspOutput()) >= 0)
     {
-        DeQueueIspOutput();
+        EnQueueV4lCapture(index);
     }
-    lastBufferIndex = index;
 }
 
-int SVideo::ProcessQueueIspCapture()
+// Publish every converted frame to the render thread, oldest first
+void SVideo::ProcessQueueIspCapture()
 {
-    int& lastBufferIndex = QueueDesc[eQN_IspCapture].LastBufferIndex;
-    int index = DeQueueIspCapture();
-    if (lastBufferIndex >= 0)
+    int index;
+    while ((index = DeQueueIspCapture()) >= 0)
     {
-        EnQueueIspCapture(lastBufferIndex);
+        PublishFrame(index);
+    }
+}
+
+// No device readiness, the frames queued by this iteration are converted on the pipeline thread
+// and passed on like an ISP completion
+void SVideo::ProcessSoftIsp()
+{
+    SoftIsp.Process();
+    ProcessQueueIspOutput();
+    ProcessQueueIspCapture();
+}
+
+// Hand a completed presented buffer to the render thread
+void SVideo::PublishFrame(int index)
+{
+    if (!ReadyFrames.Push(index))
+    {
+        RecycleFrame(index); // Cannot happen, the ring holds more than all buffers
+    }
+    WakeRender();
+}
+
+// Pipeline thread
+void SVideo::WakeRender()
+{
+    uint64_t wake = 1;
+    if (ReadyFd >= 0 && write(ReadyFd, &wake, sizeof(wake)) < 0)
+    {
+        printf("eventfd write: %s\n", strerror(errno));
+    }
+}
+
+// Queue a presented buffer for the next frame again
+void SVideo::RecycleFrame(int index)
+{
+    if (UseIsp())
+    {
+        EnQueueIspCapture(index);
+    }
+    else
+    {
+        EnQueueV4lCapture(index);
+    }
+}
+
+// Pending capture events, a source change is handled on the render thread
+void SVideo::ProcessEvents()
+{
+    if (Source->SourceChanged())
+    {
+        SourceChanged = true;
+        WakeRender();
     }
-    lastBufferIndex = index;
-    return index;
 }
 
-int SVideo::ProcessQueues()
+// Give the buffers the render thread is done with back to the ISP
+void SVideo::ProcessReleased()
 {
     int index;
+    while (ReleasedFrames.Pop(index))
+    {
+        RecycleFrame(index);
+    }
+}
+
+// One pipeline iteration, sleeps until a device or the render thread needs attention
+void SVideo::ProcessQueues()
+{
+    struct epoll_event events[3];
+    int count = epoll_wait(EpollFd, events, 3, -1);
+    for (int i = 0; i < count; i++)
+    {
+        if (events[i].data.fd == Source->GetFd())
+        {
+            if (events[i].events & EPOLLPRI)
+            {
+                ProcessEvents();
+            }
+            if (events[i].events & EPOLLIN)
+            {
+                ProcessQueueV4lCapture();
+            }
+        }
+        else if (events[i].data.fd == IspFd)
+        {
+            ProcessQueueIspOutput();
+            ProcessQueueIspCapture();
+        }
+        else if (events[i].data.fd == WakeFd)
+        {
+            uint64_t wake;
+            if (read(WakeFd, &wake, sizeof(wake)) < 0 && errno != EAGAIN)
+            {
+                printf("eventfd read: %s\n", strerror(errno));
+            }
+        }
+    }
+    if (count < 0 && errno != EINTR)
+    {
+        printf("epoll_wait: %s\n", strerror(errno));
+    }
+    ProcessReleased();
+    if (SoftIspActive)
+    {
+        ProcessSoftIsp();
+    }
+}
 
-    index = ProcessQueueV4lCapture();
-    ProcessQueueIspOutput(index);
-    index = ProcessQueueIspCapture();
+// Pipeline thread, keeps the kernel ioctl latency off the render thread
+void SVideo::PipelineLoop()
+{
+    while (PipelineRun)
+    {
+        ProcessQueues();
+    }
+}
 
+// Render thread. Next completed frame, -1 if there is none.
+int SVideo::AcquireFrame()
+{
+    int index;
+    if (!ReadyFrames.Pop(index))
+    {
+        return -1;
+    }
+    if (PresentMode == ePM_Mailbox)
+    {
+        // Latest frame wins, skipped buffers are queued again right away
+        int newer;
+        while (ReadyFrames.Pop(newer))
+        {
+            ReleaseFrame(index);
+            index = newer;
+        }
+    }
     return index;
 }
 
-// Cyclic called from main.
-void SVideo::FrameProcessing()
+// Render thread. Hand a drawn frame back to the pipeline thread.
+void SVideo::ReleaseFrame(int index)
+{
+    SetOwner(PresentQueue(), index, eBO_None);
+    if (ReleasedFrames.Push(index))
+    {
+        uint64_t wake = 1;
+        if (write(WakeFd, &wake, sizeof(wake)) < 0)
+        {
+            printf("eventfd write: %s\n", strerror(errno));
+        }
+    }
+}
+
+// Render thread. Replaced buffers go back to the pipeline once the GPU finished their last draw.
+// Fences signal in submission order, so the first unsignaled one ends the scan.
+void SVideo::ProcessFences()
+{
+    while (!Retired.empty())
+    {
+        int index = Retired.front();
+        if (Fence[index] != nullptr)
+        {
+            if (!IsFenceSignaled(Fence[index]))
+            {
+                break;
+            }
+            DeleteFence(Fence[index]);
+            Fence[index] = nullptr;
+        }
+        Retired.pop_front();
+        ReleaseFrame(index);
+    }
+}
+
+// Cyclic called from main on the render thread. Returns immediately, true if a new frame is selected.
+// Without a new frame the texture of the last good frame stays bound.
+bool SVideo::FrameProcessing()
+{
+    uint64_t wakes;
+    if (ReadyFd >= 0 && read(ReadyFd, &wakes, sizeof(wakes)) < 0 && errno != EAGAIN)
+    {
+        printf("eventfd read: %s\n", strerror(errno));
+    }
+    if (SourceChanged.exchange(false))
+    {
+        HandleSourceChange();
+        return false;
+    }
+    if (TargetResized)
+    {
+        TargetResized = false;
+        HandleTargetResize();
+        return false;
+    }
+
+    ProcessFences();
+    int index = AcquireFrame();
+    if (index < 0)
+    {
+        return false;
+    }
+
+    // The previous GPU frame waits for the fence of its last draw, the new frame is selected for drawing
+    if (GpuIndex >= 0)
+    {
+        SetOwner(PresentQueue(), GpuIndex, eBO_Fenced);
+        Retired.push_back(GpuIndex);
+    }
+    GpuIndex = index;
+    SetOwner(PresentQueue(), GpuIndex, eBO_Gpu);
+    GpuTimes = PresentTimes[index];
+
+    if (UseGpuConvert())
+    {
+        ConvertTexture(Texture[index]); // Once per new frame, repeated draws reuse the converted texture
+        GpuSelected = true;
+    }
+    else
+    {
+        GpuSelected = SelectTexture(Texture[index]); // Image indices move on after a source change reallocation
+    }
+    return true;
+}
+
+// Render thread, after the draw call of the frame. Only the first draw of a frame is measured.
+void SVideo::FrameSubmitted()
+{
+    if (GpuIndex >= 0 && GpuSelected) // Never shown, released without a fence
+    {
+        // The newest fence covers every earlier draw of the same buffer
+        if (Fence[GpuIndex] != nullptr)
+        {
+            DeleteFence(Fence[GpuIndex]);
+        }
+        Fence[GpuIndex] = InsertFence();
+    }
+    if (GpuTimes.IspDequeue != 0 && GpuTimes.DrawSubmit == 0)
+    {
+        GpuTimes.DrawSubmit = MonotonicNs();
+    }
+}
+
+// Render thread, after the buffer swap returned
+void SVideo::FramePresented()
+{
+    if (GpuTimes.DrawSubmit != 0 && GpuTimes.SwapReturn == 0)
+    {
+        GpuTimes.SwapReturn = MonotonicNs();
+        const tstFrameTimes& t = GpuTimes;
+        if (t.Capture != 0 && t.Capture <= t.IspEnqueue)
+        {
+            Latency[eLS_CaptureToIsp].Record(t.IspEnqueue - t.Capture);
+            Latency[eLS_Total].Record(t.SwapReturn - t.Capture);
+        }
+        Latency[eLS_Isp].Record(t.IspDequeue - t.IspEnqueue);
+        Latency[eLS_IspToDraw].Record(t.DrawSubmit - t.IspDequeue);
+        Latency[eLS_DrawToSwap].Record(t.SwapReturn - t.DrawSubmit);
+    }
+}
+
+int SVideo::GetReadyFd() const
+{
+    return ReadyFd;
+}
+
+// Render thread, percentiles of every stage of the presented frames
+void SVideo::PrintLatency() const
 {
-    int index = ProcessQueues();
-    SelectTexture(index);
+    static const char* stageName[eLS_Last] = { "capture->isp", "isp", "isp->draw", "draw->swap", "capture->swap" };
+    for (int i = 0; i < eLS_Last; i++)
+    {
+        Latency[i].Print(stageName[i]);
+    }
 }
@@ -1,20 +1,66 @@
 #pragma once
 
+#include <atomic>
+#include <deque>
+#include <memory>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include "capture.h"
+#include "formatchain.h"
+#include "latency.h"
+#include "softisp.h"
+#include "spscring.h"
+
 class SVideo
 {
 public:
-    SVideo();
+    // Which converted frame the render thread picks up
+    enum EPresentMode
+    {
+        ePM_Fifo, // Every frame in order, for recording style consumers
+        ePM_Mailbox, // Newest frame only, older ones go straight back to the ISP. Lowest latency.
+    };
+
+    // How the captured frames reach the GPU
+    enum ECaptureMode
+    {
+        eCM_Rgb24Isp, // RGB24 capture, converted to BGR32 by the ISP
+        eCM_UyvyIsp, // UYVY capture, converted to BGR32 by the ISP. Needs the hardware ISP.
+        eCM_UyvyDirect, // UYVY capture imported as YUV EGL image, no ISP. Allows 1080p50/60 on 2 CSI-2 lanes.
+        eCM_Rgb24Gpu, // RGB24 capture converted by a GLES 3.1 compute shader instead of the ISP
+        eCM_UyvyGpu, // UYVY capture converted by a GLES 3.1 compute shader
+    };
+
+    SVideo(unsigned dmaBuffers = 4, EPresentMode presentMode = ePM_Fifo, ECaptureMode captureMode = eCM_Rgb24Isp);
+    void SetCaptureSource(SCaptureSource* source);
+    // Before Probe(). The capture mode follows the cheapest chain of the probed formats at the source
+    // size, see SFormatChain. display: what presents the frames, the capture and ISP formats are filled
+    // in by Probe(). A source change to another size prices the chains again.
+    void SetFormatChain(const SFormatChain* formatChain, const SFormatChain::tstCaps& display);
+    // Render thread, before Start(): what the display really takes, e.g. the live EGL import formats
+    // where Probe() had to assume a list. Start() switches the chain if another one is cheaper now.
+    void SetDisplayFormats(const std::vector<uint32_t>& formats);
     bool Create();
+    bool Probe();
+    bool Start();
     void Destroy();
+    ECaptureMode GetCaptureMode() const; // Negotiated after Probe()
+    unsigned GetPresentFourcc() const; // DRM fourcc of the presented buffers, 0 for the compute target
+    void SetTargetSize(unsigned width, unsigned height);
 
-    void FrameProcessing();
+    bool FrameProcessing();
+    void FrameSubmitted();
+    void FramePresented();
+    void PrintLatency() const;
+    int GetReadyFd() const; // Readable once FrameProcessing() has a frame or a source change, for loops without vsync
 
 protected:
 
 private:
+    static const unsigned MaxDmaBuffers = 32; // VIDEO_MAX_FRAME
+
     enum EQueueName
     {
         eQN_V4lCapture,
@@ -23,44 +69,142 @@ private:
         eQN_Last
     };
 
+    // Stage which currently owns a buffer of a queue
+    enum EBufferOwner
+    {
+        eBO_None, // Dequeued, held by SVideo between two stages
+        eBO_Driver, // Queued to the V4L capture driver
+        eBO_Isp, // Queued to the ISP (output or capture queue)
+        eBO_Gpu, // Texture selected for the frame being drawn
+        eBO_Fenced, // Replaced by a newer frame, waits for the fence of its last draw
+    };
+
+    // Latency stages between the per frame timestamps
+    enum ELatencyStage
+    {
+        eLS_CaptureToIsp, // Driver timestamp to ISP enqueue
+        eLS_Isp, // ISP enqueue to ISP dequeue
+        eLS_IspToDraw, // ISP dequeue to GL draw submit
+        eLS_DrawToSwap, // GL draw submit to swap return
+        eLS_Total, // Driver timestamp to swap return
+        eLS_Last
+    };
+
+    // CLOCK_MONOTONIC in ns of one frame passing the pipeline, 0 if not reached
+    struct tstFrameTimes
+    {
+        uint64_t Capture; // Driver timestamp
+        uint64_t IspEnqueue;
+        uint64_t IspDequeue;
+        uint64_t DrawSubmit;
+        uint64_t SwapReturn;
+    };
+
     struct tstQueueDesc
     {
-        tstQueueDesc(int lbi, unsigned type, unsigned memory) : LastBufferIndex(lbi), Type(type), Memory(memory)
+        tstQueueDesc(unsigned type, unsigned memory) : Owner(), Type(type), Memory(memory)
         {
         };
-        int LastBufferIndex;
+        std::vector<EBufferOwner> Owner; // Owner per buffer index, size is the allocated ring depth
         const unsigned Type;
         const unsigned Memory;
     };
 
+    bool SetupEpoll();
+    bool NegotiateChain();
+    ECaptureMode ChooseChain() const;
+    bool SwitchChain(ECaptureMode mode);
+    void StartSoftIsp();
+    bool UseIsp() const;
+    bool UseGpuConvert() const;
+    bool CaptureUyvy() const;
+    EQueueName PresentQueue() const;
+    bool StreamOn(EQueueName queue);
+    bool StreamOff(EQueueName queue);
+    void FreeQueue(EQueueName queue);
+    bool HandleSourceChange();
+    bool HandleTargetResize();
+    void IspCaptureSize(unsigned& width, unsigned& height) const;
+    void DropFrames();
+    void StartPipeline();
+    void StopPipeline();
+    void PipelineLoop();
+    bool SetupSourceTimings();
+    bool SetupFormatsAndQueues();
+    bool StreamOnAll();
     bool SetupV4lCaptureFormat();
     bool SetupIspCaptureFormat();
     bool SetupIspOutputFormat();
     bool SetupV4lCaptureQueue();
     bool SetupIspOutputQueue();
     bool SetupIspCaptureQueue();
-    void ListFormats(int fd, std::string devStr, unsigned int type, std::string fmtStr);
+    bool CreateImages();
     void EnQueueV4lCapture(int index);
     int DeQueueV4lCapture();
     void EnQueueIspOutput(int index);
     int DeQueueIspOutput();
     void EnQueueIspCapture(int index);
     int DeQueueIspCapture();
-    int ProcessQueues();
-    int ProcessQueueV4lCapture();
-    void ProcessQueueIspOutput(int index);
-    int ProcessQueueIspCapture();
+    void ProcessQueues();
+    void ProcessQueueV4lCapture();
+    void ProcessQueueIspOutput();
+    void ProcessQueueIspCapture();
+    void ProcessSoftIsp();
+    void ProcessEvents();
+    void PublishFrame(int index);
+    void RecycleFrame(int index);
+    void ProcessReleased();
+    int AcquireFrame();
+    void ReleaseFrame(int index);
+    void WakeRender();
+    void ProcessFences();
+    void SetOwner(EQueueName queue, int index, EBufferOwner owner);
 
-    int V4lFd;
+    std::unique_ptr<SCaptureSource> Source; // Fills the V4L capture queue
     int IspFd;
+    SDeviceCaps IspCaps; // Formats and buffer lengths of IspFd from the last run
+    bool SoftIspActive; // IspFd could not be opened, SoftIsp takes both ISP queues
+    SSoftIsp SoftIsp;
+    int EpollFd; // Readiness of the capture source, IspFd and WakeFd
+    int WakeFd; // eventfd, wakes the pipeline thread for released buffers and stop
+    int ReadyFd; // eventfd, wakes the render thread for published frames and source changes
     unsigned SourceWidth;
     unsigned SourceHeight;
     unsigned DmaBuffers; // Finally requested DMA buffers for each queue
+    const EPresentMode PresentMode;
+    ECaptureMode CaptureMode; // Replaced by the negotiated chain in Probe()
+    const SFormatChain* FormatChain; // nullptr keeps CaptureMode
+    SFormatChain::tstCaps ChainCaps; // Display caps set before Probe() and the probed formats
+    std::vector<uint32_t> DisplayFormats; // From SetDisplayFormats(), render thread
+    bool DisplayFormatsSet;
+    unsigned V4lBytesPerLine;
+    unsigned TargetWidth; // Framebuffer size, 0 for the source size
+    unsigned TargetHeight;
+    unsigned IspWidth; // Negotiated ISP capture size
+    unsigned IspHeight;
+    unsigned IspBytesPerLine;
+    bool YuvBt709; // Colorimetry of a YUV capture, BT.601 otherwise
+    bool YuvFullRange; // Quantization of a YUV capture, limited range otherwise
     unsigned IspOutputBufferSize;
     std::vector<tstQueueDesc> QueueDesc;
-    std::string V4lName;
     std::string IspName;
     std::vector<int> V4lDmaFd; // DMA file descriptor associated to buffer index
+    std::vector<unsigned> V4lLength; // Buffer size per index, for the compute shader import
     std::vector<int> IspDmaFd; // DMA file descriptor associated to buffer index
-    std::vector<unsigned> Texture; // Texture name index of the created image
+    std::vector<unsigned> Texture; // Id of the created image (import cache, KMS buffer or compute source), per presented buffer
+    std::vector<tstFrameTimes> V4lTimes; // Per V4L capture buffer, pipeline thread only
+    std::deque<tstFrameTimes> IspInFlight; // Frames queued to the ISP, oldest first, pipeline thread only
+    std::vector<tstFrameTimes> PresentTimes; // Per presented buffer, handed over with the buffer
+    tstFrameTimes GpuTimes; // Frame selected for drawing, render thread only
+    SLatencyHistogram Latency[eLS_Last]; // Render thread only
+    int GpuIndex; // Presented buffer drawn in the current frame, render thread only
+    bool GpuSelected; // GpuIndex is bound or shown, false after a failed KMS commit. Render thread only.
+    std::vector<void*> Fence; // GL fence after the last draw sampling a presented buffer, render thread only
+    std::deque<int> Retired; // Replaced presented buffers waiting for their fence, oldest first, render thread only
+    SSpscRing<int, 2 * MaxDmaBuffers> ReadyFrames; // Completed presented buffers, pipeline -> render thread
+    SSpscRing<int, 2 * MaxDmaBuffers> ReleasedFrames; // Drawn presented buffers, render -> pipeline thread
+    std::atomic<bool> SourceChanged; // Set by the pipeline thread, handled by the render thread
+    bool TargetResized; // Render thread only
+    std::atomic<bool> PipelineRun;
+    std::thread PipelineThread; // Capture dequeue, ISP enqueue/dequeue and buffer recycling
 };